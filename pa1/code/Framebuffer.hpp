@@ -0,0 +1,178 @@
+//
+// Tiled framebuffer storage for the rasterizer.
+//
+
+#ifndef RASTERIZER_FRAMEBUFFER_H
+#define RASTERIZER_FRAMEBUFFER_H
+
+#include <eigen3/Eigen/Eigen>
+#include <algorithm>
+#include <cstdint>
+#include <vector>
+
+namespace rst
+{
+    /*
+     * Pixels are stored in 8x8 tiles, the tiles in row-major order and the pixels of a tile in
+     * Z-order (Morton). A triangle touches a 2D neighborhood, which this way sits in a few cache
+     * lines instead of one line per row. Coordinates are the rasterizer's, with y pointing up.
+     */
+    class tiled_layout
+    {
+    public:
+        static constexpr int tile_bits = 3;
+        static constexpr int tile_size = 1 << tile_bits;
+        static constexpr int tile_pixels = tile_size * tile_size;
+
+        tiled_layout() = default;
+
+        tiled_layout(int w, int h) : width(w), height(h)
+        {
+            int tiles_x = (w + tile_size - 1) / tile_size;
+            int tiles_y = (h + tile_size - 1) / tile_size;
+            num_pixels = tiles_x * tiles_y * tile_pixels;
+
+            // index(x, y) = x_offset[x] + y_offset[y], the interleaving is done once up front
+            x_offset.resize(w);
+            for (int x = 0; x < w; ++x)
+                x_offset[x] = (x >> tile_bits) * tile_pixels + spread_bits(x & (tile_size - 1));
+            y_offset.resize(h);
+            for (int y = 0; y < h; ++y)
+                y_offset[y] = (y >> tile_bits) * tiles_x * tile_pixels + (spread_bits(y & (tile_size - 1)) << 1);
+        }
+
+        int index(int x, int y) const { return x_offset[x] + y_offset[y]; }
+
+        // Number of storage slots, padded to whole tiles
+        int size() const { return num_pixels; }
+
+        int width = 0, height = 0;
+
+    private:
+        // 0b abc -> 0b 0a0b0c
+        static int spread_bits(int v)
+        {
+            int r = 0;
+            for (int i = 0; i < tile_bits; ++i)
+                r |= ((v >> i) & 1) << (2 * i);
+            return r;
+        }
+
+        int num_pixels = 0;
+        std::vector<int> x_offset;
+        std::vector<int> y_offset;
+    };
+
+    enum class ColorFormat
+    {
+        RGB32F,   // three floats, exact
+        RGBA16F,  // four halves, half the bandwidth and still HDR
+        RGBA8     // packed 8 bit, values are clamped to [0, 255]
+    };
+
+    // Color storage in one of the formats above. Colors go in and out as floats in [0, 255].
+    class color_buffer
+    {
+    public:
+        color_buffer(ColorFormat fmt = ColorFormat::RGB32F) : format(fmt) {}
+
+        ColorFormat get_format() const { return format; }
+
+        void resize(size_t n)
+        {
+            switch (format)
+            {
+                case ColorFormat::RGB32F: rgb32f.resize(n); break;
+                case ColorFormat::RGBA16F: rgba16f.resize(n); break;
+                case ColorFormat::RGBA8: rgba8.resize(n); break;
+            }
+        }
+
+        size_t size() const
+        {
+            switch (format)
+            {
+                case ColorFormat::RGB32F: return rgb32f.size();
+                case ColorFormat::RGBA16F: return rgba16f.size();
+                case ColorFormat::RGBA8: return rgba8.size();
+            }
+            return 0;
+        }
+
+        void fill(const Eigen::Vector3f& color)
+        {
+            switch (format)
+            {
+                case ColorFormat::RGB32F: std::fill(rgb32f.begin(), rgb32f.end(), color); break;
+                case ColorFormat::RGBA16F: std::fill(rgba16f.begin(), rgba16f.end(), pack_half(color)); break;
+                case ColorFormat::RGBA8: std::fill(rgba8.begin(), rgba8.end(), pack_rgba8(color)); break;
+            }
+        }
+
+        void set(size_t i, const Eigen::Vector3f& color)
+        {
+            switch (format)
+            {
+                case ColorFormat::RGB32F: rgb32f[i] = color; break;
+                case ColorFormat::RGBA16F: rgba16f[i] = pack_half(color); break;
+                case ColorFormat::RGBA8: rgba8[i] = pack_rgba8(color); break;
+            }
+        }
+
+        Eigen::Vector3f get(size_t i) const
+        {
+            switch (format)
+            {
+                case ColorFormat::RGB32F: return rgb32f[i];
+                case ColorFormat::RGBA16F: return unpack_half(rgba16f[i]);
+                case ColorFormat::RGBA8: return unpack_rgba8(rgba8[i]);
+            }
+            return Eigen::Vector3f::Zero();
+        }
+
+        size_t bytes_per_pixel() const
+        {
+            switch (format)
+            {
+                case ColorFormat::RGB32F: return sizeof(Eigen::Vector3f);
+                case ColorFormat::RGBA16F: return sizeof(half4);
+                case ColorFormat::RGBA8: return sizeof(uint32_t);
+            }
+            return 0;
+        }
+
+    private:
+        struct half4
+        {
+            Eigen::half c[4];
+        };
+
+        static half4 pack_half(const Eigen::Vector3f& color)
+        {
+            return {{Eigen::half(color.x()), Eigen::half(color.y()), Eigen::half(color.z()), Eigen::half(1.0f)}};
+        }
+
+        static Eigen::Vector3f unpack_half(const half4& h)
+        {
+            return {float(h.c[0]), float(h.c[1]), float(h.c[2])};
+        }
+
+        static uint32_t pack_rgba8(const Eigen::Vector3f& color)
+        {
+            auto channel = [](float v) { return uint32_t(std::clamp(v, 0.0f, 255.0f) + 0.5f); };
+            return channel(color.x()) | channel(color.y()) << 8 | channel(color.z()) << 16 | 0xffu << 24;
+        }
+
+        static Eigen::Vector3f unpack_rgba8(uint32_t c)
+        {
+            return {float(c & 0xff), float((c >> 8) & 0xff), float((c >> 16) & 0xff)};
+        }
+
+        ColorFormat format;
+        std::vector<Eigen::Vector3f> rgb32f;
+        std::vector<half4> rgba16f;
+        std::vector<uint32_t> rgba8;
+    };
+}
+
+#endif //RASTERIZER_FRAMEBUFFER_H
@@ -0,0 +1,178 @@
+//
+// Wireframe rendering: unique edges of a mesh and the line drawing they go through.
+//
+
+#include "Wireframe.hpp"
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+#include <thread>
+
+static size_t max_workers()
+{
+    return std::clamp<size_t>(std::thread::hardware_concurrency(), 1, 16);
+}
+
+void rst::parallel_for(size_t count, size_t min_per_thread, const std::function<void(size_t, size_t)>& body)
+{
+    size_t num_threads = std::min(max_workers(), std::max<size_t>(1, count / std::max<size_t>(1, min_per_thread)));
+    std::vector<std::thread> workers;
+    for (size_t t = 1; t < num_threads; ++t)
+    {
+        workers.emplace_back(body, count * t / num_threads, count * (t + 1) / num_threads);
+    }
+    body(0, count / num_threads);
+    for (auto& w : workers)
+    {
+        w.join();
+    }
+}
+
+rst::edge_list rst::build_edge_list(const std::vector<Eigen::Vector3i>& indices)
+{
+    // Every triangle edge as (lower vertex, higher vertex) next to where it came from; sorting
+    // brings the copies of a shared edge together
+    std::vector<std::pair<uint64_t, int>> keys;
+    keys.reserve(indices.size() * 3);
+    const int corners[][2] = {{2, 0}, {2, 1}, {1, 0}};
+    for (size_t t = 0; t < indices.size(); ++t)
+    {
+        for (int k = 0; k < 3; ++k)
+        {
+            uint32_t a = uint32_t(indices[t][corners[k][0]]);
+            uint32_t b = uint32_t(indices[t][corners[k][1]]);
+            keys.emplace_back(uint64_t(std::min(a, b)) << 32 | std::max(a, b), int(t * 3 + k));
+        }
+    }
+    std::sort(keys.begin(), keys.end());
+
+    edge_list list;
+    list.triangle_edges.resize(indices.size());
+    for (size_t i = 0; i < keys.size(); ++i)
+    {
+        if (i == 0 || keys[i].first != keys[i - 1].first)
+        {
+            list.edges.emplace_back(int(keys[i].first >> 32), int(keys[i].first & 0xffffffffu));
+        }
+        int slot = keys[i].second;
+        list.triangle_edges[slot / 3][slot % 3] = int(list.edges.size()) - 1;
+    }
+    return list;
+}
+
+// Walks the pixels of one segment that lie in rows [y_lo, y_hi], calling plot(x, y, coverage).
+// Pixel (x, y) covers [x, x + 1) x [y, y + 1); the line is sampled at the centers along its major axis.
+template <typename Plot>
+static void walk_segment(Eigen::Vector2f a, Eigen::Vector2f b, int y_lo, int y_hi, bool anti_aliased, Plot plot)
+{
+    float dx = b.x() - a.x();
+    float dy = b.y() - a.y();
+
+    if (std::abs(dx) >= std::abs(dy))
+    {
+        if (dx < 0)
+        {
+            std::swap(a, b);
+            dx = -dx;
+            dy = -dy;
+        }
+        float slope = dx > 0 ? dy / dx : 0.0f;
+        int x_first = int(std::floor(a.x()));
+        int x_last = int(std::floor(b.x()));
+
+        // Only the columns whose row can land in the band
+        if (slope != 0)
+        {
+            float x0 = a.x() + (float(y_lo - 1) - a.y()) / slope - 0.5f;
+            float x1 = a.x() + (float(y_hi + 2) - a.y()) / slope - 0.5f;
+            x_first = std::max(x_first, int(std::floor(std::min(x0, x1))));
+            x_last = std::min(x_last, int(std::ceil(std::max(x0, x1))));
+        }
+
+        for (int x = x_first; x <= x_last; ++x)
+        {
+            // Evaluated per column rather than stepped, so a band does not depend on where it starts
+            float y = a.y() + (float(x) + 0.5f - a.x()) * slope;
+            if (anti_aliased)
+            {
+                float center = y - 0.5f;
+                int row = int(std::floor(center));
+                float f = center - float(row);
+                plot(x, row, 1.0f - f);
+                plot(x, row + 1, f);
+            }
+            else
+            {
+                plot(x, int(std::floor(y)), 1.0f);
+            }
+        }
+    }
+    else
+    {
+        if (dy < 0)
+        {
+            std::swap(a, b);
+            dx = -dx;
+            dy = -dy;
+        }
+        float slope = dx / dy;
+        int y_first = std::max(y_lo, int(std::floor(a.y())));
+        int y_last = std::min(y_hi, int(std::floor(b.y())));
+
+        for (int y = y_first; y <= y_last; ++y)
+        {
+            float x = a.x() + (float(y) + 0.5f - a.y()) * slope;
+            if (anti_aliased)
+            {
+                float center = x - 0.5f;
+                int column = int(std::floor(center));
+                float f = center - float(column);
+                plot(column, y, 1.0f - f);
+                plot(column + 1, y, f);
+            }
+            else
+            {
+                plot(int(std::floor(x)), y, 1.0f);
+            }
+        }
+    }
+}
+
+void rst::draw_segments(const std::vector<line_segment>& segments, LineMode mode, const Eigen::Vector3f& color,
+                        const tiled_layout& layout, color_buffer& buffer)
+{
+    const int width = layout.width;
+    const int height = layout.height;
+    const bool anti_aliased = mode == LineMode::AntiAliased;
+
+    // Bands are whole tile rows, which are contiguous in the tiled layout
+    int tile_rows = (height + tiled_layout::tile_size - 1) / tiled_layout::tile_size;
+    size_t num_bands = std::min({max_workers(), std::max<size_t>(1, segments.size() / 256), size_t(tile_rows)});
+    int band_tiles = int((size_t(tile_rows) + num_bands - 1) / num_bands);
+
+    auto draw_band = [&](size_t first_band, size_t end_band) {
+        for (size_t band = first_band; band < end_band; ++band)
+        {
+            int y_lo = int(band) * band_tiles * tiled_layout::tile_size;
+            int y_hi = std::min(height, y_lo + band_tiles * tiled_layout::tile_size) - 1;
+
+            auto plot = [&](int x, int y, float coverage) {
+                if (x < 0 || x >= width || y < y_lo || y > y_hi || coverage <= 0)
+                    return;
+                int i = layout.index(x, y);
+                if (anti_aliased)
+                    buffer.set(i, buffer.get(i).cwiseMax(coverage * color));
+                else
+                    buffer.set(i, color);
+            };
+
+            for (auto& s : segments)
+            {
+                if (std::max(s.a.y(), s.b.y()) < float(y_lo - 1) || std::min(s.a.y(), s.b.y()) > float(y_hi + 2))
+                    continue;
+                walk_segment(s.a, s.b, y_lo, y_hi, anti_aliased, plot);
+            }
+        }
+    };
+    parallel_for(num_bands, 1, draw_band);
+}
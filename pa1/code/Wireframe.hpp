@@ -0,0 +1,54 @@
+//
+// Wireframe rendering: unique edges of a mesh and the line drawing they go through.
+//
+
+#ifndef RASTERIZER_WIREFRAME_H
+#define RASTERIZER_WIREFRAME_H
+
+#include "Framebuffer.hpp"
+#include <eigen3/Eigen/Eigen>
+#include <array>
+#include <functional>
+#include <vector>
+
+namespace rst
+{
+    enum class LineMode
+    {
+        Aliased,     // one pixel per step of the major axis
+        AntiAliased  // Xiaolin Wu: two pixels per step, weighted by their distance to the line
+    };
+
+    /*
+     * Every edge of an index buffer once, however many triangles share it. Built once per index
+     * buffer; a frame only has to mark which edges belong to a triangle that survived culling.
+     */
+    struct edge_list
+    {
+        std::vector<Eigen::Vector2i> edges;           // vertex indices, lower one first
+        std::vector<std::array<int, 3>> triangle_edges; // per triangle, its edges (c, a), (c, b), (b, a)
+    };
+
+    edge_list build_edge_list(const std::vector<Eigen::Vector3i>& indices);
+
+    // Screen space segment, already clipped to the viewport
+    struct line_segment
+    {
+        Eigen::Vector2f a, b;
+    };
+
+    /*
+     * Draws the segments straight into the tiled color buffer. The buffer is split into bands of
+     * whole tile rows, one per thread, and each thread draws the part of every segment that falls
+     * into its band, so no two threads ever write the same pixel. Anti-aliased pixels keep the
+     * brighter of their old color and the line's, so crossing lines do not darken each other.
+     */
+    void draw_segments(const std::vector<line_segment>& segments, LineMode mode, const Eigen::Vector3f& color,
+                       const tiled_layout& layout, color_buffer& buffer);
+
+    // Calls body(begin, end) on contiguous slices of [0, count) from up to one thread per core,
+    // using fewer threads when a slice would hold less than min_per_thread items
+    void parallel_for(size_t count, size_t min_per_thread, const std::function<void(size_t, size_t)>& body);
+}
+
+#endif //RASTERIZER_WIREFRAME_H
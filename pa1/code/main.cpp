@@ -133,6 +133,10 @@ int main(int argc, const char** argv)
         else if (key == 'd') {
             angle -= 10;
         }
+        else if (key == 'l') {
+            r.set_line_mode(r.get_line_mode() == rst::LineMode::Aliased ? rst::LineMode::AntiAliased
+                                                                         : rst::LineMode::Aliased);
+        }
     }
 
     return 0;
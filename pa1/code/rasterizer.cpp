@@ -9,127 +9,66 @@
 #include <stdexcept>
 
 
-rst::pos_buf_id rst::rasterizer::load_positions(const std::vector<Eigen::Vector3f> &positions)
+rst::pos_buf_id rst::rasterizer::load_positions(std::vector<Eigen::Vector3f> positions)
 {
-    auto id = get_next_id();
-    pos_buf.emplace(id, positions);
-
-    return {id};
+    return pos_buf.create(std::move(positions));
 }
 
-rst::ind_buf_id rst::rasterizer::load_indices(const std::vector<Eigen::Vector3i> &indices)
+rst::ind_buf_id rst::rasterizer::load_indices(std::vector<Eigen::Vector3i> indices)
 {
-    auto id = get_next_id();
-    ind_buf.emplace(id, indices);
-
-    return {id};
+    return ind_buf.create(std::move(indices));
 }
 
-// Bresenham's line drawing algorithm
-// Code taken from a stack overflow answer: https://stackoverflow.com/a/16405254
-void rst::rasterizer::draw_line(Eigen::Vector3f begin, Eigen::Vector3f end)
+auto to_vec4(const Eigen::Vector3f& v3, float w = 1.0f)
 {
-    auto x1 = begin.x();
-    auto y1 = begin.y();
-    auto x2 = end.x();
-    auto y2 = end.y();
-
-    Eigen::Vector3f line_color = {255, 255, 255};
+    return Vector4f(v3.x(), v3.y(), v3.z(), w);
+}
 
-    int x,y,dx,dy,dx1,dy1,px,py,xe,ye,i;
+// Clips the clip-space segment [a, b] against the near plane z >= -w.
+// Returns false when the whole segment lies behind it.
+static bool clip_near(Eigen::Vector4f& a, Eigen::Vector4f& b)
+{
+    float da = a.z() + a.w();
+    float db = b.z() + b.w();
+    if (da < 0 && db < 0)
+        return false;
+    if (da < 0)
+        a = a + da / (da - db) * (b - a);
+    else if (db < 0)
+        b = b + db / (db - da) * (a - b);
+    return true;
+}
 
-    dx=x2-x1;
-    dy=y2-y1;
-    dx1=fabs(dx);
-    dy1=fabs(dy);
-    px=2*dy1-dx1;
-    py=2*dx1-dy1;
+// Liang-Barsky clipping of a screen-space segment against [x_min, x_max] x [y_min, y_max].
+// Returns false when nothing of the segment is left.
+static bool clip_rect(Eigen::Vector3f& a, Eigen::Vector3f& b, float x_min, float x_max, float y_min, float y_max)
+{
+    Eigen::Vector3f d = b - a;
+    float p[] = {-d.x(), d.x(), -d.y(), d.y()};
+    float q[] = {a.x() - x_min, x_max - a.x(), a.y() - y_min, y_max - a.y()};
+    float t0 = 0.0f, t1 = 1.0f;
 
-    if(dy1<=dx1)
-    {
-        if(dx>=0)
-        {
-            x=x1;
-            y=y1;
-            xe=x2;
-        }
-        else
-        {
-            x=x2;
-            y=y2;
-            xe=x1;
-        }
-        Eigen::Vector3f point = Eigen::Vector3f(x, y, 1.0f);
-        set_pixel(point,line_color);
-        for(i=0;x<xe;i++)
-        {
-            x=x+1;
-            if(px<0)
-            {
-                px=px+2*dy1;
-            }
-            else
-            {
-                if((dx<0 && dy<0) || (dx>0 && dy>0))
-                {
-                    y=y+1;
-                }
-                else
-                {
-                    y=y-1;
-                }
-                px=px+2*(dy1-dx1);
-            }
-//            delay(0);
-            Eigen::Vector3f point = Eigen::Vector3f(x, y, 1.0f);
-            set_pixel(point,line_color);
-        }
-    }
-    else
+    for (int i = 0; i < 4; ++i)
     {
-        if(dy>=0)
+        if (p[i] == 0)
         {
-            x=x1;
-            y=y1;
-            ye=y2;
+            if (q[i] < 0)
+                return false;
+            continue;
         }
+        float t = q[i] / p[i];
+        if (p[i] < 0)
+            t0 = std::max(t0, t);
         else
-        {
-            x=x2;
-            y=y2;
-            ye=y1;
-        }
-        Eigen::Vector3f point = Eigen::Vector3f(x, y, 1.0f);
-        set_pixel(point,line_color);
-        for(i=0;y<ye;i++)
-        {
-            y=y+1;
-            if(py<=0)
-            {
-                py=py+2*dx1;
-            }
-            else
-            {
-                if((dx<0 && dy<0) || (dx>0 && dy>0))
-                {
-                    x=x+1;
-                }
-                else
-                {
-                    x=x-1;
-                }
-                py=py+2*(dx1-dy1);
-            }
-//            delay(0);
-            Eigen::Vector3f point = Eigen::Vector3f(x, y, 1.0f);
-            set_pixel(point,line_color);
-        }
+            t1 = std::min(t1, t);
+        if (t0 > t1)
+            return false;
     }
-}
 
-auto to_vec4(const Eigen::Vector3f& v3, float w = 1.0f)
-{
-    return Vector4f(v3.x(), v3.y(), v3.z(), w);
+    Eigen::Vector3f start = a;
+    a = start + t0 * d;
+    b = start + t1 * d;
+    return true;
 }
 
 void rst::rasterizer::draw(rst::pos_buf_id pos_buffer, rst::ind_buf_id ind_buffer, rst::Primitive type)
@@ -138,54 +77,124 @@ void rst::rasterizer::draw(rst::pos_buf_id pos_buffer, rst::ind_buf_id ind_buffe
     {
         throw std::runtime_error("Drawing primitives other than triangle is not implemented yet!");
     }
-    auto& buf = pos_buf[pos_buffer.pos_id];
-    auto& ind = ind_buf[ind_buffer.ind_id];
+    auto& buf = pos_buf.get(pos_buffer);
+    auto& ind = ind_buf.get(ind_buffer);
+
+    if (int(edge_buf.size()) <= ind_buffer.slot)
+    {
+        edge_buf.resize(ind_buffer.slot + 1);
+    }
+    cached_edges& cached = edge_buf[ind_buffer.slot];
+    uint64_t version = ind_buf.version(ind_buffer);
+    // Writes through a mapped buffer do not move its version until it is unmapped
+    if (cached.generation != ind_buffer.generation || cached.version != version ||
+        ind_buf.mapped(ind_buffer))
+    {
+        cached.edges = build_edge_list(ind);
+        cached.generation = ind_buffer.generation;
+        cached.version = version;
+    }
+    const edge_list& edges = cached.edges;
 
     float f1 = (100 - 0.1) / 2.0;
     float f2 = (100 + 0.1) / 2.0;
 
+    auto to_screen = [&](const Eigen::Vector4f& clip) {
+        Eigen::Vector4f vert = clip / clip.w();
+        vert.x() = 0.5*width*(vert.x()+1.0);
+        vert.y() = 0.5*height*(vert.y()+1.0);
+        vert.z() = vert.z() * f1 + f2;
+        return Eigen::Vector3f(vert.head<3>());
+    };
+
+    // Shared vertices are transformed once, not once per triangle
     Eigen::Matrix4f mvp = projection * view * model;
-    for (auto& i : ind)
+    clip_pos.resize(buf.size());
+    for (size_t i = 0; i < buf.size(); ++i)
     {
-        Triangle t;
+        clip_pos[i] = mvp * to_vec4(buf[i], 1.0f);
+    }
 
-        Eigen::Vector4f v[] = {
-                mvp * to_vec4(buf[i[0]], 1.0f),
-                mvp * to_vec4(buf[i[1]], 1.0f),
-                mvp * to_vec4(buf[i[2]], 1.0f)
-        };
+    // Culling works on triangles, an edge is drawn when any of its triangles survives
+    edge_visible.assign(edges.edges.size(), 0);
+    for (size_t t = 0; t < ind.size(); ++t)
+    {
+        auto& i = ind[t];
+        const Eigen::Vector4f v[] = {clip_pos[i[0]], clip_pos[i[1]], clip_pos[i[2]]};
 
-        for (auto& vec : v) {
-            vec /= vec.w();
-        }
+        statistics.submitted++;
 
-        for (auto & vert : v)
+        // Completely outside one of the frustum planes
+        bool outside = false;
+        for (int axis = 0; axis < 3 && !outside; ++axis)
+        {
+            outside = (v[0][axis] < -v[0].w() && v[1][axis] < -v[1].w() && v[2][axis] < -v[2].w()) ||
+                      (v[0][axis] > v[0].w() && v[1][axis] > v[1].w() && v[2][axis] > v[2].w());
+        }
+        if (outside)
         {
-            vert.x() = 0.5*width*(vert.x()+1.0);
-            vert.y() = 0.5*height*(vert.y()+1.0);
-            vert.z() = vert.z() * f1 + f2;
+            statistics.frustum_culled++;
+            continue;
         }
 
-        for (int i = 0; i < 3; ++i)
+        // The winding is only meaningful when the whole triangle is in front of the
+        // camera, triangles crossing the near plane are kept
+        if (cull_mode != CullMode::None && v[0].w() > 0 && v[1].w() > 0 && v[2].w() > 0)
         {
-            t.setVertex(i, v[i].head<3>());
-            t.setVertex(i, v[i].head<3>());
-            t.setVertex(i, v[i].head<3>());
+            Eigen::Vector3f s[] = {to_screen(v[0]), to_screen(v[1]), to_screen(v[2])};
+            float area = (s[1].x() - s[0].x()) * (s[2].y() - s[0].y()) -
+                         (s[2].x() - s[0].x()) * (s[1].y() - s[0].y());
+            if ((cull_mode == CullMode::Back && area < 0) ||
+                (cull_mode == CullMode::Front && area > 0))
+            {
+                statistics.backface_culled++;
+                continue;
+            }
         }
+        statistics.rasterized++;
 
-        t.setColor(0, 255.0,  0.0,  0.0);
-        t.setColor(1, 0.0  ,255.0,  0.0);
-        t.setColor(2, 0.0  ,  0.0,255.0);
+        for (int e : edges.triangle_edges[t])
+            edge_visible[e] = 1;
+    }
 
-        rasterize_wireframe(t);
+    // Each edge is clipped on its own, in batches over the worker threads
+    segment_slots.resize(edges.edges.size());
+    segment_valid.assign(edges.edges.size(), 0);
+    auto setup_edges = [&](size_t first, size_t last) {
+        for (size_t e = first; e < last; ++e)
+        {
+            if (!edge_visible[e])
+                continue;
+            Eigen::Vector4f a = clip_pos[edges.edges[e][0]];
+            Eigen::Vector4f b = clip_pos[edges.edges[e][1]];
+            if (!clip_near(a, b))
+                continue;
+
+            Eigen::Vector3f begin = to_screen(a);
+            Eigen::Vector3f end = to_screen(b);
+
+            // Segments inside the viewport skip 2D clipping, the rest are cut to it so that
+            // the line walk never visits pixels that are off screen
+            bool inside = begin.x() >= 0 && begin.x() <= width - 1 && begin.y() >= 0 && begin.y() <= height - 1 &&
+                          end.x() >= 0 && end.x() <= width - 1 && end.y() >= 0 && end.y() <= height - 1;
+            if (!inside && !clip_rect(begin, end, 0, width - 1, 0, height - 1))
+                continue;
+
+            segment_slots[e] = {begin.head<2>(), end.head<2>()};
+            segment_valid[e] = 1;
+        }
+    };
+    parallel_for(edges.edges.size(), 4096, setup_edges);
+
+    segments.clear();
+    for (size_t e = 0; e < segment_slots.size(); ++e)
+    {
+        if (segment_valid[e])
+            segments.push_back(segment_slots[e]);
     }
-}
+    statistics.lines += int(segments.size());
 
-void rst::rasterizer::rasterize_wireframe(const Triangle& t)
-{
-    draw_line(t.c(), t.a());
-    draw_line(t.c(), t.b());
-    draw_line(t.b(), t.a());
+    draw_segments(segments, line_mode, Eigen::Vector3f(255, 255, 255), layout, color_buf);
 }
 
 void rst::rasterizer::set_model(const Eigen::Matrix4f& m)
@@ -207,7 +216,7 @@ void rst::rasterizer::clear(rst::Buffers buff)
 {
     if ((buff & rst::Buffers::Color) == rst::Buffers::Color)
     {
-        std::fill(frame_buf.begin(), frame_buf.end(), Eigen::Vector3f{0, 0, 0});
+        color_buf.fill(Eigen::Vector3f{0, 0, 0});
     }
     if ((buff & rst::Buffers::Depth) == rst::Buffers::Depth)
     {
@@ -215,23 +224,30 @@ void rst::rasterizer::clear(rst::Buffers buff)
     }
 }
 
-rst::rasterizer::rasterizer(int w, int h) : width(w), height(h)
+rst::rasterizer::rasterizer(int w, int h, ColorFormat format)
+    : layout(w, h), color_buf(format), width(w), height(h)
 {
+    color_buf.resize(layout.size());
+    depth_buf.resize(layout.size());
     frame_buf.resize(w * h);
-    depth_buf.resize(w * h);
 }
 
-int rst::rasterizer::get_index(int x, int y)
+std::vector<Eigen::Vector3f>& rst::rasterizer::frame_buffer()
 {
-    return (height-y)*width + x;
+    for (int y = 0; y < height; ++y)
+    {
+        auto row = frame_buf.begin() + (height - 1 - y) * width;
+        for (int x = 0; x < width; ++x)
+        {
+            row[x] = color_buf.get(get_index(x, y));
+        }
+    }
+    return frame_buf;
 }
 
 void rst::rasterizer::set_pixel(const Eigen::Vector3f& point, const Eigen::Vector3f& color)
 {
-    //old index: auto ind = point.y() + point.x() * width;
     if (point.x() < 0 || point.x() >= width ||
         point.y() < 0 || point.y() >= height) return;
-    auto ind = (height-point.y())*width + point.x();
-    frame_buf[ind] = color;
+    color_buf.set(get_index(point.x(), point.y()), color);
 }
-
@@ -4,7 +4,10 @@
 
 #pragma once
 
+#include "BufferRegistry.hpp"
+#include "Framebuffer.hpp"
 #include "Triangle.hpp"
+#include "Wireframe.hpp"
 #include <algorithm>
 #include <eigen3/Eigen/Eigen>
 using namespace Eigen;
@@ -32,27 +35,51 @@ enum class Primitive
     Triangle
 };
 
+// Which screen-space winding gets discarded; counter clockwise triangles face
+// the camera
+enum class CullMode
+{
+    None,
+    Back,
+    Front
+};
+
+// Triangle counters of the culling stage, accumulated until reset_stats()
+struct pipeline_stats
+{
+    int submitted = 0;       // triangles assembled from the index buffer
+    int frustum_culled = 0;  // completely outside one frustum plane
+    int backface_culled = 0; // rejected by the cull mode
+    int rasterized = 0;      // triangles whose edges were drawn
+    int lines = 0;           // unique edges drawn, an edge shared by two triangles counts once
+
+    int culled() const { return frustum_culled + backface_culled; }
+};
+
 /*
  * For the curious : The draw function takes two buffer id's as its arguments.
  * These two structs make sure that if you mix up with their orders, the
  * compiler won't compile it. Aka : Type safety
  * */
-struct pos_buf_id
+struct pos_buf_id : buffer_handle
 {
-    int pos_id = 0;
 };
 
-struct ind_buf_id
+struct ind_buf_id : buffer_handle
 {
-    int ind_id = 0;
 };
 
 class rasterizer
 {
   public:
-    rasterizer(int w, int h);
-    pos_buf_id load_positions(const std::vector<Eigen::Vector3f>& positions);
-    ind_buf_id load_indices(const std::vector<Eigen::Vector3i>& indices);
+    rasterizer(int w, int h, ColorFormat format = ColorFormat::RGB32F);
+    // The vectors are taken by value: pass an rvalue to move the data in instead of copying it
+    pos_buf_id load_positions(std::vector<Eigen::Vector3f> positions);
+    ind_buf_id load_indices(std::vector<Eigen::Vector3i> indices);
+
+    // The buffers behind the ids, for in-place updates, mapped writes and release
+    buffer_registry<Eigen::Vector3f, pos_buf_id>& position_buffers() { return pos_buf; }
+    buffer_registry<Eigen::Vector3i, ind_buf_id>& index_buffers() { return ind_buf; }
 
     void set_model(const Eigen::Matrix4f& m);
     void set_view(const Eigen::Matrix4f& v);
@@ -60,31 +87,57 @@ class rasterizer
 
     void set_pixel(const Eigen::Vector3f& point, const Eigen::Vector3f& color);
 
+    void set_cull_mode(CullMode mode) { cull_mode = mode; }
+    void set_line_mode(LineMode mode) { line_mode = mode; }
+    LineMode get_line_mode() const { return line_mode; }
+    const pipeline_stats& stats() const { return statistics; }
+    void reset_stats() { statistics = pipeline_stats(); }
+
     void clear(Buffers buff);
 
     void draw(pos_buf_id pos_buffer, ind_buf_id ind_buffer, Primitive type);
 
-    std::vector<Eigen::Vector3f>& frame_buffer() { return frame_buf; }
-
-  private:
-    void draw_line(Eigen::Vector3f begin, Eigen::Vector3f end);
-    void rasterize_wireframe(const Triangle& t);
+    // Converts the tiled color buffer to a linear, top row first image for
+    // OpenCV
+    std::vector<Eigen::Vector3f>& frame_buffer();
 
   private:
     Eigen::Matrix4f model;
     Eigen::Matrix4f view;
     Eigen::Matrix4f projection;
 
-    std::map<int, std::vector<Eigen::Vector3f>> pos_buf;
-    std::map<int, std::vector<Eigen::Vector3i>> ind_buf;
-
-    std::vector<Eigen::Vector3f> frame_buf;
+    CullMode cull_mode = CullMode::None;
+    LineMode line_mode = LineMode::Aliased;
+    pipeline_stats statistics;
+
+    buffer_registry<Eigen::Vector3f, pos_buf_id> pos_buf;
+    buffer_registry<Eigen::Vector3i, ind_buf_id> ind_buf;
+
+    // Unique edges of an index buffer, per slot; rebuilt when the slot holds another buffer, the
+    // buffer's version moved on or the buffer is mapped
+    struct cached_edges
+    {
+        uint32_t generation = 0;
+        uint64_t version = 0;
+        edge_list edges;
+    };
+    std::vector<cached_edges> edge_buf;
+
+    // Per draw scratch, kept to avoid reallocating every frame
+    std::vector<Eigen::Vector4f> clip_pos;
+    std::vector<char> edge_visible;
+    std::vector<line_segment> segment_slots;
+    std::vector<char> segment_valid;
+    std::vector<line_segment> segments;
+
+    // Color and depth share one tiled layout; frame_buf only holds the linear
+    // copy handed out by frame_buffer()
+    tiled_layout layout;
+    color_buffer color_buf;
     std::vector<float> depth_buf;
-    int get_index(int x, int y);
+    std::vector<Eigen::Vector3f> frame_buf;
+    int get_index(int x, int y) const { return layout.index(x, y); }
 
     int width, height;
-
-    int next_id = 0;
-    int get_next_id() { return next_id++; }
 };
 } // namespace rst
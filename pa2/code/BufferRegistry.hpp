@@ -0,0 +1,165 @@
+//
+// Vertex and index buffer storage of the rasterizer.
+//
+
+#ifndef RASTERIZER_BUFFERREGISTRY_H
+#define RASTERIZER_BUFFERREGISTRY_H
+
+#include <algorithm>
+#include <cstdint>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+namespace rst
+{
+    // Slot of a buffer in its registry. Slots are reused after a release; the generation tells the
+    // buffer a handle was made for from a later one in the same slot. Generation 0 is never live,
+    // so a default constructed handle refers to nothing.
+    struct buffer_handle
+    {
+        int slot = -1;
+        uint32_t generation = 0;
+    };
+
+    /*
+     * Buffers of one element type, kept in a dense vector of slots and addressed by typed handles
+     * (Id derives from buffer_handle). Lookups are an index and a generation compare, with no tree
+     * walk and no hashing.
+     *
+     * create() takes the vector by value, so callers move their data in or pay for one copy.
+     * update() overwrites a range in place and map() hands out the storage itself; neither
+     * reallocates, so a mapped pointer stays valid until release(). The registry cannot see writes
+     * through it: version() changes on every create, update, map and unmap, so state derived from
+     * a buffer's contents is current once the writer calls unmap(), and while mapped() is true it
+     * has to be rebuilt on every use.
+     *
+     * A stale or unknown handle throws std::invalid_argument; a range past the end of a buffer
+     * throws std::out_of_range.
+     */
+    template <typename T, typename Id>
+    class buffer_registry
+    {
+    public:
+        Id create(std::vector<T> data)
+        {
+            int slot;
+            if (!free_slots.empty())
+            {
+                slot = free_slots.back();
+                free_slots.pop_back();
+            }
+            else
+            {
+                slot = int(slots.size());
+                slots.emplace_back();
+            }
+            entry& e = slots[slot];
+            e.data = std::move(data);
+            e.live = true;
+            e.version++;
+
+            Id id;
+            id.slot = slot;
+            id.generation = e.generation;
+            return id;
+        }
+
+        bool valid(Id id) const
+        {
+            return id.slot >= 0 && id.slot < int(slots.size()) && slots[id.slot].live &&
+                   slots[id.slot].generation == id.generation;
+        }
+
+        const std::vector<T>& get(Id id) const { return lookup(id).data; }
+
+        size_t size(Id id) const { return lookup(id).data.size(); }
+
+        uint64_t version(Id id) const { return lookup(id).version; }
+
+        void update(Id id, size_t first, const T* values, size_t count)
+        {
+            entry& e = lookup(id);
+            if (first > e.data.size() || count > e.data.size() - first)
+            {
+                throw std::out_of_range("buffer update of " + std::to_string(count) + " elements at " +
+                                        std::to_string(first) + " past the end of a buffer of " +
+                                        std::to_string(e.data.size()));
+            }
+            std::copy(values, values + count, e.data.begin() + first);
+            e.version++;
+        }
+
+        void update(Id id, size_t first, const std::vector<T>& values)
+        {
+            update(id, first, values.data(), values.size());
+        }
+
+        // Persistent write access to the whole buffer, valid until the buffer is released
+        T* map(Id id)
+        {
+            entry& e = lookup(id);
+            e.version++;
+            e.mapped = true;
+            return e.data.data();
+        }
+
+        // Ends the writes through a mapped pointer; the pointer stays usable, but a later write
+        // through it needs another map() and unmap()
+        void unmap(Id id)
+        {
+            entry& e = lookup(id);
+            e.version++;
+            e.mapped = false;
+        }
+
+        bool mapped(Id id) const { return lookup(id).mapped; }
+
+        // Frees the storage; the handle and any copy of it become stale
+        void release(Id id)
+        {
+            entry& e = lookup(id);
+            e.data = std::vector<T>();
+            e.live = false;
+            e.mapped = false;
+            e.generation++;
+            if (e.generation == 0)
+            {
+                e.generation = 1;
+            }
+            free_slots.push_back(id.slot);
+        }
+
+        // Number of live buffers
+        size_t count() const { return slots.size() - free_slots.size(); }
+
+    private:
+        struct entry
+        {
+            std::vector<T> data;
+            uint32_t generation = 1;
+            uint64_t version = 0;
+            bool live = false;
+            bool mapped = false;
+        };
+
+        entry& lookup(Id id)
+        {
+            return const_cast<entry&>(static_cast<const buffer_registry*>(this)->lookup(id));
+        }
+
+        const entry& lookup(Id id) const
+        {
+            if (!valid(id))
+            {
+                throw std::invalid_argument("stale or unknown buffer handle (slot " + std::to_string(id.slot) + ")");
+            }
+            return slots[id.slot];
+        }
+
+        std::vector<entry> slots;
+        std::vector<int> free_slots;
+    };
+}
+
+#endif //RASTERIZER_BUFFERREGISTRY_H
@@ -4,6 +4,7 @@
 #include "rasterizer.hpp"
 #include "global.hpp"
 #include "Triangle.hpp"
+#include "FramePipeline.hpp"
 
 constexpr double MY_PI = 3.1415926;
 
@@ -54,7 +55,8 @@ int main(int argc, const char** argv)
         filename = std::string(argv[1]);
     }
 
-    rst::rasterizer r(700, 700, 2);
+    // 4x MSAA
+    rst::rasterizer r(700, 700, 4);
 
     Eigen::Vector3f eye_pos = {0,0,5};
 
@@ -89,6 +91,9 @@ int main(int argc, const char** argv)
     auto ind_id = r.load_indices(ind);
     auto col_id = r.load_colors(cols);
 
+    // Both triangles face the camera, clockwise ones would not cover any sample anyway
+    r.set_cull_mode(rst::CullMode::Back);
+
     int key = 0;
     int frame_count = 0;
 
@@ -110,6 +115,8 @@ int main(int argc, const char** argv)
         return 0;
     }
 
+    // Frame N is converted in the background while frame N + 1 renders
+    rst::frame_pipeline pipeline(700, 700);
     while(key != 27)
     {
         r.clear(rst::Buffers::Color | rst::Buffers::Depth);
@@ -120,11 +127,13 @@ int main(int argc, const char** argv)
 
         r.draw(pos_id, ind_id, col_id, rst::Primitive::Triangle);
 
-        cv::Mat image(700, 700, CV_32FC3, r.frame_buffer().data());
-        image.convertTo(image, CV_8UC3, 1.0f);
-        cv::cvtColor(image, image, cv::COLOR_RGB2BGR);
-        cv::imshow("image", image);
-        key = cv::waitKey(10);
+        cv::Mat image;
+        if (pipeline.present(image))
+        {
+            cv::imshow("image", image);
+        }
+        pipeline.submit(r.frame_buffer());
+        key = cv::waitKey(pipeline.frame_wait_ms());
 
         std::cout << "frame count: " << frame_count++ << '\n';
     }
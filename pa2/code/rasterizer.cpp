@@ -8,30 +8,22 @@
 #include "rasterizer.hpp"
 #include <opencv2/opencv.hpp>
 #include <math.h>
+#include <stdexcept>
 
 
-rst::pos_buf_id rst::rasterizer::load_positions(const std::vector<Eigen::Vector3f> &positions)
+rst::pos_buf_id rst::rasterizer::load_positions(std::vector<Eigen::Vector3f> positions)
 {
-    auto id = get_next_id();
-    pos_buf.emplace(id, positions);
-
-    return {id};
+    return pos_buf.create(std::move(positions));
 }
 
-rst::ind_buf_id rst::rasterizer::load_indices(const std::vector<Eigen::Vector3i> &indices)
+rst::ind_buf_id rst::rasterizer::load_indices(std::vector<Eigen::Vector3i> indices)
 {
-    auto id = get_next_id();
-    ind_buf.emplace(id, indices);
-
-    return {id};
+    return ind_buf.create(std::move(indices));
 }
 
-rst::col_buf_id rst::rasterizer::load_colors(const std::vector<Eigen::Vector3f> &cols)
+rst::col_buf_id rst::rasterizer::load_colors(std::vector<Eigen::Vector3f> cols)
 {
-    auto id = get_next_id();
-    col_buf.emplace(id, cols);
-
-    return {id};
+    return col_buf.create(std::move(cols));
 }
 
 auto to_vec4(const Eigen::Vector3f& v3, float w = 1.0f)
@@ -64,15 +56,77 @@ static std::tuple<float, float, float> computeBarycentric2D(float x, float y, co
     return {c1,c2,c3};
 }
 
+// Clip-space outcodes. A triangle whose vertices share a frustum bit is invisible, and only
+// triangles touching the near plane or leaving the guard band need to be clipped; everything
+// else is rasterized directly with its bounding box clamped to the viewport.
+static constexpr unsigned char CLIP_LEFT = 1 << 0;
+static constexpr unsigned char CLIP_RIGHT = 1 << 1;
+static constexpr unsigned char CLIP_BOTTOM = 1 << 2;
+static constexpr unsigned char CLIP_TOP = 1 << 3;
+static constexpr unsigned char CLIP_NEAR = 1 << 4;
+static constexpr unsigned char CLIP_FAR = 1 << 5;
+static constexpr unsigned char CLIP_GUARD = 1 << 6;
+static constexpr unsigned char CLIP_FRUSTUM = CLIP_LEFT | CLIP_RIGHT | CLIP_BOTTOM | CLIP_TOP | CLIP_NEAR | CLIP_FAR;
+
+// Guard band half extent in NDC units, i.e. four viewports on each side of the screen
+static constexpr float guard_band = 4.0f;
+
+static unsigned char compute_clip_code(const Eigen::Vector4f& p)
+{
+    unsigned char code = 0;
+    if (p.x() < -p.w()) code |= CLIP_LEFT;
+    if (p.x() > p.w()) code |= CLIP_RIGHT;
+    if (p.y() < -p.w()) code |= CLIP_BOTTOM;
+    if (p.y() > p.w()) code |= CLIP_TOP;
+    if (p.z() < -p.w()) code |= CLIP_NEAR;
+    if (p.z() > p.w()) code |= CLIP_FAR;
+    float guard = guard_band * p.w();
+    if (p.x() < -guard || p.x() > guard || p.y() < -guard || p.y() > guard) code |= CLIP_GUARD;
+    return code;
+}
+
+struct clip_vertex
+{
+    Eigen::Vector4f pos;
+    Eigen::Vector3f color;
+};
+
+// Sutherland-Hodgman against the clip-space half space dot(plane, pos) >= 0
+static void clip_polygon(std::vector<clip_vertex>& polygon, const Eigen::Vector4f& plane)
+{
+    std::vector<clip_vertex> result;
+    result.reserve(polygon.size() + 1);
+
+    for (size_t i = 0; i < polygon.size(); ++i)
+    {
+        const auto& cur = polygon[i];
+        const auto& next = polygon[(i + 1) % polygon.size()];
+        float d_cur = plane.dot(cur.pos);
+        float d_next = plane.dot(next.pos);
+
+        if (d_cur >= 0)
+            result.push_back(cur);
+        if ((d_cur >= 0) != (d_next >= 0))
+        {
+            float t = d_cur / (d_cur - d_next);
+            result.push_back({cur.pos + t * (next.pos - cur.pos), cur.color + t * (next.color - cur.color)});
+        }
+    }
+
+    polygon.swap(result);
+}
+
 void rst::rasterizer::draw(pos_buf_id pos_buffer, ind_buf_id ind_buffer, col_buf_id col_buffer, Primitive type)
 {
-    auto& buf = pos_buf[pos_buffer.pos_id];
-    auto& ind = ind_buf[ind_buffer.ind_id];
-    auto& col = col_buf[col_buffer.col_id];
+    auto& buf = pos_buf.get(pos_buffer);
+    auto& ind = ind_buf.get(ind_buffer);
+    auto& col = col_buf.get(col_buffer);
 
     float f1 = (50 - 0.1) / 2.0;
     float f2 = (50 + 0.1) / 2.0;
 
+    std::vector<clip_vertex> polygon;
+
     Eigen::Matrix4f mvp = projection * view * model;
     for (auto& i : ind)
     {
@@ -82,76 +136,225 @@ void rst::rasterizer::draw(pos_buf_id pos_buffer, ind_buf_id ind_buffer, col_buf
                 mvp * to_vec4(buf[i[1]], 1.0f),
                 mvp * to_vec4(buf[i[2]], 1.0f)
         };
-        //Homogeneous division
-        for (auto& vec : v) {
-            vec /= vec.w();
+
+        statistics.submitted++;
+
+        unsigned char codes[] = {compute_clip_code(v[0]), compute_clip_code(v[1]), compute_clip_code(v[2])};
+        // Completely outside one of the frustum planes
+        if (codes[0] & codes[1] & codes[2] & CLIP_FRUSTUM)
+        {
+            statistics.frustum_culled++;
+            continue;
         }
-        //Viewport transformation
-        for (auto & vert : v)
+
+        polygon.clear();
+        for (int j = 0; j < 3; ++j)
         {
-            vert.x() = 0.5*width*(vert.x()+1.0);
-            vert.y() = 0.5*height*(vert.y()+1.0);
-            vert.z() = vert.z() * f1 + f2;
+            polygon.push_back({v[j], col[i[j]]});
         }
 
-        for (int i = 0; i < 3; ++i)
+        unsigned char code_or = codes[0] | codes[1] | codes[2];
+        if (code_or & CLIP_NEAR)
         {
-            t.setVertex(i, v[i].head<3>());
-            t.setVertex(i, v[i].head<3>());
-            t.setVertex(i, v[i].head<3>());
+            clip_polygon(polygon, Eigen::Vector4f(0, 0, 1, 1));
         }
+        if (code_or & CLIP_GUARD)
+        {
+            clip_polygon(polygon, Eigen::Vector4f(1, 0, 0, guard_band));
+            clip_polygon(polygon, Eigen::Vector4f(-1, 0, 0, guard_band));
+            clip_polygon(polygon, Eigen::Vector4f(0, 1, 0, guard_band));
+            clip_polygon(polygon, Eigen::Vector4f(0, -1, 0, guard_band));
+        }
+
+        for (auto& vert : polygon)
+        {
+            //Homogeneous division
+            vert.pos /= vert.pos.w();
+            //Viewport transformation
+            vert.pos.x() = 0.5*width*(vert.pos.x()+1.0);
+            vert.pos.y() = 0.5*height*(vert.pos.y()+1.0);
+            vert.pos.z() = vert.pos.z() * f1 + f2;
+        }
+
+        // Unclipped triangles come out unchanged, clipped ones are convex polygons split into a fan
+        for (size_t k = 1; k + 1 < polygon.size(); ++k)
+        {
+            const clip_vertex* fan[] = {&polygon[0], &polygon[k], &polygon[k + 1]};
+            for (int j = 0; j < 3; ++j)
+            {
+                t.setVertex(j, fan[j]->pos.head<3>());
+                t.setColor(j, fan[j]->color[0], fan[j]->color[1], fan[j]->color[2]);
+            }
+
+            if (!cull_triangle(t))
+            {
+                rasterize_triangle(t);
+            }
+        }
+    }
+}
+
+// Screen positions are snapped to 1/256 of a pixel before setup, so the signed area below is
+// exact and a triangle that collapsed to a line or a point is recognized reliably.
+static constexpr float subpixel_steps = 256.0f;
 
-        auto col_x = col[i[0]];
-        auto col_y = col[i[1]];
-        auto col_z = col[i[2]];
+bool rst::rasterizer::cull_triangle(Triangle& t)
+{
+    for (auto& vert : t.v)
+    {
+        vert.x() = std::round(vert.x() * subpixel_steps) / subpixel_steps;
+        vert.y() = std::round(vert.y() * subpixel_steps) / subpixel_steps;
+    }
 
-        t.setColor(0, col_x[0], col_x[1], col_x[2]);
-        t.setColor(1, col_y[0], col_y[1], col_y[2]);
-        t.setColor(2, col_z[0], col_z[1], col_z[2]);
+    // Twice the signed area, positive for counter clockwise triangles (y points up)
+    double area = (double(t.v[1].x()) - t.v[0].x()) * (double(t.v[2].y()) - t.v[0].y()) -
+                  (double(t.v[2].x()) - t.v[0].x()) * (double(t.v[1].y()) - t.v[0].y());
 
-        rasterize_triangle(t);
+    if (area == 0)
+    {
+        statistics.degenerate_culled++;
+        return true;
+    }
+    if ((cull_mode == CullMode::Back && area < 0) || (cull_mode == CullMode::Front && area > 0))
+    {
+        statistics.backface_culled++;
+        return true;
+    }
+
+    // Sample positions repeat every pixel at the same offsets from the pixel center; a bounding
+    // box that contains no such x or no such y cannot cover any sample
+    float x_min = std::min(std::min(t.v[0].x(), t.v[1].x()), t.v[2].x()) - 0.5f;
+    float x_max = std::max(std::max(t.v[0].x(), t.v[1].x()), t.v[2].x()) - 0.5f;
+    float y_min = std::min(std::min(t.v[0].y(), t.v[1].y()), t.v[2].y()) - 0.5f;
+    float y_max = std::max(std::max(t.v[0].y(), t.v[1].y()), t.v[2].y()) - 0.5f;
+    bool hits_x = false, hits_y = false;
+    for (auto& pos : sample_pos)
+    {
+        hits_x = hits_x || std::floor(x_max - pos.x()) >= std::ceil(x_min - pos.x());
+        hits_y = hits_y || std::floor(y_max - pos.y()) >= std::ceil(y_min - pos.y());
     }
+    if (!hits_x || !hits_y)
+    {
+        statistics.small_culled++;
+        return true;
+    }
+
+    statistics.rasterized++;
+    return false;
 }
 
 //Screen space rasterization
 void rst::rasterizer::rasterize_triangle(const Triangle& t) {
     auto v = t.toVector4();
 
-    int x_min = std::min(std::min(v[0].x(), v[1].x()), v[2].x());
-    int x_max = std::max(std::max(v[0].x(), v[1].x()), v[2].x()) + 1;
-    int y_min = std::min(std::min(v[0].y(), v[1].y()), v[2].y());
-    int y_max = std::max(std::max(v[0].y(), v[1].y()), v[2].y()) + 1;
+    // Bounding box clamped to the viewport, the guard band keeps these values well inside int range
+    int x_min = std::max(0, int(std::floor(std::min(std::min(v[0].x(), v[1].x()), v[2].x()))));
+    int x_max = std::min(width, int(std::max(std::max(v[0].x(), v[1].x()), v[2].x())) + 1);
+    int y_min = std::max(0, int(std::floor(std::min(std::min(v[0].y(), v[1].y()), v[2].y()))));
+    int y_max = std::min(height, int(std::max(std::max(v[0].y(), v[1].y()), v[2].y())) + 1);
 
-    float init_offset = 1.0f / num_samples / 2.0f;
-    float offset = 1.0f / num_samples;
+    // Flat shading, one color per triangle
+    Eigen::Vector3f color = t.getColor();
+    const unsigned int full_mask = (1u << num_samples) - 1;
 
     for (int x = x_min; x < x_max; x++) {
         for (int y = y_min; y < y_max; y++) {
-            int num_sub_pixels = 0;
-            for (int x_sub=0; x_sub < num_samples; x_sub++) {
-                for (int y_sub=0; y_sub < num_samples; y_sub++) {
-                    if (insideTriangle(x+init_offset+offset*x_sub, y+init_offset+offset*y_sub, t.v)) {
-                        auto[alpha, beta, gamma] = computeBarycentric2D(x + init_offset + offset * x_sub,
-                                                                        y + init_offset + offset * y_sub, t.v);
-                        float w_reciprocal = 1.0f / (alpha / v[0].w() + beta / v[1].w() + gamma / v[2].w());
-                        float z_interpolated =
-                                alpha * v[0].z() / v[0].w() + beta * v[1].z() / v[1].w() + gamma * v[2].z() / v[2].w();
-                        z_interpolated *= w_reciprocal;
-                        if (z_interpolated < depth_buf[get_sub_index(x, y, x_sub, y_sub)]) {
-                            depth_buf[get_sub_index(x, y, x_sub, y_sub)] = z_interpolated;
-                            num_sub_pixels += 1;
-                        }
+            // Coverage and depth are evaluated per sample, the color only once per pixel
+            unsigned int mask = 0;
+            for (int s = 0; s < num_samples; s++) {
+                float sx = x + 0.5f + sample_pos[s].x();
+                float sy = y + 0.5f + sample_pos[s].y();
+                if (insideTriangle(sx, sy, t.v)) {
+                    auto[alpha, beta, gamma] = computeBarycentric2D(sx, sy, t.v);
+                    float w_reciprocal = 1.0f / (alpha / v[0].w() + beta / v[1].w() + gamma / v[2].w());
+                    float z_interpolated =
+                            alpha * v[0].z() / v[0].w() + beta * v[1].z() / v[1].w() + gamma * v[2].z() / v[2].w();
+                    z_interpolated *= w_reciprocal;
+                    if (z_interpolated < depth_buf[get_sub_index(x, y, s)]) {
+                        depth_buf[get_sub_index(x, y, s)] = z_interpolated;
+                        mask |= 1u << s;
+                    }
+                }
+            }
+            if (mask == 0) {
+                continue;
+            }
+
+            int index = get_index(x, y);
+            if (mask == full_mask) {
+                // Fully covered, the pixel collapses back to a single color
+                pixel_colors.set(index, color);
+                release_samples(index);
+                continue;
+            }
+
+            int& samples = pixel_samples[index];
+            if (samples < 0) {
+                // Edge pixel, expand it to per-sample colors
+                if (free_sample_blocks.empty()) {
+                    samples = sample_colors_used;
+                    sample_colors_used += num_samples;
+                    if (sample_colors.size() < size_t(sample_colors_used)) {
+                        sample_colors.resize(std::max(size_t(sample_colors_used), 2 * sample_colors.size()));
                     }
+                } else {
+                    samples = free_sample_blocks.back();
+                    free_sample_blocks.pop_back();
+                }
+                Eigen::Vector3f previous = pixel_colors.get(index);
+                for (int s = 0; s < num_samples; s++) {
+                    sample_colors.set(samples + s, previous);
                 }
             }
-            if (num_sub_pixels > 0) {
-                auto color = t.getColor() * (float(num_sub_pixels) / num_samples / num_samples);
-                add_pixel_color(Vector3f(x, y, 1.0f), color);
+            for (int s = 0; s < num_samples; s++) {
+                if (mask & (1u << s)) {
+                    sample_colors.set(samples + s, color);
+                }
             }
         }
     }
 }
 
+void rst::rasterizer::resolve()
+{
+    for (int y = 0; y < height; ++y)
+    {
+        auto row = frame_buf.begin() + (height - 1 - y) * width;
+        for (int x = 0; x < width; ++x)
+        {
+            int index = get_index(x, y);
+            int samples = pixel_samples[index];
+            if (samples < 0)
+            {
+                row[x] = pixel_colors.get(index);
+                continue;
+            }
+
+            Eigen::Vector3f sum = Eigen::Vector3f::Zero();
+            for (int s = 0; s < num_samples; s++)
+            {
+                sum += sample_colors.get(samples + s);
+            }
+            row[x] = sum / float(num_samples);
+        }
+    }
+}
+
+void rst::rasterizer::release_samples(int index)
+{
+    if (pixel_samples[index] >= 0)
+    {
+        free_sample_blocks.push_back(pixel_samples[index]);
+        pixel_samples[index] = -1;
+    }
+}
+
+std::vector<Eigen::Vector3f>& rst::rasterizer::frame_buffer()
+{
+    resolve();
+    return frame_buf;
+}
+
 void rst::rasterizer::set_model(const Eigen::Matrix4f& m)
 {
     model = m;
@@ -171,7 +374,10 @@ void rst::rasterizer::clear(rst::Buffers buff)
 {
     if ((buff & rst::Buffers::Color) == rst::Buffers::Color)
     {
-        std::fill(frame_buf.begin(), frame_buf.end(), Eigen::Vector3f{0, 0, 0});
+        pixel_colors.fill(Eigen::Vector3f{0, 0, 0});
+        std::fill(pixel_samples.begin(), pixel_samples.end(), -1);
+        sample_colors_used = 0;
+        free_sample_blocks.clear();
     }
     if ((buff & rst::Buffers::Depth) == rst::Buffers::Depth)
     {
@@ -179,35 +385,41 @@ void rst::rasterizer::clear(rst::Buffers buff)
     }
 }
 
-rst::rasterizer::rasterizer(int w, int h, int num_samples) : width(w), height(h), num_samples(num_samples)
-{
-    frame_buf.resize(w * h);
-    depth_buf.resize(w * h * num_samples * num_samples);
-}
-
-int rst::rasterizer::get_index(int x, int y)
+rst::rasterizer::rasterizer(int w, int h, int num_samples, ColorFormat format)
+    : layout(w, h), pixel_colors(format), sample_colors(format), width(w), height(h), num_samples(num_samples)
 {
-    return (height-1-y)*width + x;
-}
+    // Standard multisample patterns in 1/16 pixel units, rotated so that no two samples share a
+    // row or a column, which gives near horizontal and vertical edges the most distinct levels
+    switch (num_samples)
+    {
+        case 1: sample_pos = {{0, 0}}; break;
+        case 2: sample_pos = {{4, 4}, {-4, -4}}; break;
+        case 4: sample_pos = {{-2, -6}, {6, -2}, {-6, 2}, {2, 6}}; break;
+        case 8: sample_pos = {{1, -3}, {-1, 3}, {5, 1}, {-3, -5}, {-5, 5}, {-7, -1}, {3, 7}, {7, -7}}; break;
+        case 16: sample_pos = {{1, 1}, {-1, -3}, {-3, 2}, {4, -1}, {-5, -2}, {2, 5}, {5, 3}, {3, -5},
+                               {-2, 6}, {0, -7}, {-4, -6}, {-6, 4}, {-8, 0}, {7, -4}, {6, 7}, {-7, -8}}; break;
+        default: throw std::invalid_argument("Unsupported MSAA sample count, use 1, 2, 4, 8 or 16");
+    }
+    for (auto& pos : sample_pos)
+    {
+        pos /= 16.0f;
+    }
 
-int rst::rasterizer::get_sub_index(int x, int y, int sub_x, int sub_y)
-{
-    return ((height-1-y)*width+x)*num_samples*num_samples + sub_x + sub_y*num_samples;
+    frame_buf.resize(w * h);
+    pixel_colors.resize(layout.size());
+    pixel_samples.resize(layout.size(), -1);
+    depth_buf.resize(layout.size() * num_samples);
 }
 
 
 void rst::rasterizer::set_pixel_color(const Eigen::Vector3f& point, const Eigen::Vector3f& color)
 {
     //old index: auto ind = point.y() + point.x() * width;
-    auto ind = (height-1-point.y())*width + point.x();
-    frame_buf[ind] = color;
-}
-
-void rst::rasterizer::add_pixel_color(const Eigen::Vector3f& point, const Eigen::Vector3f& color)
-{
-    //old index: auto ind = point.y() + point.x() * width;
-    auto ind = (height-1-point.y())*width + point.x();
-    frame_buf[ind] += color;
+    if (point.x() < 0 || point.x() >= width ||
+        point.y() < 0 || point.y() >= height) return;
+    int index = get_index(point.x(), point.y());
+    pixel_colors.set(index, color);
+    release_samples(index);
 }
 
 
@@ -7,6 +7,8 @@
 #include <eigen3/Eigen/Eigen>
 #include <algorithm>
 #include "global.hpp"
+#include "BufferRegistry.hpp"
+#include "Framebuffer.hpp"
 #include "Triangle.hpp"
 using namespace Eigen;
 
@@ -34,52 +36,86 @@ namespace rst
         Triangle
     };
 
+    // Which screen-space winding gets discarded; counter clockwise triangles face the camera
+    enum class CullMode
+    {
+        None,
+        Back,
+        Front
+    };
+
+    // Triangle counters of the culling stage, accumulated until reset_stats() is called
+    struct pipeline_stats
+    {
+        int submitted = 0;          // triangles assembled from the index buffer
+        int frustum_culled = 0;     // completely outside one frustum plane
+        int backface_culled = 0;    // rejected by the cull mode
+        int degenerate_culled = 0;  // zero area after snapping
+        int small_culled = 0;       // bounding box covers no sample position
+        int rasterized = 0;         // triangles handed to the rasterizer, clipped fans count each piece
+
+        int culled() const { return frustum_culled + backface_culled + degenerate_culled + small_culled; }
+    };
+
     /*
      * For the curious : The draw function takes two buffer id's as its arguments. These two structs
      * make sure that if you mix up with their orders, the compiler won't compile it.
      * Aka : Type safety
      * */
-    struct pos_buf_id
+    struct pos_buf_id : buffer_handle
     {
-        int pos_id = 0;
     };
 
-    struct ind_buf_id
+    struct ind_buf_id : buffer_handle
     {
-        int ind_id = 0;
     };
 
-    struct col_buf_id
+    struct col_buf_id : buffer_handle
     {
-        int col_id = 0;
     };
 
     class rasterizer
     {
     public:
-        rasterizer(int w, int h, int num_samples=1);
-        pos_buf_id load_positions(const std::vector<Eigen::Vector3f>& positions);
-        ind_buf_id load_indices(const std::vector<Eigen::Vector3i>& indices);
-        col_buf_id load_colors(const std::vector<Eigen::Vector3f>& colors);
+        // num_samples is the MSAA sample count per pixel: 1, 2, 4, 8 or 16
+        rasterizer(int w, int h, int num_samples=1, ColorFormat format=ColorFormat::RGB32F);
+        // The vectors are taken by value: pass an rvalue to move the data in instead of copying it
+        pos_buf_id load_positions(std::vector<Eigen::Vector3f> positions);
+        ind_buf_id load_indices(std::vector<Eigen::Vector3i> indices);
+        col_buf_id load_colors(std::vector<Eigen::Vector3f> colors);
+
+        // The buffers behind the ids, for in-place updates, mapped writes and release
+        buffer_registry<Eigen::Vector3f, pos_buf_id>& position_buffers() { return pos_buf; }
+        buffer_registry<Eigen::Vector3i, ind_buf_id>& index_buffers() { return ind_buf; }
+        buffer_registry<Eigen::Vector3f, col_buf_id>& color_buffers() { return col_buf; }
 
         void set_model(const Eigen::Matrix4f& m);
         void set_view(const Eigen::Matrix4f& v);
         void set_projection(const Eigen::Matrix4f& p);
 
         void set_pixel_color(const Eigen::Vector3f& point, const Eigen::Vector3f& color);
-        void add_pixel_color(const Eigen::Vector3f& point, const Eigen::Vector3f& color);
+
+        void set_cull_mode(CullMode mode) { cull_mode = mode; }
+        const pipeline_stats& stats() const { return statistics; }
+        void reset_stats() { statistics = pipeline_stats(); }
 
         void clear(Buffers buff);
 
         void draw(pos_buf_id pos_buffer, ind_buf_id ind_buffer, col_buf_id col_buffer, Primitive type);
 
-        std::vector<Eigen::Vector3f>& frame_buffer() { return frame_buf; }
+        // Averages the samples of every pixel into the linear, top row first frame buffer
+        void resolve();
+        // Resolves first, so the returned image always reflects everything drawn so far
+        std::vector<Eigen::Vector3f>& frame_buffer();
 
     private:
         void draw_line(Eigen::Vector3f begin, Eigen::Vector3f end);
 
         void rasterize_triangle(const Triangle& t);
 
+        // Snaps the screen-space vertices and returns true if the triangle can be discarded
+        bool cull_triangle(Triangle& t);
+
         // VERTEX SHADER -> MVP -> Clipping -> /.W -> VIEWPORT -> DRAWLINE/DRAWTRI -> FRAGSHADER
 
     private:
@@ -87,20 +123,37 @@ namespace rst
         Eigen::Matrix4f view;
         Eigen::Matrix4f projection;
 
-        std::map<int, std::vector<Eigen::Vector3f>> pos_buf;
-        std::map<int, std::vector<Eigen::Vector3i>> ind_buf;
-        std::map<int, std::vector<Eigen::Vector3f>> col_buf;
+        CullMode cull_mode = CullMode::None;
+        pipeline_stats statistics;
+
+        buffer_registry<Eigen::Vector3f, pos_buf_id> pos_buf;
+        buffer_registry<Eigen::Vector3i, ind_buf_id> ind_buf;
+        buffer_registry<Eigen::Vector3f, col_buf_id> col_buf;
 
+        // Resolved, one color per pixel in linear layout for OpenCV
         std::vector<Eigen::Vector3f> frame_buf;
 
+        // Everything below is stored in the tiled layout
+        tiled_layout layout;
+
+        // MSAA color storage. A pixel whose samples all hold the same color keeps just that color;
+        // only pixels on triangle edges get expanded to one color per sample, allocated from
+        // sample_colors in blocks of num_samples.
+        color_buffer pixel_colors;
+        std::vector<int> pixel_samples;    // first entry in sample_colors, -1 while the pixel is uniform
+        color_buffer sample_colors;
+        int sample_colors_used = 0;
+        std::vector<int> free_sample_blocks;
+
+        // Depth is kept for every sample
         std::vector<float> depth_buf;
-        int get_index(int x, int y);
-        int get_sub_index(int x, int y, int x_sub, int y_sub);
+        int get_index(int x, int y) const { return layout.index(x, y); }
+        int get_sub_index(int x, int y, int sample) const { return layout.index(x, y) * num_samples + sample; }
+        void release_samples(int index);
 
         int width, height;
         int num_samples;
-
-        int next_id = 0;
-        int get_next_id() { return next_id++; }
+        // Sample offsets from the pixel center
+        std::vector<Eigen::Vector2f> sample_pos;
     };
 }
@@ -0,0 +1,242 @@
+//
+// Job scripts of the headless batch mode.
+//
+
+#include "BatchJob.hpp"
+#include <fstream>
+#include <sstream>
+#include <stdexcept>
+
+static std::runtime_error script_error(int line, const std::string& message)
+{
+    return std::runtime_error("job script line " + std::to_string(line) + ": " + message);
+}
+
+static float parse_float(const std::string& value, int line)
+{
+    try
+    {
+        size_t end;
+        float f = std::stof(value, &end);
+        if (end == value.size())
+        {
+            return f;
+        }
+    }
+    catch (const std::exception&)
+    {
+    }
+    throw script_error(line, "expected a number, got '" + value + "'");
+}
+
+static int parse_int(const std::string& value, int line)
+{
+    float f = parse_float(value, line);
+    if (f != float(int(f)) || f <= 0)
+    {
+        throw script_error(line, "expected a positive integer, got '" + value + "'");
+    }
+    return int(f);
+}
+
+// Applies one key=value to a job, returns false for keys that are not job settings
+static bool set_job_value(render_job& job, const std::string& key, const std::string& value, int line)
+{
+    if (key == "out")
+    {
+        job.output = value;
+    }
+    else if (key == "shader")
+    {
+        job.shader = value;
+    }
+    else if (key == "size")
+    {
+        auto x = value.find('x');
+        if (x == std::string::npos)
+        {
+            throw script_error(line, "size is <width>x<height>");
+        }
+        job.width = parse_int(value.substr(0, x), line);
+        job.height = parse_int(value.substr(x + 1), line);
+    }
+    else if (key == "angle")
+    {
+        job.angle = parse_float(value, line);
+    }
+    else if (key == "eye")
+    {
+        std::stringstream coords(value);
+        std::string c;
+        for (int i = 0; i < 3; ++i)
+        {
+            if (!std::getline(coords, c, ','))
+            {
+                throw script_error(line, "eye is <x>,<y>,<z>");
+            }
+            job.eye_pos[i] = parse_float(c, line);
+        }
+    }
+    else if (key == "fov")
+    {
+        job.fov = parse_float(value, line);
+    }
+    else if (key == "instances")
+    {
+        job.instances = parse_int(value, line);
+    }
+    else
+    {
+        return false;
+    }
+    return true;
+}
+
+// out with its run of '#' replaced by the zero padded frame number
+static std::string frame_path(const std::string& pattern, int frame, int line)
+{
+    auto first = pattern.find('#');
+    if (first == std::string::npos)
+    {
+        throw script_error(line, "a turntable needs a run of '#' in out for the frame number");
+    }
+    auto last = pattern.find_first_not_of('#', first);
+    size_t width = (last == std::string::npos ? pattern.size() : last) - first;
+
+    std::string number = std::to_string(frame);
+    if (number.size() < width)
+    {
+        number.insert(0, width - number.size(), '0');
+    }
+    return pattern.substr(0, first) + number + pattern.substr(first + width);
+}
+
+job_script parse_job_script(std::istream& in)
+{
+    job_script script;
+    render_job defaults;
+    std::string text;
+
+    for (int line = 1; std::getline(in, text); ++line)
+    {
+        std::stringstream words(text);
+        std::string command;
+        if (!(words >> command) || command[0] == '#')
+        {
+            continue;
+        }
+
+        if (command == "model")
+        {
+            if (!(words >> script.model))
+            {
+                throw script_error(line, "model needs a path");
+            }
+            continue;
+        }
+        if (command == "threads")
+        {
+            std::string n;
+            words >> n;
+            script.threads = parse_int(n, line);
+            continue;
+        }
+        if (command == "shadows")
+        {
+            std::string value;
+            words >> value;
+            if (value != "on" && value != "off")
+                throw script_error(line, "shadows is on or off");
+            script.shadows = value == "on";
+            continue;
+        }
+        if (command == "transparency")
+        {
+            std::string mode;
+            words >> mode;
+            if (mode == "off")
+                script.transparency = rst::TransparencyMode::Off;
+            else if (mode == "abuffer")
+                script.transparency = rst::TransparencyMode::ABuffer;
+            else if (mode == "weighted")
+                script.transparency = rst::TransparencyMode::WeightedBlended;
+            else
+                throw script_error(line, "transparency is off, abuffer or weighted");
+            continue;
+        }
+        if (command != "set" && command != "render" && command != "turntable")
+        {
+            throw script_error(line, "unknown command '" + command + "'");
+        }
+
+        render_job job = defaults;
+        job.line = line;
+        int frames = 1;
+        float step = 0;
+        bool has_step = false;
+        for (std::string arg; words >> arg;)
+        {
+            auto eq = arg.find('=');
+            if (eq == std::string::npos)
+            {
+                throw script_error(line, "expected key=value, got '" + arg + "'");
+            }
+            std::string key = arg.substr(0, eq), value = arg.substr(eq + 1);
+            if (set_job_value(job, key, value, line))
+            {
+                continue;
+            }
+            if (command == "turntable" && key == "frames")
+            {
+                frames = parse_int(value, line);
+            }
+            else if (command == "turntable" && key == "step")
+            {
+                step = parse_float(value, line);
+                has_step = true;
+            }
+            else
+            {
+                throw script_error(line, "unknown key '" + key + "'");
+            }
+        }
+
+        if (command == "set")
+        {
+            defaults = job;
+            continue;
+        }
+        if (job.output.empty())
+        {
+            throw script_error(line, command + " needs out=<path>");
+        }
+        if (command == "render")
+        {
+            script.jobs.push_back(job);
+            continue;
+        }
+
+        if (!has_step)
+        {
+            step = 360.0f / frames;
+        }
+        for (int i = 0; i < frames; ++i)
+        {
+            render_job frame = job;
+            frame.output = frame_path(job.output, i, line);
+            frame.angle = job.angle + step * i;
+            script.jobs.push_back(frame);
+        }
+    }
+    return script;
+}
+
+job_script load_job_script(const std::string& path)
+{
+    std::ifstream in(path);
+    if (!in)
+    {
+        throw std::runtime_error("cannot read job script " + path);
+    }
+    return parse_job_script(in);
+}
@@ -0,0 +1,55 @@
+//
+// Job scripts of the headless batch mode.
+//
+
+#ifndef RASTERIZER_BATCHJOB_H
+#define RASTERIZER_BATCHJOB_H
+
+#include <eigen3/Eigen/Eigen>
+#include "rasterizer.hpp"
+#include <istream>
+#include <string>
+#include <vector>
+
+// One image of a batch; the defaults are the ones of a single command line render
+struct render_job
+{
+    std::string output;
+    std::string shader = "texture";
+    int width = 700, height = 700;
+    float angle = 140;                  // model rotation about y, degrees
+    Eigen::Vector3f eye_pos{0, 0, 10};
+    float fov = 45;                     // vertical, degrees
+    int instances = 1;                  // copies of the model on a grid, drawn as one instanced call
+    int line = 0;                       // where the job was written in the script
+};
+
+struct job_script
+{
+    std::string model = "./models/spot/spot_triangulated_good.obj";
+    int threads = 0;                    // 0 runs one worker per hardware thread
+    rst::TransparencyMode transparency = rst::TransparencyMode::ABuffer;   // for models with transparent materials
+    bool shadows = true;
+    std::vector<render_job> jobs;
+};
+
+/*
+ * A job script has one command per line; lines starting with '#' are comments:
+ *
+ *   model <obj file>        mesh rendered by every job, loaded once (default: spot)
+ *   threads <n>             number of render workers
+ *   transparency <mode>     off, abuffer (default) or weighted, see rst::TransparencyMode
+ *   shadows on|off          shadow maps for the lit shaders (default on)
+ *   set <key=value>...      changes the defaults of the following jobs
+ *   render <key=value>...   one image
+ *   turntable <key=value>...  frames=<n> images turning by step=<degrees> (default 360 / n),
+ *                           starting at angle; a run of '#' in out is replaced by the frame number
+ *
+ * Keys: out=<png path>, shader=texture|normal|phong|bump|displacement, size=<w>x<h>,
+ * angle=<degrees>, eye=<x>,<y>,<z>, fov=<degrees>, instances=<n>. Every job needs an output path.
+ * Malformed lines throw std::runtime_error naming the line.
+ */
+job_script parse_job_script(std::istream& in);
+job_script load_job_script(const std::string& path);
+
+#endif //RASTERIZER_BATCHJOB_H
@@ -0,0 +1,209 @@
+//
+// Overlaps presenting a frame with rendering the next one.
+//
+
+#ifndef RASTERIZER_FRAMEPIPELINE_H
+#define RASTERIZER_FRAMEPIPELINE_H
+
+#include <eigen3/Eigen/Eigen>
+#include <opencv2/opencv.hpp>
+#include <chrono>
+#include <condition_variable>
+#include <deque>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+namespace rst
+{
+    /*
+     * Frames handed to submit() are converted to 8-bit BGR images on a background thread while the
+     * caller renders the next frame, and present() hands out the newest converted one. num_frames
+     * framebuffers rotate between the two sides: 2 is double buffering (one frame displayed, one
+     * being converted), 3 lets conversion fall a frame behind without stalling the renderer. If
+     * png_path is set, a second thread writes the newest converted frame there, skipping frames
+     * while it is still busy encoding the previous one.
+     *
+     * Per iteration of an interactive loop: draw, present() the previous frame, submit() the new
+     * one, then wait frame_wait_ms() for input. All methods are called from one thread.
+     */
+    class frame_pipeline
+    {
+    public:
+        frame_pipeline(int w, int h, int num_frames = 2, int frame_budget_ms = 16, std::string png_path = "")
+            : width(w), height(h), frames(std::max(2, num_frames)), budget(frame_budget_ms),
+              png_path(std::move(png_path)), deadline(std::chrono::steady_clock::now() + budget)
+        {
+            for (int i = 0; i < int(frames.size()); ++i)
+            {
+                frames[i].colors.resize(size_t(w) * h);
+                free_frames.push_back(i);
+            }
+            converter = std::thread([this] { convert_frames(); });
+            if (!this->png_path.empty())
+                writer = std::thread([this] { write_frames(); });
+        }
+
+        ~frame_pipeline()
+        {
+            {
+                std::lock_guard<std::mutex> lock(mutex);
+                stopping = true;
+            }
+            changed.notify_all();
+            converter.join();
+            if (writer.joinable())
+                writer.join();
+        }
+
+        frame_pipeline(const frame_pipeline&) = delete;
+        frame_pipeline& operator=(const frame_pipeline&) = delete;
+
+        // Queues a linear RGB frame (row 0 at the top, 0..255). The frame is swapped with a free
+        // buffer of the same size instead of being copied, so afterwards the caller's vector holds
+        // stale pixels. Waits if every buffer is still queued for conversion; if the only ones left
+        // are converted but not yet presented, the oldest of them is dropped.
+        void submit(std::vector<Eigen::Vector3f>& colors)
+        {
+            std::unique_lock<std::mutex> lock(mutex);
+            changed.wait(lock, [this] { return !free_frames.empty() || !ready_frames.empty(); });
+            int index;
+            if (!free_frames.empty())
+            {
+                index = free_frames.front();
+                free_frames.pop_front();
+            }
+            else
+            {
+                index = ready_frames.front();
+                ready_frames.pop_front();
+                dropped++;
+            }
+            frames[index].colors.swap(colors);
+            queued_frames.push_back(index);
+            lock.unlock();
+            changed.notify_all();
+        }
+
+        // The newest converted frame, if one was finished since the last call. The image stays
+        // valid until the next call; frames older than it are dropped.
+        bool present(cv::Mat& image)
+        {
+            std::unique_lock<std::mutex> lock(mutex);
+            if (ready_frames.empty())
+                return false;
+
+            if (displayed >= 0)
+                free_frames.push_back(displayed);
+            displayed = ready_frames.back();
+            ready_frames.pop_back();
+            dropped += int(ready_frames.size());
+            free_frames.insert(free_frames.end(), ready_frames.begin(), ready_frames.end());
+            ready_frames.clear();
+            lock.unlock();
+            changed.notify_all();
+
+            image = frames[displayed].image;
+            return true;
+        }
+
+        // Milliseconds left until the end of the current frame's budget, at least 1 so it can be
+        // passed to cv::waitKey. A frame that overran its budget starts the next one from now.
+        int frame_wait_ms()
+        {
+            auto now = std::chrono::steady_clock::now();
+            int wait = int(std::chrono::duration_cast<std::chrono::milliseconds>(deadline - now).count());
+            deadline = wait > 0 ? deadline + budget : now + budget;
+            return std::max(1, wait);
+        }
+
+        // Frames that were converted but replaced by a newer one before being presented
+        int dropped_frames() const
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            return dropped;
+        }
+
+    private:
+        struct frame
+        {
+            std::vector<Eigen::Vector3f> colors;
+            cv::Mat image;
+        };
+
+        void convert_frames()
+        {
+            std::unique_lock<std::mutex> lock(mutex);
+            while (true)
+            {
+                changed.wait(lock, [this] { return stopping || !queued_frames.empty(); });
+                if (queued_frames.empty())
+                {
+                    converter_done = true;
+                    changed.notify_all();
+                    return;
+                }
+                int index = queued_frames.front();
+                queued_frames.pop_front();
+                lock.unlock();
+
+                frame& f = frames[index];
+                cv::Mat image(height, width, CV_32FC3, f.colors.data());
+                image.convertTo(f.image, CV_8UC3, 1.0f);
+                cv::cvtColor(f.image, f.image, cv::COLOR_RGB2BGR);
+                cv::Mat encode;
+                if (!png_path.empty())
+                    encode = f.image.clone();
+
+                lock.lock();
+                ready_frames.push_back(index);
+                if (!png_path.empty())
+                    pending_png = encode;
+                changed.notify_all();
+            }
+        }
+
+        void write_frames()
+        {
+            std::unique_lock<std::mutex> lock(mutex);
+            while (true)
+            {
+                // The last frame converted before shutdown is still written
+                changed.wait(lock, [this] { return converter_done || !pending_png.empty(); });
+                if (pending_png.empty())
+                    return;
+                cv::Mat image = pending_png;
+                pending_png = cv::Mat();
+                lock.unlock();
+
+                cv::imwrite(png_path, image);
+
+                lock.lock();
+            }
+        }
+
+        int width, height;
+        std::vector<frame> frames;
+        std::chrono::milliseconds budget;
+        std::string png_path;
+        std::chrono::steady_clock::time_point deadline;
+
+        // Each frame index is in one of these, displayed or being converted
+        std::deque<int> free_frames;
+        std::deque<int> queued_frames;   // submitted, waiting for the converter
+        std::deque<int> ready_frames;    // converted, oldest first
+        int displayed = -1;
+        int dropped = 0;
+
+        cv::Mat pending_png;
+        bool stopping = false;
+        bool converter_done = false;
+        mutable std::mutex mutex;
+        std::condition_variable changed;
+        std::thread converter;
+        std::thread writer;
+    };
+}
+
+#endif //RASTERIZER_FRAMEPIPELINE_H
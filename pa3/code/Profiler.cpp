@@ -0,0 +1,151 @@
+//
+// Frame timing and counters of the rasterizer.
+//
+
+#include "Profiler.hpp"
+#include <algorithm>
+#include <fstream>
+#include <stdexcept>
+
+const char* rst::stage_name(Stage s)
+{
+    switch (s)
+    {
+        case Stage::Vertex: return "vertex";
+        case Stage::Clip: return "clip";
+        case Stage::Setup: return "setup";
+        case Stage::Raster: return "raster";
+        case Stage::Shade: return "shade";
+        case Stage::Resolve: return "resolve";
+        default: return "unknown";
+    }
+}
+
+static constexpr size_t num_stages = size_t(rst::Stage::Count);
+
+static const char* counter_names[] = {"triangles", "fragments", "depth_passed", "depth_failed", "shader_invocations",
+                                      "transparent_fragments", "transparent_dropped"};
+
+static std::array<long long, 7> counter_values(const rst::frame_counters& c)
+{
+    return {c.triangles, c.fragments, c.depth_passed, c.depth_failed, c.shader_invocations,
+            c.transparent_fragments, c.transparent_dropped};
+}
+
+rst::frame_profiler::frame_profiler(size_t max_frames)
+    : max_frames(std::max<size_t>(1, max_frames)), created(clock::now()), frame_start(created), last(created)
+{
+}
+
+void rst::frame_profiler::begin_frame()
+{
+    current = frame_profile();
+    current.frame = next_frame++;
+    frame_start = clock::now();
+    current.start_ms = since_start(frame_start);
+}
+
+void rst::frame_profiler::end_frame()
+{
+    current.total_ms = since_start(clock::now()) - current.start_ms;
+    history.push_back(current);
+    if (history.size() > max_frames)
+    {
+        history.pop_front();
+    }
+}
+
+void rst::frame_profiler::write_csv(std::ostream& out) const
+{
+    out << "frame,start_ms,total_ms";
+    for (size_t s = 0; s < num_stages; ++s)
+        out << ',' << stage_name(Stage(s)) << "_ms";
+    for (auto name : counter_names)
+        out << ',' << name;
+    out << '\n';
+
+    for (auto& f : history)
+    {
+        out << f.frame << ',' << f.start_ms << ',' << f.total_ms;
+        for (double ms : f.stage_ms)
+            out << ',' << ms;
+        for (long long value : counter_values(f.counters))
+            out << ',' << value;
+        out << '\n';
+    }
+}
+
+void rst::frame_profiler::write_json(std::ostream& out) const
+{
+    out << "{\"frames\": [";
+    for (size_t i = 0; i < history.size(); ++i)
+    {
+        auto& f = history[i];
+        out << (i ? ",\n" : "\n") << "  {\"frame\": " << f.frame << ", \"start_ms\": " << f.start_ms
+            << ", \"total_ms\": " << f.total_ms << ", \"stages_ms\": {";
+        for (size_t s = 0; s < num_stages; ++s)
+            out << (s ? ", " : "") << '"' << stage_name(Stage(s)) << "\": " << f.stage_ms[s];
+        out << "}, \"counters\": {";
+        auto values = counter_values(f.counters);
+        for (size_t c = 0; c < values.size(); ++c)
+            out << (c ? ", " : "") << '"' << counter_names[c] << "\": " << values[c];
+        out << "}}";
+    }
+    out << "\n]}\n";
+}
+
+void rst::frame_profiler::write_chrome_trace(std::ostream& out) const
+{
+    // Timestamps and durations are in microseconds
+    out << "{\"traceEvents\": [";
+    bool first = true;
+    auto event = [&]() -> std::ostream& {
+        out << (first ? "\n  " : ",\n  ");
+        first = false;
+        return out;
+    };
+
+    for (auto& f : history)
+    {
+        double ts = f.start_ms * 1000.0;
+        event() << "{\"name\": \"frame " << f.frame << "\", \"ph\": \"X\", \"pid\": 1, \"tid\": 1, \"ts\": " << ts
+                << ", \"dur\": " << f.total_ms * 1000.0 << '}';
+        for (size_t s = 0; s < num_stages; ++s)
+        {
+            if (f.stage_ms[s] <= 0)
+                continue;
+            event() << "{\"name\": \"" << stage_name(Stage(s)) << "\", \"ph\": \"X\", \"pid\": 1, \"tid\": 1, \"ts\": " << ts
+                    << ", \"dur\": " << f.stage_ms[s] * 1000.0 << '}';
+            ts += f.stage_ms[s] * 1000.0;
+        }
+
+        auto values = counter_values(f.counters);
+        for (size_t c = 0; c < values.size(); ++c)
+        {
+            event() << "{\"name\": \"" << counter_names[c] << "\", \"ph\": \"C\", \"pid\": 1, \"ts\": " << f.start_ms * 1000.0
+                    << ", \"args\": {\"" << counter_names[c] << "\": " << values[c] << "}}";
+        }
+    }
+    out << "\n]}\n";
+}
+
+static bool ends_with(const std::string& s, const std::string& suffix)
+{
+    return s.size() >= suffix.size() && s.compare(s.size() - suffix.size(), suffix.size(), suffix) == 0;
+}
+
+void rst::frame_profiler::write(const std::string& path) const
+{
+    std::ofstream out(path);
+    if (ends_with(path, ".csv"))
+        write_csv(out);
+    else if (ends_with(path, ".trace.json"))
+        write_chrome_trace(out);
+    else
+        write_json(out);
+
+    if (!out)
+    {
+        throw std::runtime_error("cannot write profile " + path);
+    }
+}
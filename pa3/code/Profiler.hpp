@@ -0,0 +1,151 @@
+//
+// Frame timing and counters of the rasterizer.
+//
+
+#ifndef RASTERIZER_PROFILER_H
+#define RASTERIZER_PROFILER_H
+
+#include <array>
+#include <chrono>
+#include <deque>
+#include <ostream>
+#include <string>
+
+namespace rst
+{
+    // Stages of the pipeline. Time spent in a nested stage is not charged to the enclosing one,
+    // so the stage times of a frame add up to the time spent inside the rasterizer.
+    enum class Stage
+    {
+        Vertex,    // vertex shader and the batch transforms
+        Clip,      // clipping triangles against the near plane and the guard band
+        Setup,     // triangle assembly, culling, bounding box and derivative setup
+        Raster,    // coverage, depth test and attribute interpolation
+        Shade,     // fragment shader calls
+        Resolve,   // compositing transparency, converting the tiled color buffer to the linear frame
+        Count
+    };
+
+    const char* stage_name(Stage s);
+
+    struct frame_counters
+    {
+        long long triangles = 0;              // triangles handed to the rasterizer, after culling
+        long long fragments = 0;              // pixels covered by a triangle
+        long long depth_passed = 0;
+        long long depth_failed = 0;
+        long long shader_invocations = 0;     // fragment shader calls, a quad shader call counts once
+        long long transparent_fragments = 0;  // fragments handed to order-independent transparency
+        long long transparent_dropped = 0;    // of those, lost to a full A-buffer arena
+    };
+
+    struct frame_profile
+    {
+        int frame = 0;
+        double start_ms = 0;   // since the profiler was created
+        double total_ms = 0;   // begin_frame to end_frame
+        std::array<double, size_t(Stage::Count)> stage_ms{};
+        frame_counters counters;
+    };
+
+    /*
+     * Per-frame stage times and counters, bracketed by begin_frame and end_frame. The last
+     * max_frames frames are kept and can be exported as CSV, JSON or a Chrome trace (load it in
+     * chrome://tracing or Perfetto).
+     *
+     * Counters are always kept. Timing reads the clock on every stage change, which costs a few
+     * percent with per-fragment shaders, so it is off until set_enabled(true).
+     */
+    class frame_profiler
+    {
+    public:
+        using clock = std::chrono::steady_clock;
+
+        explicit frame_profiler(size_t max_frames = 1024);
+
+        void set_enabled(bool e) { enabled = e; }
+        bool is_enabled() const { return enabled; }
+
+        void begin_frame();
+        void end_frame();
+
+        // Charges the time until the end of the scope to a stage
+        class scope
+        {
+        public:
+            scope(frame_profiler& p, Stage s) : profiler(p.enabled ? &p : nullptr)
+            {
+                if (profiler) profiler->enter(s);
+            }
+            ~scope()
+            {
+                if (profiler) profiler->leave();
+            }
+            scope(const scope&) = delete;
+            scope& operator=(const scope&) = delete;
+
+        private:
+            frame_profiler* profiler;
+        };
+        scope time(Stage s) { return scope(*this, s); }
+
+        frame_counters& counters() { return current.counters; }
+
+        const std::deque<frame_profile>& frames() const { return history; }
+        void clear_history() { history.clear(); }
+
+        void write_csv(std::ostream& out) const;
+        void write_json(std::ostream& out) const;
+        // Every frame is a complete event, its stages are child events laid end to end with their
+        // total time; the counters are counter events
+        void write_chrome_trace(std::ostream& out) const;
+        // Picks the format from the file name: *.csv, *.trace.json or any other *.json
+        void write(const std::string& path) const;
+
+    private:
+        void enter(Stage s)
+        {
+            auto now = clock::now();
+            if (depth > 0)
+                charge(active[depth - 1], now);
+            if (depth < int(active.size()))
+                active[depth] = s;
+            depth++;
+            last = now;
+        }
+
+        void leave()
+        {
+            auto now = clock::now();
+            depth--;
+            if (depth < int(active.size()))
+                charge(active[depth], now);
+            last = now;
+        }
+
+        void charge(Stage s, clock::time_point now)
+        {
+            current.stage_ms[size_t(s)] += std::chrono::duration<double, std::milli>(now - last).count();
+        }
+
+        double since_start(clock::time_point t) const
+        {
+            return std::chrono::duration<double, std::milli>(t - created).count();
+        }
+
+        bool enabled = false;
+        size_t max_frames;
+        int next_frame = 0;
+
+        clock::time_point created;
+        clock::time_point frame_start;
+        clock::time_point last;
+        std::array<Stage, 8> active{};   // stack of open scopes
+        int depth = 0;
+
+        frame_profile current;
+        std::deque<frame_profile> history;
+    };
+}
+
+#endif //RASTERIZER_PROFILER_H
@@ -7,6 +7,7 @@
 #include <eigen3/Eigen/Eigen>
 #include "Texture.hpp"
 
+class shadow_atlas;
 
 struct fragment_shader_payload
 {
@@ -22,10 +23,58 @@ struct fragment_shader_payload
     Eigen::Vector3f view_pos;
     Eigen::Vector3f color;
     Eigen::Vector3f normal;
+    // View space tangent (direction of increasing u); the bitangent is w * cross(normal, tangent).
+    // Zero if the mesh has no tangents.
+    Eigen::Vector4f tangent = Eigen::Vector4f::Zero();
     Eigen::Vector2f tex_coords;
+    // Screen-space derivatives of tex_coords, for picking the mip level
+    Eigen::Vector2f tex_dx = Eigen::Vector2f::Zero();
+    Eigen::Vector2f tex_dy = Eigen::Vector2f::Zero();
     Texture* texture;
+    Texture* normal_map = nullptr;
+    Texture* height_map = nullptr;
+    // Shadow maps of the scene's lights, nullptr if shadows are off
+    const shadow_atlas* shadows = nullptr;
 };
 
+// Quad shading: the rasterizer hands 2x2 blocks of pixels to the shader as one payload, one SIMD
+// lane per pixel. Lane i is the pixel (x + (i & 1), y + (i >> 1)) of the block. Attributes are
+// stored as structure of arrays, column k of a lane_vec3 holds component k of every lane.
+constexpr int quad_lanes = 4;
+using lane_float = Eigen::Array<float, quad_lanes, 1>;
+using lane_vec2 = Eigen::Array<float, quad_lanes, 2>;
+using lane_vec3 = Eigen::Array<float, quad_lanes, 3>;
+using lane_vec4 = Eigen::Array<float, quad_lanes, 4>;
+
+struct fragment_quad_payload
+{
+    // Bit i is set if lane i is covered and passed the depth test. The other lanes hold
+    // extrapolated attributes and their results are discarded.
+    unsigned mask = 0;
+
+    lane_vec3 view_pos;
+    lane_vec3 color;
+    lane_vec3 normal;
+    lane_vec4 tangent;
+    lane_vec2 tex_coords;
+    Eigen::Vector2f tex_dx = Eigen::Vector2f::Zero();
+    Eigen::Vector2f tex_dy = Eigen::Vector2f::Zero();
+    Texture* texture = nullptr;
+    Texture* normal_map = nullptr;
+    Texture* height_map = nullptr;
+    const shadow_atlas* shadows = nullptr;
+};
+
+inline lane_float dot_lanes(const lane_vec3& a, const lane_vec3& b)
+{
+    return (a * b).rowwise().sum();
+}
+
+inline lane_vec3 normalize_lanes(const lane_vec3& a)
+{
+    return a.colwise() * dot_lanes(a, a).rsqrt();
+}
+
 struct vertex_shader_payload
 {
     Eigen::Vector3f position;
@@ -0,0 +1,191 @@
+//
+// Shadow maps for the rasterizer's point lights.
+//
+
+#include "ShadowMap.hpp"
+#include <cmath>
+
+shadow_atlas::shadow_atlas(int map_size, int max_lights)
+    : map_size(map_size), tiles_per_row(int(std::ceil(std::sqrt(float(std::max(1, max_lights)))))),
+      maps(std::max(1, max_lights))
+{
+    int atlas_size = map_size * tiles_per_row;
+    atlas.assign(size_t(atlas_size) * atlas_size, std::numeric_limits<float>::infinity());
+    for (int i = 0; i < int(maps.size()); ++i)
+    {
+        maps[i].tile_x = (i % tiles_per_row) * map_size;
+        maps[i].tile_y = (i / tiles_per_row) * map_size;
+    }
+
+    depth_pass = std::make_unique<rst::rasterizer>(map_size, map_size);
+    depth_pass->set_depth_only(true);
+}
+
+shadow_atlas::~shadow_atlas() = default;
+
+void shadow_atlas::set_geometry(const std::vector<Eigen::Vector3f>& positions, const std::vector<Eigen::Vector3i>& indices,
+                                std::vector<Eigen::Matrix4f> instances)
+{
+    if (instances.empty())
+    {
+        instances.push_back(Eigen::Matrix4f::Identity());
+    }
+
+    // Geometry set before is replaced, not kept around
+    if (depth_pass->position_buffers().valid(pos_id))
+    {
+        depth_pass->position_buffers().release(pos_id);
+        depth_pass->index_buffers().release(ind_id);
+        depth_pass->instance_buffers().release(inst_id);
+    }
+    pos_id = depth_pass->load_positions(positions);
+    ind_id = depth_pass->load_indices(indices);
+    has_geometry = !positions.empty() && !indices.empty();
+
+    // Bounding sphere of all instances, around the center of their bounding box
+    Eigen::Vector3f lo = Eigen::Vector3f::Constant(std::numeric_limits<float>::max());
+    Eigen::Vector3f hi = -lo;
+    for (auto& m : instances)
+    {
+        for (auto& p : positions)
+        {
+            Eigen::Vector3f q = (m * p.homogeneous()).head<3>();
+            lo = lo.cwiseMin(q);
+            hi = hi.cwiseMax(q);
+        }
+    }
+    bounds_center = has_geometry ? Eigen::Vector3f((lo + hi) / 2) : Eigen::Vector3f::Zero();
+    bounds_radius = 0;
+    for (auto& m : instances)
+    {
+        for (auto& p : positions)
+        {
+            bounds_radius = std::max(bounds_radius, ((m * p.homogeneous()).head<3>() - bounds_center).norm());
+        }
+    }
+    inst_id = depth_pass->load_instances(std::move(instances));
+
+    for (auto& map : maps)
+    {
+        map.valid = false;
+    }
+}
+
+void shadow_atlas::update(const std::vector<Eigen::Vector3f>& light_positions, const Eigen::Matrix4f& model_view)
+{
+    for (int i = 0; i < int(maps.size()); ++i)
+    {
+        light_map& map = maps[i];
+        if (i >= int(light_positions.size()) || !has_geometry)
+        {
+            map.valid = false;
+            continue;
+        }
+        if (map.valid && map.light_pos == light_positions[i] && map.model_view == model_view)
+        {
+            continue;
+        }
+        map.light_pos = light_positions[i];
+        map.model_view = model_view;
+        render(map);
+    }
+}
+
+// Looks from eye towards target, y as close to up as possible; maps to a space looking down -z
+static Eigen::Matrix4f look_at(const Eigen::Vector3f& eye, const Eigen::Vector3f& target)
+{
+    Eigen::Vector3f forward = (target - eye).normalized();
+    Eigen::Vector3f up = std::abs(forward.y()) > 0.99f ? Eigen::Vector3f::UnitZ() : Eigen::Vector3f::UnitY();
+    Eigen::Vector3f right = forward.cross(up).normalized();
+    up = right.cross(forward);
+
+    Eigen::Matrix4f view = Eigen::Matrix4f::Identity();
+    view.block<1, 3>(0, 0) = right.transpose();
+    view.block<1, 3>(1, 0) = up.transpose();
+    view.block<1, 3>(2, 0) = -forward.transpose();
+    view(0, 3) = -right.dot(eye);
+    view(1, 3) = -up.dot(eye);
+    view(2, 3) = forward.dot(eye);
+    return view;
+}
+
+void shadow_atlas::render(light_map& map)
+{
+    // Frustum around the bounding sphere as seen from the light
+    Eigen::Vector3f center = (map.model_view * bounds_center.homogeneous()).head<3>();
+    float scale = map.model_view.topLeftCorner<3, 3>().colwise().norm().maxCoeff();
+    float radius = bounds_radius * scale * 1.01f;
+    float distance = (center - map.light_pos).norm();
+    float half_angle = distance > radius ? std::asin(radius / distance) : float(EIGEN_PI) / 2 * 0.95f;
+
+    map.near = std::max(0.05f, distance - radius);
+    map.far = distance + radius;
+    map.light_view = look_at(map.light_pos, center);
+    float y_ratio = 1.0f / std::tan(half_angle);
+    map.light_projection << y_ratio, 0, 0, 0,
+                            0, y_ratio, 0, 0,
+                            0, 0, -(map.far + map.near) / (map.far - map.near), -2 * map.far * map.near / (map.far - map.near),
+                            0, 0, -1, 0;
+    map.texel_size = 2.0f * distance * std::tan(half_angle) / map_size;
+
+    depth_pass->clear(rst::Buffers::Depth);
+    depth_pass->set_model(map.model_view);
+    depth_pass->set_view(map.light_view);
+    depth_pass->set_projection(map.light_projection);
+    depth_pass->draw_indexed(pos_id, rst::col_buf_id{}, rst::tex_buf_id{}, ind_id, inst_id);
+    depth_pass->depth_buffer(depth_scratch);
+
+    // Stored as the distance along the light's axis, so the comparison bias is in scene units
+    int atlas_size = map_size * tiles_per_row;
+    for (int y = 0; y < map_size; ++y)
+    {
+        float* row = atlas.data() + size_t(map.tile_y + y) * atlas_size + map.tile_x;
+        const float* src = depth_scratch.data() + size_t(y) * map_size;
+        for (int x = 0; x < map_size; ++x)
+        {
+            float ndc = src[x];
+            row[x] = std::isinf(ndc) ? ndc : 2 * map.far * map.near / (map.far + map.near - ndc * (map.far - map.near));
+        }
+    }
+    map.valid = true;
+    render_count++;
+}
+
+float shadow_atlas::visibility(int light, const Eigen::Vector3f& view_pos, const Eigen::Vector3f& normal) const
+{
+    if (light < 0 || light >= int(maps.size()) || !maps[light].valid)
+    {
+        return 1.0f;
+    }
+    const light_map& map = maps[light];
+
+    // Pushing the point along its normal by a texel or two keeps surfaces from shadowing themselves
+    Eigen::Vector3f p = view_pos + normal * (1.5f * map.texel_size);
+    Eigen::Vector4f light_pos = map.light_view * p.homogeneous();
+    Eigen::Vector4f clip = map.light_projection * light_pos;
+    if (clip.w() <= 0)
+    {
+        return 1.0f;
+    }
+    float x = 0.5f * map_size * (clip.x() / clip.w() + 1.0f);
+    float y = 0.5f * map_size * (clip.y() / clip.w() + 1.0f);
+    if (x < 0 || y < 0 || x >= map_size || y >= map_size)
+    {
+        return 1.0f;
+    }
+
+    float depth = -light_pos.z() - map.texel_size;
+    int cx = int(x), cy = int(y);
+    int atlas_size = map_size * tiles_per_row;
+    int lit = 0;
+    for (int dy = -1; dy <= 1; ++dy)
+    {
+        for (int dx = -1; dx <= 1; ++dx)
+        {
+            int tx = std::clamp(cx + dx, 0, map_size - 1);
+            int ty = std::clamp(cy + dy, 0, map_size - 1);
+            lit += depth <= atlas[size_t(map.tile_y + ty) * atlas_size + map.tile_x + tx];
+        }
+    }
+    return lit / 9.0f;
+}
@@ -0,0 +1,74 @@
+//
+// Shadow maps for the rasterizer's point lights.
+//
+
+#ifndef RASTERIZER_SHADOWMAP_H
+#define RASTERIZER_SHADOWMAP_H
+
+#include <eigen3/Eigen/Eigen>
+#include <memory>
+#include <vector>
+#include "rasterizer.hpp"
+
+/*
+ * One shadow map per light, stored as tiles of a single depth atlas. A map is rendered with a
+ * depth-only rst::rasterizer from the light towards the geometry's bounding sphere, with a frustum
+ * just wide enough to hold it. Maps are kept between frames: update() only renders the ones whose
+ * light or model-view transform changed since their last render, or all of them after the geometry
+ * was replaced.
+ *
+ * Lights and shading points are in view space, like the fragment shaders' view_pos. visibility()
+ * is safe to call from several threads once update() has returned.
+ */
+class shadow_atlas
+{
+public:
+    explicit shadow_atlas(int map_size = 1024, int max_lights = 4);
+    ~shadow_atlas();
+
+    // Shadow casting triangles in object space, drawn once per instance transform; without
+    // instances they are drawn once as they are
+    void set_geometry(const std::vector<Eigen::Vector3f>& positions, const std::vector<Eigen::Vector3i>& indices,
+                      std::vector<Eigen::Matrix4f> instances = {});
+
+    // Brings the maps of the given lights up to date, light i uses tile i
+    void update(const std::vector<Eigen::Vector3f>& light_positions, const Eigen::Matrix4f& model_view);
+
+    // Fraction of a 3x3 texel neighbourhood around the point that sees the light, 1 outside its map
+    float visibility(int light, const Eigen::Vector3f& view_pos, const Eigen::Vector3f& normal) const;
+
+    // Number of maps rendered so far, cached ones are not counted
+    int renders() const { return render_count; }
+
+private:
+    struct light_map
+    {
+        bool valid = false;
+        Eigen::Vector3f light_pos;
+        Eigen::Matrix4f model_view;   // of the geometry when the map was rendered
+        Eigen::Matrix4f light_view;   // view space -> light space
+        Eigen::Matrix4f light_projection;
+        float near, far;
+        float texel_size;             // at the bounding sphere's center, in view space units
+        int tile_x, tile_y;
+    };
+
+    void render(light_map& map);
+
+    int map_size;
+    int tiles_per_row;
+    std::vector<light_map> maps;
+    std::vector<float> atlas;        // linear light space depth, rows of map_size texels, y up
+
+    std::unique_ptr<rst::rasterizer> depth_pass;
+    rst::pos_buf_id pos_id;
+    rst::ind_buf_id ind_id;
+    rst::inst_buf_id inst_id;
+    bool has_geometry = false;
+    Eigen::Vector3f bounds_center = Eigen::Vector3f::Zero();
+    float bounds_radius = 0;
+    std::vector<float> depth_scratch;
+    int render_count = 0;
+};
+
+#endif //RASTERIZER_SHADOWMAP_H
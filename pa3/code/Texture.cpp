@@ -2,3 +2,294 @@
 // Created by LEI XU on 4/27/19.
 //
 
+#include "Texture.hpp"
+#include <filesystem>
+#include <random>
+#include <stdexcept>
+#include <opencv2/opencv.hpp>
+
+// .rtex header, followed by the tiles of every level, level 0 first, tiles in row-major order
+struct rtex_header
+{
+    uint32_t magic;
+    uint32_t version;
+    uint32_t width, height;
+    uint32_t levels;
+    uint32_t tile_size;
+    float normal_scale;   // 0 for color textures
+};
+static constexpr uint32_t rtex_magic = 0x58455452;  // "RTEX"
+static constexpr uint32_t rtex_version = 2;
+
+static uint32_t pack_texel(const Eigen::Vector4f& c)
+{
+    return uint32_t(c.x() + 0.5f) | uint32_t(c.y() + 0.5f) << 8 | uint32_t(c.z() + 0.5f) << 16 | uint32_t(c.w() + 0.5f) << 24;
+}
+
+static Eigen::Vector4f unpack_texel(uint32_t c)
+{
+    return {float(c & 0xff), float((c >> 8) & 0xff), float((c >> 16) & 0xff), float(c >> 24)};
+}
+
+// Replaces every texel of a height map with the normal of the height field and the height itself.
+// The gradient is the forward difference the bump shaders used to take per fragment; v points up,
+// so +v is the previous image row.
+static void bake_normal_map(std::vector<uint32_t>& texels, int w, int h, float scale)
+{
+    std::vector<float> height(texels.size());
+    for (size_t i = 0; i < texels.size(); ++i)
+    {
+        height[i] = unpack_texel(texels[i]).head<3>().norm();
+    }
+
+    for (int y = 0; y < h; ++y)
+    {
+        for (int x = 0; x < w; ++x)
+        {
+            float h0 = height[size_t(y) * w + x];
+            float du = scale * (height[size_t(y) * w + std::min(x + 1, w - 1)] - h0);
+            float dv = scale * (height[size_t(std::max(y - 1, 0)) * w + x] - h0);
+            Eigen::Vector3f n = Eigen::Vector3f(-du, -dv, 1.0f).normalized();
+            Eigen::Vector4f texel;
+            texel << (n.array() + 1.0f) * 127.5f, h0 / std::sqrt(3.0f);
+            texels[size_t(y) * w + x] = pack_texel(texel);
+        }
+    }
+}
+
+// Decodes the image once and writes its whole mip chain as tiles. Only the level being
+// downsampled is kept in memory in linear order.
+static void convert_to_tiles(const std::string& image_path, const std::string& tiled_path,
+                             const rst::tiled_layout& tile_layout, float normal_scale)
+{
+    cv::Mat image_data = cv::imread(image_path);
+    if (image_data.empty())
+    {
+        throw std::runtime_error("cannot read texture " + image_path);
+    }
+    cv::cvtColor(image_data, image_data, cv::COLOR_RGB2BGR);
+
+    int w = image_data.cols, h = image_data.rows;
+    std::vector<uint32_t> level(size_t(w) * h);
+    for (int y = 0; y < h; ++y)
+    {
+        for (int x = 0; x < w; ++x)
+        {
+            auto color = image_data.at<cv::Vec3b>(y, x);
+            level[size_t(y) * w + x] = pack_texel(Eigen::Vector4f(color[0], color[1], color[2], 255));
+        }
+    }
+    image_data.release();
+    if (normal_scale > 0)
+    {
+        bake_normal_map(level, w, h, normal_scale);
+    }
+
+    int num_levels = 1;
+    for (int lw = w, lh = h; lw > 1 || lh > 1; lw = std::max(1, lw / 2), lh = std::max(1, lh / 2))
+    {
+        num_levels++;
+    }
+
+    // Written next to the final file and renamed, so an interrupted conversion is never picked up.
+    // Batch workers may convert the same image at once, each into its own temporary file.
+    std::string tmp_path = tiled_path + ".tmp" + std::to_string(std::random_device{}());
+    std::ofstream out(tmp_path, std::ios::binary);
+    rtex_header header{rtex_magic, rtex_version, uint32_t(w), uint32_t(h), uint32_t(num_levels), Texture::tile_size, normal_scale};
+    out.write(reinterpret_cast<const char*>(&header), sizeof(header));
+
+    std::vector<uint32_t> tile(Texture::tile_texels);
+    for (int l = 0; l < num_levels; ++l)
+    {
+        for (int ty = 0; ty < (h + Texture::tile_size - 1) / Texture::tile_size; ++ty)
+        {
+            for (int tx = 0; tx < (w + Texture::tile_size - 1) / Texture::tile_size; ++tx)
+            {
+                for (int j = 0; j < Texture::tile_size; ++j)
+                {
+                    for (int i = 0; i < Texture::tile_size; ++i)
+                    {
+                        int x = std::min(tx * Texture::tile_size + i, w - 1);
+                        int y = std::min(ty * Texture::tile_size + j, h - 1);
+                        tile[tile_layout.index(i, j)] = level[size_t(y) * w + x];
+                    }
+                }
+                out.write(reinterpret_cast<const char*>(tile.data()), tile.size() * sizeof(uint32_t));
+            }
+        }
+
+        // Every further level is a 2x2 box filter of the previous one, down to a single texel
+        int nw = std::max(1, w / 2), nh = std::max(1, h / 2);
+        std::vector<uint32_t> next(size_t(nw) * nh);
+        for (int y = 0; y < nh; ++y)
+        {
+            for (int x = 0; x < nw; ++x)
+            {
+                int x0 = std::min(2 * x, w - 1), x1 = std::min(2 * x + 1, w - 1);
+                int y0 = std::min(2 * y, h - 1), y1 = std::min(2 * y + 1, h - 1);
+                Eigen::Vector4f sum = unpack_texel(level[size_t(y0) * w + x0]) + unpack_texel(level[size_t(y0) * w + x1]) +
+                                      unpack_texel(level[size_t(y1) * w + x0]) + unpack_texel(level[size_t(y1) * w + x1]);
+                sum /= 4.0f;
+                next[size_t(y) * nw + x] = pack_texel(sum);
+            }
+        }
+        level = std::move(next);
+        w = nw;
+        h = nh;
+    }
+
+    out.close();
+    if (!out)
+    {
+        throw std::runtime_error("cannot write " + tmp_path);
+    }
+    std::filesystem::rename(tmp_path, tiled_path);
+}
+
+Texture::Texture(TextureManager& manager, const std::string& path, float normal_scale)
+    : manager(&manager), path(path), normal_scale(normal_scale)
+{
+}
+
+static bool read_header(std::ifstream& file, rtex_header& header, float normal_scale)
+{
+    file.read(reinterpret_cast<char*>(&header), sizeof(header));
+    return file && header.magic == rtex_magic && header.version == rtex_version &&
+           header.tile_size == uint32_t(Texture::tile_size) && header.normal_scale == normal_scale;
+}
+
+void Texture::open_file()
+{
+    namespace fs = std::filesystem;
+    std::string tiled_path = path + (normal_scale > 0 ? ".normal.rtex" : ".rtex");
+    bool have_image = fs::exists(path);
+    bool have_tiles = fs::exists(tiled_path);
+    if (!have_image && !have_tiles)
+    {
+        throw std::runtime_error("cannot find texture " + path);
+    }
+    if (!have_tiles || (have_image && fs::last_write_time(tiled_path) < fs::last_write_time(path)))
+    {
+        convert_to_tiles(path, tiled_path, tile_layout, normal_scale);
+    }
+
+    // A file from an older version or baked with another scale is converted again
+    file.open(tiled_path, std::ios::binary);
+    rtex_header header{};
+    bool valid = read_header(file, header, normal_scale);
+    if (!valid && have_image)
+    {
+        file.close();
+        convert_to_tiles(path, tiled_path, tile_layout, normal_scale);
+        file.open(tiled_path, std::ios::binary);
+        valid = read_header(file, header, normal_scale);
+    }
+    if (!valid)
+    {
+        throw std::runtime_error("invalid tiled texture " + tiled_path);
+    }
+
+    int w = int(header.width), h = int(header.height);
+    int first_tile = 0;
+    for (uint32_t l = 0; l < header.levels; ++l)
+    {
+        mip_level level;
+        level.width = w;
+        level.height = h;
+        level.tiles_x = (w + tile_size - 1) / tile_size;
+        level.tiles_y = (h + tile_size - 1) / tile_size;
+        level.first_tile = first_tile;
+        level.pages.assign(level.tiles_x * level.tiles_y, -1);
+        first_tile += level.tiles_x * level.tiles_y;
+        levels.push_back(std::move(level));
+
+        w = std::max(1, w / 2);
+        h = std::max(1, h / 2);
+    }
+}
+
+void Texture::read_tile(int level, int page, uint32_t* texels)
+{
+    size_t tile = size_t(levels[level].first_tile) + page;
+    file.seekg(std::streamoff(sizeof(rtex_header) + tile * tile_texels * sizeof(uint32_t)));
+    file.read(reinterpret_cast<char*>(texels), tile_texels * sizeof(uint32_t));
+    if (!file)
+    {
+        throw std::runtime_error("truncated tiled texture of " + path);
+    }
+}
+
+Eigen::Vector4f Texture::bilinear(int level, float u, float v)
+{
+    // Texel centers sit at integer + 0.5
+    const mip_level& l = levels[level];
+    float x = u * l.width - 0.5f;
+    float y = (1 - v) * l.height - 0.5f;
+    float x0 = std::floor(x), y0 = std::floor(y);
+    float s = x - x0, t = y - y0;
+    int xi = int(x0), yi = int(y0);
+
+    // Usually all four texels lie in one tile, which is then looked up only once
+    constexpr int mask = tile_size - 1;
+    if (xi >= 0 && yi >= 0 && xi + 1 < l.width && yi + 1 < l.height && (xi & mask) != mask && (yi & mask) != mask)
+    {
+        int page = (yi >> tile_bits) * l.tiles_x + (xi >> tile_bits);
+        const uint32_t* texels = manager->acquire(*this, level, page, levels[level].pages[page]);
+        int lx = xi & mask, ly = yi & mask;
+        Eigen::Vector4f top = (1 - s) * unpack(texels[tile_layout.index(lx, ly)]) + s * unpack(texels[tile_layout.index(lx + 1, ly)]);
+        Eigen::Vector4f bottom = (1 - s) * unpack(texels[tile_layout.index(lx, ly + 1)]) + s * unpack(texels[tile_layout.index(lx + 1, ly + 1)]);
+        return (1 - t) * top + t * bottom;
+    }
+
+    Eigen::Vector4f top = (1 - s) * fetch(level, xi, yi) + s * fetch(level, xi + 1, yi);
+    Eigen::Vector4f bottom = (1 - s) * fetch(level, xi, yi + 1) + s * fetch(level, xi + 1, yi + 1);
+    return (1 - t) * top + t * bottom;
+}
+
+Eigen::Vector4f Texture::trilinear(float u, float v, float lod)
+{
+    lod = std::clamp(lod, 0.0f, float(levels.size() - 1));
+    int level = int(lod);
+    float t = lod - level;
+    if (t == 0.0f)
+    {
+        return bilinear(level, u, v);
+    }
+    return (1 - t) * bilinear(level, u, v) + t * bilinear(level + 1, u, v);
+}
+
+Eigen::Vector4f Texture::sampleRGBA(const Eigen::Vector2f& uv, const Eigen::Vector2f& duv_dx, const Eigen::Vector2f& duv_dy)
+{
+    open();
+    switch (filter)
+    {
+        case TextureFilter::Nearest: return fetch(0, int(uv.x() * levels[0].width), int((1 - uv.y()) * levels[0].height));
+        case TextureFilter::Bilinear: return bilinear(0, uv.x(), uv.y());
+        default: break;
+    }
+
+    // Footprint of the pixel in level 0 texels
+    Eigen::Vector2f size((float)levels[0].width, (float)levels[0].height);
+    float len_x = duv_dx.cwiseProduct(size).norm();
+    float len_y = duv_dy.cwiseProduct(size).norm();
+    float major = std::max(len_x, len_y);
+    float minor = std::min(len_x, len_y);
+
+    if (filter == TextureFilter::Trilinear || major <= 1.0f)
+    {
+        return trilinear(uv.x(), uv.y(), std::log2(std::max(major, 1.0f)));
+    }
+
+    // The level is picked from the short axis, the long axis is covered by extra taps
+    int taps = std::min(int(std::ceil(major / std::max(minor, 1e-6f))), max_anisotropy);
+    float lod = std::log2(major / float(taps));
+    Eigen::Vector2f axis = len_x >= len_y ? duv_dx : duv_dy;
+
+    Eigen::Vector4f sum = Eigen::Vector4f::Zero();
+    for (int i = 0; i < taps; ++i)
+    {
+        Eigen::Vector2f p = uv + axis * ((i + 0.5f) / float(taps) - 0.5f);
+        sum += trilinear(p.x(), p.y(), lod);
+    }
+    return sum / float(taps);
+}
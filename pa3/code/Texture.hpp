@@ -5,50 +5,117 @@
 #ifndef RASTERIZER_TEXTURE_H
 #define RASTERIZER_TEXTURE_H
 #include "global.hpp"
+#include "Framebuffer.hpp"
+#include "TextureManager.hpp"
 #include <eigen3/Eigen/Eigen>
-#include <opencv2/opencv.hpp>
-class Texture{
-private:
-    cv::Mat image_data;
+#include <fstream>
+#include <string>
+
+enum class TextureFilter
+{
+    Nearest,      // level 0, closest texel
+    Bilinear,     // level 0, four texels
+    Trilinear,    // two mip levels picked from the screen-space footprint
+    Anisotropic   // several trilinear taps along the long axis of the footprint
+};
 
+/*
+ * A mip-mapped texture streamed from a tiled file. The first time a texture is sampled its image
+ * is converted to "<image>.rtex" (unless that file is already up to date): every mip level cut
+ * into 32x32 texel tiles of packed RGBA8, texels in the framebuffer's tiled order. Tiles are read
+ * on demand into memory owned by the TextureManager, which evicts the least recently used ones
+ * when its budget is reached. Addressing clamps to the edge; colors come out in [0, 255].
+ *
+ * A texture created with a normal_scale > 0 treats the image as a height map (height = length of
+ * the RGB color) and bakes it into "<image>.normal.rtex" instead: RGB holds the tangent space
+ * normal of the scaled height field mapped from [-1, 1] to [0, 255], alpha the height / sqrt(3).
+ *
+ * Textures are created by TextureManager::load and are not thread safe.
+ */
+class Texture{
 public:
-    Texture(const std::string& name)
+    static constexpr int tile_bits = 5;
+    static constexpr int tile_size = 1 << tile_bits;
+    static constexpr int tile_texels = tile_size * tile_size;
+
+    Texture(TextureManager& manager, const std::string& path, float normal_scale = 0.0f);
+
+    int width() { open(); return levels[0].width; }
+    int height() { open(); return levels[0].height; }
+    int mip_levels() { open(); return int(levels.size()); }
+
+    void set_filter(TextureFilter f, int anisotropy = 8)
     {
-        image_data = cv::imread(name);
-        cv::cvtColor(image_data, image_data, cv::COLOR_RGB2BGR);
-        width = image_data.cols;
-        height = image_data.rows;
+        filter = f;
+        max_anisotropy = std::max(1, anisotropy);
     }
 
-    int width, height;
-
+    // Unfiltered lookup in the full resolution level
     Eigen::Vector3f getColor(float u, float v)
     {
-        auto u_img = u * width;
-        auto v_img = (1 - v) * height;
-        auto color = image_data.at<cv::Vec3b>(v_img, u_img);
-        return Eigen::Vector3f(color[0], color[1], color[2]);
+        open();
+        return fetch(0, int(u * levels[0].width), int((1 - v) * levels[0].height)).head<3>();
     }
 
     Eigen::Vector3f getColorBilinear(float u, float v)
     {
-        auto u_img = u * width;
-        auto v_img = (1 - v) * height;
-        auto u_img_offset = (u_img - std::floor(u_img)) > 0.5? +1: -1;
-        auto v_img_offset = (v_img - std::floor(v_img)) > 0.5? +1: -1;
-        auto color_00 = image_data.at<cv::Vec3b>(v_img, u_img);
-        auto color_10 = image_data.at<cv::Vec3b>(v_img, std::clamp(int(u_img)+u_img_offset, 0, width));
-        auto color_01 = image_data.at<cv::Vec3b>(std::clamp(int(v_img)+v_img_offset, 0, height), u_img);
-        auto color_11 = image_data.at<cv::Vec3b>(std::clamp(int(v_img)+v_img_offset, 0, height),
-                                                 std::clamp(int(u_img)+u_img_offset, 0, width));
-
-        float x = std::abs(u_img-std::floor(u_img)-0.5f);
-        float y = std::abs(v_img-std::floor(v_img)-0.5f);
-        auto color_0 = (1-x)*color_00 + x*color_01;
-        auto color_1 = (1-x)*color_10 + x*color_11;
-        auto color = (1-y)*color_0 + y*color_1;
-        return Eigen::Vector3f(color[0], color[1], color[2]);
+        open();
+        return bilinear(0, u, v).head<3>();
+    }
+
+    // Filtered lookup with the configured filter. duv_dx and duv_dy are the derivatives of the
+    // texture coordinates with respect to the screen x and y, they determine the mip level.
+    Eigen::Vector3f sample(const Eigen::Vector2f& uv, const Eigen::Vector2f& duv_dx, const Eigen::Vector2f& duv_dy)
+    {
+        return sampleRGBA(uv, duv_dx, duv_dy).head<3>();
     }
 
+    // Same as sample, including alpha
+    Eigen::Vector4f sampleRGBA(const Eigen::Vector2f& uv, const Eigen::Vector2f& duv_dx, const Eigen::Vector2f& duv_dy);
+
+private:
+    friend class TextureManager;
+
+    struct mip_level
+    {
+        int width, height;
+        int tiles_x, tiles_y;
+        int first_tile;           // position of the level's first tile in the file
+        std::vector<int> pages;   // resident slot in the manager per tile, -1 if not loaded
+    };
+
+    // The file is only touched once the texture is first used
+    void open() { if (levels.empty()) open_file(); }
+    void open_file();
+    void read_tile(int level, int page, uint32_t* texels);
+
+    Eigen::Vector4f fetch(int level, int x, int y);
+    static Eigen::Vector4f unpack(uint32_t c)
+    {
+        return {float(c & 0xff), float((c >> 8) & 0xff), float((c >> 16) & 0xff), float(c >> 24)};
+    }
+    Eigen::Vector4f bilinear(int level, float u, float v);
+    Eigen::Vector4f trilinear(float u, float v, float lod);
+
+    TextureManager* manager;
+    std::string path;
+    float normal_scale;
+    std::ifstream file;
+    std::vector<mip_level> levels;
+    rst::tiled_layout tile_layout{tile_size, tile_size};
+
+    TextureFilter filter = TextureFilter::Trilinear;
+    int max_anisotropy = 8;
 };
+
+inline Eigen::Vector4f Texture::fetch(int level, int x, int y)
+{
+    mip_level& l = levels[level];
+    x = std::clamp(x, 0, l.width - 1);
+    y = std::clamp(y, 0, l.height - 1);
+    int page = (y >> tile_bits) * l.tiles_x + (x >> tile_bits);
+    const uint32_t* texels = manager->acquire(*this, level, page, l.pages[page]);
+    return unpack(texels[tile_layout.index(x & (tile_size - 1), y & (tile_size - 1))]);
+}
+
 #endif //RASTERIZER_TEXTURE_H
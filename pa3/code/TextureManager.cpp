@@ -0,0 +1,107 @@
+//
+// Texture residency for the rasterizer.
+//
+
+#include "TextureManager.hpp"
+#include "Texture.hpp"
+#include <algorithm>
+
+TextureManager::TextureManager(size_t budget_bytes)
+{
+    static_assert(tile_texels == Texture::tile_texels, "tile size mismatch");
+    set_budget(budget_bytes);
+}
+
+TextureManager::~TextureManager() = default;
+
+texture_handle TextureManager::load(const std::string& path)
+{
+    return register_texture(path, 0.0f);
+}
+
+texture_handle TextureManager::load_normal_map(const std::string& height_path, float scale)
+{
+    return register_texture(height_path, scale);
+}
+
+texture_handle TextureManager::register_texture(const std::string& path, float normal_scale)
+{
+    auto key = std::make_pair(path, normal_scale);
+    auto it = paths.find(key);
+    if (it != paths.end())
+    {
+        return {it->second};
+    }
+
+    int id = int(textures.size());
+    textures.push_back(std::make_unique<Texture>(*this, path, normal_scale));
+    paths.emplace(key, id);
+    return {id};
+}
+
+Texture* TextureManager::get(texture_handle handle)
+{
+    if (handle.id < 0 || handle.id >= int(textures.size()))
+    {
+        return nullptr;
+    }
+    return textures[handle.id].get();
+}
+
+void TextureManager::set_budget(size_t budget_bytes)
+{
+    for (auto& slot : slots)
+    {
+        *slot.page_entry = -1;
+    }
+    slots.clear();
+    lru_head = lru_tail = -1;
+
+    // The pool never grows past its reservation, so texel pointers stay valid until eviction
+    slot_count = std::max<size_t>(1, budget_bytes / tile_bytes);
+    pool.clear();
+    pool.shrink_to_fit();
+    pool.reserve(slot_count * tile_texels);
+}
+
+int TextureManager::page_in(Texture& texture, int level, int page, int& page_entry)
+{
+    int slot;
+    if (slots.size() < slot_count)
+    {
+        slot = int(slots.size());
+        slots.push_back({});
+        pool.resize(pool.size() + tile_texels);
+    }
+    else
+    {
+        slot = lru_tail;
+        unlink(slot);
+        *slots[slot].page_entry = -1;
+        statistics.tiles_evicted++;
+    }
+
+    slots[slot].page_entry = &page_entry;
+    push_front(slot);
+    texture.read_tile(level, page, pool.data() + size_t(slot) * tile_texels);
+    statistics.tiles_loaded++;
+    return slot;
+}
+
+void TextureManager::unlink(int slot)
+{
+    auto& s = slots[slot];
+    if (s.prev >= 0) slots[s.prev].next = s.next; else lru_head = s.next;
+    if (s.next >= 0) slots[s.next].prev = s.prev; else lru_tail = s.prev;
+    s.prev = s.next = -1;
+}
+
+void TextureManager::push_front(int slot)
+{
+    auto& s = slots[slot];
+    s.prev = -1;
+    s.next = lru_head;
+    if (lru_head >= 0) slots[lru_head].prev = slot;
+    lru_head = slot;
+    if (lru_tail < 0) lru_tail = slot;
+}
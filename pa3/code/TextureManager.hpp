@@ -0,0 +1,99 @@
+//
+// Texture residency for the rasterizer.
+//
+
+#ifndef RASTERIZER_TEXTUREMANAGER_H
+#define RASTERIZER_TEXTUREMANAGER_H
+
+#include <cstddef>
+#include <cstdint>
+#include <map>
+#include <memory>
+#include <string>
+#include <vector>
+
+class Texture;
+
+// Refers to a texture registered with a TextureManager, cheap to copy around
+struct texture_handle
+{
+    int id = -1;
+};
+
+/*
+ * Owns all textures and the memory their tiles are streamed into. Registering a texture does not
+ * read it; tiles are paged in when a sample first touches them. Once budget_bytes worth of tiles
+ * are resident, the least recently used tile is evicted to make room for a new one.
+ */
+class TextureManager
+{
+public:
+    explicit TextureManager(size_t budget_bytes = size_t(64) << 20);
+    ~TextureManager();
+
+    // Registering the same path twice returns the same handle
+    texture_handle load(const std::string& path);
+
+    // Registers the height map at path as a normal map baked with the given gradient scale, see Texture
+    texture_handle load_normal_map(const std::string& height_path, float scale);
+
+    // nullptr for an invalid handle
+    Texture* get(texture_handle handle);
+
+    // Changing the budget drops every resident tile
+    void set_budget(size_t budget_bytes);
+    size_t budget() const { return slot_count * tile_bytes; }
+    size_t resident_bytes() const { return slots.size() * tile_bytes; }
+
+    struct streaming_stats
+    {
+        int tiles_loaded = 0;
+        int tiles_evicted = 0;
+    };
+    const streaming_stats& stats() const { return statistics; }
+
+    // Returns the texels of a tile, loading it if needed. slot is the texture's page table entry.
+    const uint32_t* acquire(Texture& texture, int level, int page, int& slot)
+    {
+        if (slot < 0)
+        {
+            slot = page_in(texture, level, page, slot);
+        }
+        else if (slot != lru_head)
+        {
+            unlink(slot);
+            push_front(slot);
+        }
+        return pool.data() + size_t(slot) * tile_texels;
+    }
+
+private:
+    texture_handle register_texture(const std::string& path, float normal_scale);
+    int page_in(Texture& texture, int level, int page, int& page_entry);
+    void unlink(int slot);
+    void push_front(int slot);
+
+    // 32x32 RGBA8 texels, the tile size of the .rtex files
+    static constexpr size_t tile_texels = 32 * 32;
+    static constexpr size_t tile_bytes = tile_texels * sizeof(uint32_t);
+
+    std::vector<std::unique_ptr<Texture>> textures;
+    std::map<std::pair<std::string, float>, int> paths;   // (path, normal scale) -> id
+
+    // One entry per resident tile, chained from most (lru_head) to least (lru_tail) recently used
+    struct tile_slot
+    {
+        int* page_entry;   // the owning texture's page table entry, reset on eviction
+        int prev = -1;
+        int next = -1;
+    };
+    std::vector<tile_slot> slots;
+    std::vector<uint32_t> pool;
+    size_t slot_count = 0;
+    int lru_head = -1;
+    int lru_tail = -1;
+
+    streaming_stats statistics;
+};
+
+#endif //RASTERIZER_TEXTUREMANAGER_H
@@ -18,6 +18,10 @@ Triangle::Triangle() {
     tex_coords[0] << 0.0, 0.0;
     tex_coords[1] << 0.0, 0.0;
     tex_coords[2] << 0.0, 0.0;
+
+    tangent[0] << 0.0, 0.0, 0.0, 1.0;
+    tangent[1] << 0.0, 0.0, 0.0, 1.0;
+    tangent[2] << 0.0, 0.0, 0.0, 1.0;
 }
 
 void Triangle::setVertex(int ind, Vector4f ver){
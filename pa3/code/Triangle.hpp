@@ -17,6 +17,7 @@ public:
     Vector3f color[3]; //color at each vertex;
     Vector2f tex_coords[3]; //texture u,v
     Vector3f normal[3]; //normal vector for each vertex
+    Vector4f tangent[3]; //tangent and bitangent sign for each vertex
 
     Texture *tex= nullptr;
     Triangle();
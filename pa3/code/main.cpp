@@ -1,4 +1,10 @@
 #include <iostream>
+#include <atomic>
+#include <filesystem>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <thread>
 #include <opencv2/opencv.hpp>
 
 #include "global.hpp"
@@ -7,6 +13,9 @@
 #include "Shader.hpp"
 #include "Texture.hpp"
 #include "OBJ_Loader.h"
+#include "FramePipeline.hpp"
+#include "BatchJob.hpp"
+#include "ShadowMap.hpp"
 
 Eigen::Matrix4f get_view_matrix(Eigen::Vector3f eye_pos)
 {
@@ -86,12 +95,29 @@ struct light
     Eigen::Vector3f intensity;
 };
 
+// Lights of every lit shader, in view space; light i casts its shadows through shadow map i
+const std::array<light, 2> lights = {light{{20, 20, 20}, {500, 500, 500}}, light{{-20, 20, 0}, {500, 500, 500}}};
+
+std::vector<Eigen::Vector3f> light_positions()
+{
+    std::vector<Eigen::Vector3f> positions;
+    for (auto& l : lights)
+        positions.push_back(l.position);
+    return positions;
+}
+
+// 1 where light i reaches the point, less in its shadow
+float light_visibility(const shadow_atlas* shadows, int i, const Eigen::Vector3f& point, const Eigen::Vector3f& normal)
+{
+    return shadows ? shadows->visibility(i, point, normal) : 1.0f;
+}
+
 Eigen::Vector3f texture_fragment_shader(const fragment_shader_payload& payload)
 {
     Eigen::Vector3f return_color = {0, 0, 0};
     if (payload.texture)
     {
-        return_color = payload.texture->getColorBilinear(payload.tex_coords[0], payload.tex_coords[1]);
+        return_color = payload.texture->sample(payload.tex_coords, payload.tex_dx, payload.tex_dy);
     }
     Eigen::Vector3f texture_color;
     texture_color << return_color.x(), return_color.y(), return_color.z();
@@ -100,10 +126,6 @@ Eigen::Vector3f texture_fragment_shader(const fragment_shader_payload& payload)
     Eigen::Vector3f kd = texture_color / 255.f;
     Eigen::Vector3f ks = Eigen::Vector3f(0.7937, 0.7937, 0.7937);
 
-    auto l1 = light{{20, 20, 20}, {500, 500, 500}};
-    auto l2 = light{{-20, 20, 0}, {500, 500, 500}};
-
-    std::vector<light> lights = {l1, l2};
     Eigen::Vector3f amb_light_intensity{10, 10, 10};
     Eigen::Vector3f eye_pos{0, 0, 10};
 
@@ -115,8 +137,9 @@ Eigen::Vector3f texture_fragment_shader(const fragment_shader_payload& payload)
 
     Eigen::Vector3f result_color = {0, 0, 0};
 
-    for (auto& light : lights)
+    for (int i = 0; i < int(lights.size()); ++i)
     {
+        auto& light = lights[i];
         float dis = (light.position - point).norm();
         auto in_dir = (light.position - point).normalized();
         auto view_dir = (eye_pos-point).normalized();
@@ -124,7 +147,8 @@ Eigen::Vector3f texture_fragment_shader(const fragment_shader_payload& payload)
         auto diffuse = kd.cwiseProduct(light.intensity) * std::pow(dis, -2.0f) * std::max(0.f, normal.dot(in_dir));
         auto specular = ks.cwiseProduct(light.intensity) * std::pow(dis, -2.0f) * std::max(0.f, std::pow(normal.dot(mid_dir), p));
         auto ambient = ka.cwiseProduct(amb_light_intensity);
-        result_color += diffuse + specular + ambient;
+        float visibility = light_visibility(payload.shadows, i, point, normal);
+        result_color += (diffuse + specular) * visibility + ambient;
     }
 
     return result_color * 255.f;
@@ -136,10 +160,6 @@ Eigen::Vector3f phong_fragment_shader(const fragment_shader_payload& payload)
     Eigen::Vector3f kd = payload.color;
     Eigen::Vector3f ks = Eigen::Vector3f(0.7937, 0.7937, 0.7937);
 
-    auto l1 = light{{20, 20, 20}, {500, 500, 500}};
-    auto l2 = light{{-20, 20, 0}, {500, 500, 500}};
-
-    std::vector<light> lights = {l1, l2};
     Eigen::Vector3f amb_light_intensity{10, 10, 10};
     Eigen::Vector3f eye_pos{0, 0, 10};
 
@@ -149,8 +169,9 @@ Eigen::Vector3f phong_fragment_shader(const fragment_shader_payload& payload)
     Eigen::Vector3f normal = payload.normal;
 
     Eigen::Vector3f result_color = {0, 0, 0};
-    for (auto& light : lights)
+    for (int i = 0; i < int(lights.size()); ++i)
     {
+        auto& light = lights[i];
         float dis = (light.position - point).norm();
         auto in_dir = (light.position - point).normalized();
         auto view_dir = (eye_pos-point).normalized();
@@ -158,7 +179,8 @@ Eigen::Vector3f phong_fragment_shader(const fragment_shader_payload& payload)
         auto diffuse = kd.cwiseProduct(light.intensity) * std::pow(dis, -2.0f) * std::max(0.f, normal.dot(in_dir));
         auto specular = ks.cwiseProduct(light.intensity) * std::pow(dis, -2.0f) * std::max(0.f, std::pow(normal.dot(mid_dir), p));
         auto ambient = ka.cwiseProduct(amb_light_intensity);
-        result_color += diffuse + specular + ambient;
+        float visibility = light_visibility(payload.shadows, i, point, normal);
+        result_color += (diffuse + specular) * visibility + ambient;
     }
 
     return result_color * 255.f;
@@ -166,6 +188,105 @@ Eigen::Vector3f phong_fragment_shader(const fragment_shader_payload& payload)
 
 
 
+// Blinn-Phong lighting of the texture and phong shaders for a whole quad, every light is evaluated
+// for the four lanes at once
+lane_vec3 blinn_phong_lanes(const lane_vec3& kd, const fragment_quad_payload& quad)
+{
+    Eigen::Array3f ka(0.005, 0.005, 0.005);
+    Eigen::Array3f ks(0.7937, 0.7937, 0.7937);
+
+    Eigen::Array3f amb_light_intensity{10, 10, 10};
+    Eigen::Vector3f eye_pos{0, 0, 10};
+
+    float p = 150;
+
+    const lane_vec3& point = quad.view_pos;
+    const lane_vec3& normal = quad.normal;
+    lane_vec3 view_dir = normalize_lanes((-point).rowwise() + eye_pos.transpose().array());
+
+    lane_vec3 result_color = lane_vec3::Zero();
+    for (int l = 0; l < int(lights.size()); ++l)
+    {
+        auto& light = lights[l];
+        Eigen::Array<float, 1, 3> intensity = light.intensity.transpose().array();
+        lane_vec3 to_light = (-point).rowwise() + light.position.transpose().array();
+        lane_float dis2 = dot_lanes(to_light, to_light);
+        lane_vec3 in_dir = to_light.colwise() * dis2.rsqrt();
+        lane_vec3 mid_dir = normalize_lanes(in_dir + view_dir);
+        lane_float diffuse = dot_lanes(normal, in_dir).max(0.f) / dis2;
+        lane_float specular = dot_lanes(normal, mid_dir).pow(p).max(0.f) / dis2;
+        if (quad.shadows)
+        {
+            lane_float visibility = lane_float::Ones();
+            for (int i = 0; i < quad_lanes; ++i)
+            {
+                if (quad.mask & (1u << i))
+                    visibility[i] = quad.shadows->visibility(l, point.row(i).transpose(), normal.row(i).transpose());
+            }
+            diffuse *= visibility;
+            specular *= visibility;
+        }
+        result_color += (kd.colwise() * diffuse).rowwise() * intensity;
+        result_color += specular.replicate<1, 3>().rowwise() * (ks.transpose() * intensity);
+        result_color.rowwise() += (ka * amb_light_intensity).transpose();
+    }
+
+    return result_color * 255.f;
+}
+
+lane_vec3 texture_quad_fragment_shader(const fragment_quad_payload& quad)
+{
+    lane_vec3 texture_color = lane_vec3::Zero();
+    if (quad.texture)
+    {
+        for (int i = 0; i < quad_lanes; ++i)
+        {
+            if (quad.mask & (1u << i))
+            {
+                Eigen::Vector2f uv = quad.tex_coords.row(i).transpose();
+                texture_color.row(i) = quad.texture->sample(uv, quad.tex_dx, quad.tex_dy).transpose().array();
+            }
+        }
+    }
+    return blinn_phong_lanes(texture_color / 255.f, quad);
+}
+
+lane_vec3 phong_quad_fragment_shader(const fragment_quad_payload& quad)
+{
+    return blinn_phong_lanes(quad.color, quad);
+}
+
+lane_vec3 normal_quad_fragment_shader(const fragment_quad_payload& quad)
+{
+    return (quad.normal + 1.0f) / 2.f * 255.f;
+}
+
+// Gradient scale of the height maps and displacement strength of the bump shaders
+constexpr float kh = 0.2f, kn = 0.1f;
+
+// Tangent frame of a fragment: the interpolated mesh tangent made orthogonal to the normal, or a
+// frame derived from the normal alone for meshes without tangents
+Eigen::Matrix3f tangent_frame(const fragment_shader_payload& payload)
+{
+    Eigen::Vector3f normal = payload.normal;
+    Eigen::Vector3f t = payload.tangent.head<3>() - normal * normal.dot(payload.tangent.head<3>());
+    Eigen::Vector3f b;
+    if (t.squaredNorm() > 1e-12f)
+    {
+        t.normalize();
+        b = (payload.tangent.w() < 0 ? -1.0f : 1.0f) * normal.cross(t);
+    }
+    else
+    {
+        float x = normal.x(), y = normal.y(), z = normal.z();
+        t = Vector3f{x*y/std::sqrt(x*x+z*z),std::sqrt(x*x+z*z),z*y/std::sqrt(x*x+z*z)};
+        b = normal.cross(t);
+    }
+    Matrix3f tbn;
+    tbn << t, b, normal;
+    return tbn;
+}
+
 Eigen::Vector3f displacement_fragment_shader(const fragment_shader_payload& payload)
 {
 
@@ -173,10 +294,6 @@ Eigen::Vector3f displacement_fragment_shader(const fragment_shader_payload& payl
     Eigen::Vector3f kd = payload.color;
     Eigen::Vector3f ks = Eigen::Vector3f(0.7937, 0.7937, 0.7937);
 
-    auto l1 = light{{20, 20, 20}, {500, 500, 500}};
-    auto l2 = light{{-20, 20, 0}, {500, 500, 500}};
-
-    std::vector<light> lights = {l1, l2};
     Eigen::Vector3f amb_light_intensity{10, 10, 10};
     Eigen::Vector3f eye_pos{0, 0, 10};
 
@@ -186,28 +303,21 @@ Eigen::Vector3f displacement_fragment_shader(const fragment_shader_payload& payl
     Eigen::Vector3f point = payload.view_pos;
     Eigen::Vector3f normal = payload.normal;
 
-    float kh = 0.2, kn = 0.1;
-
-    float x = normal.x(), y = normal.y(), z = normal.z();
-    Vector3f t{x*y/std::sqrt(x*x+z*z),std::sqrt(x*x+z*z),z*y/std::sqrt(x*x+z*z)};
-    auto b = normal.cross(t);
-    Matrix3f tbn;
-    tbn << t, b, normal;
-
-    auto u = payload.tex_coords[0], v = payload.tex_coords[1];
-    auto w = float(payload.texture->width), h = float(payload.texture->height);
-
-    auto dU = kh * kn * (payload.texture->getColor(u+1.0f/w,v).norm()-payload.texture->getColor(u,v).norm());
-    auto dV = kh * kn * (payload.texture->getColor(u,v+1.0f/h).norm()-payload.texture->getColor(u,v).norm());
-
-    Vector3f ln{-dU, -dV, 1.0f};
-    point += kn * normal * payload.texture->getColor(u, v).norm();
-    normal = (tbn * ln).normalized();
+    // Meshes whose material has no normal map are shaded with their interpolated normal
+    if (Texture* normal_map = payload.normal_map)
+    {
+        // One filtered fetch gives both the baked normal and the height (stored divided by sqrt(3))
+        Eigen::Vector4f texel = normal_map->sampleRGBA(payload.tex_coords, payload.tex_dx, payload.tex_dy);
+        Vector3f ln = texel.head<3>() / 127.5f - Vector3f::Ones();
+        point += kn * normal * texel.w() * std::sqrt(3.0f);
+        normal = (tangent_frame(payload) * ln).normalized();
+    }
 
     Eigen::Vector3f result_color = {0, 0, 0};
 
-    for (auto& light : lights)
+    for (int i = 0; i < int(lights.size()); ++i)
     {
+        auto& light = lights[i];
         float dis = (light.position - point).norm();
         auto in_dir = (light.position - point).normalized();
         auto view_dir = (eye_pos-point).normalized();
@@ -215,7 +325,8 @@ Eigen::Vector3f displacement_fragment_shader(const fragment_shader_payload& payl
         auto diffuse = kd.cwiseProduct(light.intensity) * std::pow(dis, -2.0f) * std::max(0.f, normal.dot(in_dir));
         auto specular = ks.cwiseProduct(light.intensity) * std::pow(dis, -2.0f) * std::max(0.f, std::pow(normal.dot(mid_dir), p));
         auto ambient = ka.cwiseProduct(amb_light_intensity);
-        result_color += diffuse + specular + ambient;
+        float visibility = light_visibility(payload.shadows, i, point, normal);
+        result_color += (diffuse + specular) * visibility + ambient;
     }
 
     return result_color * 255.f;
@@ -226,22 +337,13 @@ Eigen::Vector3f bump_fragment_shader(const fragment_shader_payload& payload)
 {
     Eigen::Vector3f normal = payload.normal;
 
-    float kh = 0.2, kn = 0.1;
-
-    float x = normal.x(), y = normal.y(), z = normal.z();
-    Vector3f t{x*y/std::sqrt(x*x+z*z),std::sqrt(x*x+z*z),z*y/std::sqrt(x*x+z*z)};
-    auto b = normal.cross(t);
-    Matrix3f tbn;
-    tbn << t, b, normal;
-
-    auto u = payload.tex_coords[0], v = payload.tex_coords[1];
-    auto w = float(payload.texture->width), h = float(payload.texture->height);
-
-    auto dU = kh * kn * (payload.texture->getColor(u+1.0f/w,v).norm()-payload.texture->getColor(u,v).norm());
-    auto dV = kh * kn * (payload.texture->getColor(u,v+1.0f/h).norm()-payload.texture->getColor(u,v).norm());
-
-    Vector3f ln{-dU, -dV, 1.0f};
-    normal = (tbn * ln).normalized();
+    // Meshes whose material has no normal map keep their interpolated normal
+    if (Texture* normal_map = payload.normal_map)
+    {
+        Eigen::Vector4f texel = normal_map->sampleRGBA(payload.tex_coords, payload.tex_dx, payload.tex_dy);
+        Vector3f ln = texel.head<3>() / 127.5f - Vector3f::Ones();
+        normal = (tangent_frame(payload) * ln).normalized();
+    }
 
     Eigen::Vector3f result_color = {0, 0, 0};
     result_color = normal;
@@ -249,117 +351,511 @@ Eigen::Vector3f bump_fragment_shader(const fragment_shader_payload& payload)
     return result_color * 255.f;
 }
 
-int main(int argc, const char** argv)
+// objl::Loader emits three fresh vertices per face; weld identical ones back together so the
+// rasterizer's vertex stage transforms each shared vertex only once.
+void weld_mesh(const objl::Mesh& mesh, std::vector<Eigen::Vector3f>& positions, std::vector<Eigen::Vector3f>& normals,
+               std::vector<Eigen::Vector2f>& texcoords, std::vector<Eigen::Vector3i>& indices)
 {
-    std::vector<Triangle*> TriangleList;
+    std::map<std::array<float, 8>, int> unique_vertices;
+    std::array<int, 3> face;
 
-    float angle = 140.0;
-    bool command_line = false;
+    for (int i = 0; i < mesh.Vertices.size(); i++)
+    {
+        auto& vert = mesh.Vertices[i];
+        std::array<float, 8> key = {vert.Position.X, vert.Position.Y, vert.Position.Z,
+                                    vert.Normal.X, vert.Normal.Y, vert.Normal.Z,
+                                    vert.TextureCoordinate.X, vert.TextureCoordinate.Y};
 
-    std::string filename = "output.png";
-    objl::Loader Loader;
-    std::string obj_path = "./models/spot/";
+        auto [it, inserted] = unique_vertices.emplace(key, int(positions.size()));
+        if (inserted)
+        {
+            positions.emplace_back(vert.Position.X, vert.Position.Y, vert.Position.Z);
+            normals.emplace_back(vert.Normal.X, vert.Normal.Y, vert.Normal.Z);
+            texcoords.emplace_back(vert.TextureCoordinate.X, vert.TextureCoordinate.Y);
+        }
 
-    // Load .obj File
-    assert(std::filesystem::exists("./models/spot/spot_triangulated_good.obj"));
-    bool loadout = Loader.LoadFile("./models/spot/spot_triangulated_good.obj");
+        face[i % 3] = it->second;
+        if (i % 3 == 2)
+        {
+            indices.emplace_back(face[0], face[1], face[2]);
+        }
+    }
+}
+
+// Per-vertex tangents for the vertices of one mesh: the direction of increasing u averaged over the
+// adjacent faces, made orthogonal to the normal. w records whether the bitangent (increasing v) is
+// cross(normal, tangent) or its opposite. Vertices without usable texture coordinates get zero.
+void compute_tangents(const std::vector<Eigen::Vector3f>& positions, const std::vector<Eigen::Vector3f>& normals,
+                      const std::vector<Eigen::Vector2f>& texcoords, const std::vector<Eigen::Vector3i>& indices,
+                      std::vector<Eigen::Vector4f>& tangents)
+{
+    tangents.resize(positions.size(), Eigen::Vector4f::Zero());
+    std::vector<Eigen::Vector3f> tan(positions.size(), Eigen::Vector3f::Zero());
+    std::vector<Eigen::Vector3f> bitan(positions.size(), Eigen::Vector3f::Zero());
 
-    for(auto mesh:Loader.LoadedMeshes)
+    for (auto& face : indices)
     {
-        for(int i=0;i<mesh.Vertices.size();i+=3)
+        Eigen::Vector3f e1 = positions[face[1]] - positions[face[0]];
+        Eigen::Vector3f e2 = positions[face[2]] - positions[face[0]];
+        Eigen::Vector2f duv1 = texcoords[face[1]] - texcoords[face[0]];
+        Eigen::Vector2f duv2 = texcoords[face[2]] - texcoords[face[0]];
+        float det = duv1.x() * duv2.y() - duv2.x() * duv1.y();
+        if (det == 0)
         {
-            Triangle* t = new Triangle();
-            for(int j=0;j<3;j++)
+            continue;
+        }
+        Eigen::Vector3f t = (e1 * duv2.y() - e2 * duv1.y()) / det;
+        Eigen::Vector3f b = (e2 * duv1.x() - e1 * duv2.x()) / det;
+        for (int j = 0; j < 3; ++j)
+        {
+            tan[face[j]] += t;
+            bitan[face[j]] += b;
+        }
+    }
+
+    for (auto& face : indices)
+    {
+        for (int j = 0; j < 3; ++j)
+        {
+            int i = face[j];
+            const Eigen::Vector3f& n = normals[i];
+            Eigen::Vector3f t = tan[i] - n * n.dot(tan[i]);
+            if (t.squaredNorm() < 1e-12f)
             {
-                t->setVertex(j,Vector4f(mesh.Vertices[i+j].Position.X,mesh.Vertices[i+j].Position.Y,mesh.Vertices[i+j].Position.Z,1.0));
-                t->setNormal(j,Vector3f(mesh.Vertices[i+j].Normal.X,mesh.Vertices[i+j].Normal.Y,mesh.Vertices[i+j].Normal.Z));
-                t->setTexCoord(j,Vector2f(mesh.Vertices[i+j].TextureCoordinate.X, mesh.Vertices[i+j].TextureCoordinate.Y));
+                continue;
             }
-            TriangleList.push_back(t);
+            t.normalize();
+            tangents[i] << t, n.cross(t).dot(bitan[i]) < 0 ? -1.0f : 1.0f;
         }
     }
+}
 
-    rst::rasterizer r(700, 700);
-    auto texture_path = "spot_texture.png";
-    assert(std::filesystem::exists(obj_path + texture_path));
-    r.set_texture(Texture(obj_path + texture_path));
-    std::function<Eigen::Vector3f(fragment_shader_payload)> active_shader = texture_fragment_shader;
+// Textures referenced by an MTL file are looked up next to the model; exporters often write
+// absolute paths from their own machine, so only the file name is kept. Empty if not found.
+std::string find_material_texture(const std::string& obj_path, const std::string& map)
+{
+    if (map.empty())
+    {
+        return {};
+    }
+    auto path = obj_path + map.substr(map.find_last_of("/\\") + 1);
+    if (!std::filesystem::exists(path))
+    {
+        std::cerr << "missing texture " << path << '\n';
+        return {};
+    }
+    return path;
+}
 
-    if (argc >= 2)
+// A model as loaded from disk, shared by every rasterizer that renders it
+struct scene
+{
+    struct mesh
     {
-        command_line = true;
-        filename = std::string(argv[1]);
+        std::vector<Eigen::Vector3i> indices;
+        std::string diffuse_path;
+        std::string height_path;
+        float opacity = 1.0f;
+    };
+
+    std::vector<Eigen::Vector3f> positions;
+    std::vector<Eigen::Vector3f> normals;
+    std::vector<Eigen::Vector2f> texcoords;
+    std::vector<Eigen::Vector4f> tangents;
+    std::vector<mesh> meshes;
+};
+
+scene load_scene(const std::string& obj_file)
+{
+    objl::Loader Loader;
+    if (!std::filesystem::exists(obj_file) || !Loader.LoadFile(obj_file))
+    {
+        throw std::runtime_error("cannot load model " + obj_file);
+    }
+    std::string obj_path = std::filesystem::path(obj_file).parent_path().string() + "/";
+
+    // All meshes share one set of vertex buffers and keep their own indices and textures
+    scene s;
+    for(auto& mesh:Loader.LoadedMeshes)
+    {
+        scene::mesh m;
+        weld_mesh(mesh, s.positions, s.normals, s.texcoords, m.indices);
+        compute_tangents(s.positions, s.normals, s.texcoords, m.indices, s.tangents);
+        m.diffuse_path = find_material_texture(obj_path, mesh.MeshMaterial.map_Kd);
+        m.height_path = find_material_texture(obj_path, mesh.MeshMaterial.map_bump);
+        // objl reports 0 when the MTL file has no "d" line
+        float dissolve = mesh.MeshMaterial.d;
+        m.opacity = dissolve > 0.0f && dissolve < 1.0f ? dissolve : 1.0f;
+
+        // spot has no MTL file, its texture doubles as the height map of the bump shaders
+        if (m.diffuse_path.empty() && m.height_path.empty() && std::filesystem::exists(obj_path + "spot_texture.png"))
+        {
+            m.diffuse_path = m.height_path = obj_path + "spot_texture.png";
+        }
+        s.meshes.push_back(std::move(m));
+    }
+    return s;
+}
+
+// Buffers and materials of a scene loaded into one rasterizer
+struct scene_buffers
+{
+    rst::pos_buf_id pos_id;
+    rst::col_buf_id col_id;
+    rst::col_buf_id normal_id;
+    rst::tex_buf_id texcoord_id;
+    std::vector<rst::submesh> meshes;
+};
+
+scene_buffers upload_scene(rst::rasterizer& r, const scene& s)
+{
+    scene_buffers buffers;
+    for (auto& mesh : s.meshes)
+    {
+        rst::material material;
+        material.opacity = mesh.opacity;
+        if (!mesh.diffuse_path.empty())
+            material.diffuse = r.load_texture(mesh.diffuse_path);
+        if (!mesh.height_path.empty())
+        {
+            material.normal = r.load_normal_map(mesh.height_path, kh * kn);
+            material.height = r.load_texture(mesh.height_path);
+        }
+        // The bump shaders shade from one bilinear fetch of the baked normal map, the way they
+        // used to read the height map from the full resolution level
+        if (Texture* normal_map = r.textures().get(material.normal))
+        {
+            normal_map->set_filter(TextureFilter::Bilinear);
+        }
+        buffers.meshes.push_back({r.load_indices(mesh.indices), r.add_material(material)});
+    }
+
+    buffers.pos_id = r.load_positions(s.positions);
+    buffers.col_id = r.load_colors(std::vector<Eigen::Vector3f>(s.positions.size(), {148, 121.0, 92.0}));
+    buffers.normal_id = r.load_normals(s.normals);
+    buffers.texcoord_id = r.load_texcoords(s.texcoords);
+    r.load_tangents(s.tangents);
+    return buffers;
+}
+
+// n copies of the scene on a square grid in its xz plane, one scene width apart
+std::vector<Eigen::Matrix4f> crowd_transforms(const scene& s, int n)
+{
+    std::vector<Eigen::Matrix4f> transforms(n, Eigen::Matrix4f::Identity());
+    if (n == 1 || s.positions.empty())
+        return transforms;
+
+    Eigen::Vector3f lo = s.positions[0], hi = s.positions[0];
+    for (auto& p : s.positions)
+    {
+        lo = lo.cwiseMin(p);
+        hi = hi.cwiseMax(p);
+    }
+    float spacing = 1.25f * std::max(hi.x() - lo.x(), hi.z() - lo.z());
+    int columns = int(std::ceil(std::sqrt(float(n))));
+    for (int i = 0; i < n; ++i)
+    {
+        transforms[i](0, 3) = (float(i % columns) - float(columns - 1) / 2) * spacing;
+        transforms[i](2, 3) = -float(i / columns) * spacing;
+    }
+    return transforms;
+}
+
+// Every mesh of the scene casts shadows, once per instance
+void set_shadow_casters(shadow_atlas& shadows, const scene& s, std::vector<Eigen::Matrix4f> instances = {})
+{
+    std::vector<Eigen::Vector3i> indices;
+    for (auto& mesh : s.meshes)
+        indices.insert(indices.end(), mesh.indices.begin(), mesh.indices.end());
+    shadows.set_geometry(s.positions, indices, std::move(instances));
+}
+
+bool has_transparency(const scene& s)
+{
+    return std::any_of(s.meshes.begin(), s.meshes.end(), [](const scene::mesh& m) { return m.opacity < 1.0f; });
+}
+
+// Shaders with a quad version run through it, the others one fragment at a time
+struct shader_choice
+{
+    std::function<Eigen::Vector3f(fragment_shader_payload)> fragment;
+    std::function<lane_vec3(const fragment_quad_payload&)> quad;
+};
+
+bool find_shader(const std::string& name, shader_choice& shader)
+{
+    if (name == "texture")
+        shader = {texture_fragment_shader, texture_quad_fragment_shader};
+    else if (name == "normal")
+        shader = {normal_fragment_shader, normal_quad_fragment_shader};
+    else if (name == "phong")
+        shader = {phong_fragment_shader, phong_quad_fragment_shader};
+    else if (name == "bump")
+        shader = {bump_fragment_shader, nullptr};
+    else if (name == "displacement")
+        shader = {displacement_fragment_shader, nullptr};
+    else
+        return false;
+    return true;
+}
+
+void set_shader(rst::rasterizer& r, const shader_choice& shader)
+{
+    if (shader.quad)
+        r.set_quad_fragment_shader(shader.quad);
+    else
+        r.set_fragment_shader(shader.fragment);
+}
+
+// Renders the jobs of a script on a pool of workers. The scene is loaded once; each worker keeps
+// one rasterizer per resolution it has rendered and writes every image as soon as it is done.
+int render_batch(const std::string& script_path)
+{
+    job_script script = load_job_script(script_path);
+    for (auto& job : script.jobs)
+    {
+        shader_choice shader;
+        if (!find_shader(job.shader, shader))
+        {
+            throw std::runtime_error("job script line " + std::to_string(job.line) + ": unknown shader '" + job.shader + "'");
+        }
+    }
+
+    auto start = std::chrono::steady_clock::now();
+    const scene model = load_scene(script.model);
+
+    int num_threads = script.threads > 0 ? script.threads : int(std::max(1u, std::thread::hardware_concurrency()));
+    num_threads = std::min(num_threads, std::max(1, int(script.jobs.size())));
 
-        if (argc == 3 && std::string(argv[2]) == "texture")
+    std::atomic<size_t> next_job{0};
+    std::atomic<int> failures{0};
+    std::mutex output_mutex;
+    auto worker = [&]() {
+        struct target
         {
-            std::cout << "Rasterizing using the texture shader\n";
-            active_shader = texture_fragment_shader;
-            texture_path = "spot_texture.png";
-            r.set_texture(Texture(obj_path + texture_path));
+            std::unique_ptr<rst::rasterizer> r;
+            scene_buffers buffers;
+            rst::inst_buf_id instances;
+            int instance_count = 0;
+        };
+        // Shadow maps do not depend on the resolution, they are shared by all of a worker's targets
+        std::unique_ptr<shadow_atlas> shadows;
+        int shadow_instances = 1;
+        if (script.shadows)
+        {
+            shadows = std::make_unique<shadow_atlas>();
+            set_shadow_casters(*shadows, model);
         }
-        else if (argc == 3 && std::string(argv[2]) == "normal")
+        std::map<std::pair<int, int>, target> targets;
+
+        for (size_t i = next_job++; i < script.jobs.size(); i = next_job++)
         {
-            std::cout << "Rasterizing using the normal shader\n";
-            active_shader = normal_fragment_shader;
+            const render_job& job = script.jobs[i];
+            auto job_start = std::chrono::steady_clock::now();
+            try
+            {
+                auto& t = targets[{job.width, job.height}];
+                if (!t.r)
+                {
+                    t.r = std::make_unique<rst::rasterizer>(job.width, job.height);
+                    t.buffers = upload_scene(*t.r, model);
+                    if (has_transparency(model))
+                        t.r->set_transparency(script.transparency);
+                    t.r->set_vertex_shader(vertex_shader);
+                    t.r->set_cull_mode(rst::CullMode::Back);
+                    t.r->set_shadows(shadows.get());
+                }
+                rst::rasterizer& r = *t.r;
+                if (t.instance_count != job.instances)
+                {
+                    if (t.instance_count > 0)
+                        r.instance_buffers().release(t.instances);
+                    t.instances = r.load_instances(crowd_transforms(model, job.instances));
+                    t.instance_count = job.instances;
+                }
+
+                shader_choice shader;
+                find_shader(job.shader, shader);
+                set_shader(r, shader);
+
+                if (shadows)
+                {
+                    if (shadow_instances != job.instances)
+                    {
+                        set_shadow_casters(*shadows, model, crowd_transforms(model, job.instances));
+                        shadow_instances = job.instances;
+                    }
+                    shadows->update(light_positions(), get_view_matrix(job.eye_pos) * get_model_matrix(job.angle));
+                }
+                r.clear(rst::Buffers::Color | rst::Buffers::Depth);
+                r.set_model(get_model_matrix(job.angle));
+                r.set_view(get_view_matrix(job.eye_pos));
+                r.set_projection(get_projection_matrix(job.fov, float(job.width) / job.height, 0.1, 50));
+                r.draw_indexed(t.buffers.pos_id, t.buffers.normal_id, t.buffers.texcoord_id, t.buffers.meshes, t.instances);
+
+                cv::Mat image(job.height, job.width, CV_32FC3, r.frame_buffer().data());
+                image.convertTo(image, CV_8UC3, 1.0f);
+                cv::cvtColor(image, image, cv::COLOR_RGB2BGR);
+                if (!cv::imwrite(job.output, image))
+                {
+                    throw std::runtime_error("cannot write " + job.output);
+                }
+
+                double ms = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - job_start).count();
+                std::lock_guard<std::mutex> lock(output_mutex);
+                std::cout << "[" << i + 1 << "/" << script.jobs.size() << "] " << job.output << " (" << ms << " ms)\n";
+            }
+            catch (const std::exception& e)
+            {
+                failures++;
+                std::lock_guard<std::mutex> lock(output_mutex);
+                std::cerr << "job at line " << job.line << " failed: " << e.what() << '\n';
+            }
         }
-        else if (argc == 3 && std::string(argv[2]) == "phong")
+    };
+
+    std::vector<std::thread> workers;
+    for (int i = 1; i < num_threads; ++i)
+    {
+        workers.emplace_back(worker);
+    }
+    worker();
+    for (auto& w : workers)
+    {
+        w.join();
+    }
+
+    double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+    std::cout << script.jobs.size() - failures << " of " << script.jobs.size() << " images rendered with "
+              << num_threads << " threads in " << seconds << " s\n";
+    return failures ? 1 : 0;
+}
+
+int main(int argc, const char** argv)
+{
+    // Rasterizer --batch <job script> renders the jobs of the script without a window
+    if (argc == 3 && std::string(argv[1]) == "--batch")
+    {
+        try
         {
-            std::cout << "Rasterizing using the phong shader\n";
-            active_shader = phong_fragment_shader;
+            return render_batch(argv[2]);
         }
-        else if (argc == 3 && std::string(argv[2]) == "bump")
+        catch (const std::exception& e)
         {
-            std::cout << "Rasterizing using the bump shader\n";
-            active_shader = bump_fragment_shader;
+            std::cerr << e.what() << '\n';
+            return 1;
         }
-        else if (argc == 3 && std::string(argv[2]) == "displacement")
+    }
+
+    float angle = 140.0;
+    bool command_line = false;
+
+    std::string filename = "output.png";
+
+    rst::rasterizer r(700, 700);
+    const scene model = load_scene("./models/spot/spot_triangulated_good.obj");
+    scene_buffers buffers = upload_scene(r, model);
+    if (has_transparency(model))
+        r.set_transparency(rst::TransparencyMode::ABuffer);
+    shadow_atlas shadows;
+    set_shadow_casters(shadows, model);
+    r.set_shadows(&shadows);
+    auto pos_id = buffers.pos_id;
+    auto col_id = buffers.col_id;
+    auto& meshes = buffers.meshes;
+
+    shader_choice active_shader;
+    find_shader("texture", active_shader);
+
+    if (argc >= 2)
+    {
+        command_line = true;
+        filename = std::string(argv[1]);
+
+        if (argc >= 3 && find_shader(argv[2], active_shader))
         {
-            std::cout << "Rasterizing using the bump shader\n";
-            active_shader = displacement_fragment_shader;
+            std::cout << "Rasterizing using the " << argv[2] << " shader\n";
         }
     }
 
     Eigen::Vector3f eye_pos = {0,0,10};
 
     r.set_vertex_shader(vertex_shader);
-    r.set_fragment_shader(active_shader);
+    set_shader(r, active_shader);
+    // spot is a closed mesh, its back faces are always hidden by the front ones
+    r.set_cull_mode(rst::CullMode::Back);
 
     int key = 0;
     int frame_count = 0;
 
+    // An optional third argument names a file for the frame's profile, see frame_profiler::write
+    std::string profile_path = argc >= 4 ? argv[3] : "";
+    r.profiler().set_enabled(!profile_path.empty());
+
     if (command_line)
     {
+        r.profiler().begin_frame();
+        shadows.update(light_positions(), get_view_matrix(eye_pos) * get_model_matrix(angle));
         r.clear(rst::Buffers::Color | rst::Buffers::Depth);
         r.set_model(get_model_matrix(angle));
         r.set_view(get_view_matrix(eye_pos));
         r.set_projection(get_projection_matrix(45.0, 1, 0.1, 50));
 
-        r.draw(TriangleList);
+        r.draw(pos_id, col_id, meshes);
         cv::Mat image(700, 700, CV_32FC3, r.frame_buffer().data());
+        r.profiler().end_frame();
         image.convertTo(image, CV_8UC3, 1.0f);
         cv::cvtColor(image, image, cv::COLOR_RGB2BGR);
 
         cv::imwrite(filename, image);
 
+        auto& stats = r.stats();
+        std::cout << "triangles submitted: " << stats.submitted << ", culled: " << stats.culled()
+                  << " (frustum " << stats.frustum_culled << ", backface " << stats.backface_culled
+                  << ", degenerate " << stats.degenerate_culled << ", small " << stats.small_culled
+                  << "), rasterized: " << stats.rasterized << '\n';
+        auto& streaming = r.textures().stats();
+        std::cout << "texture tiles loaded: " << streaming.tiles_loaded << ", evicted: " << streaming.tiles_evicted
+                  << ", resident: " << r.textures().resident_bytes() / 1024 << " KiB\n";
+        auto& frame = r.profiler().frames().back();
+        std::cout << "fragments: " << frame.counters.fragments << ", depth passed: " << frame.counters.depth_passed
+                  << ", failed: " << frame.counters.depth_failed << ", shader invocations: " << frame.counters.shader_invocations << '\n';
+        if (!profile_path.empty())
+        {
+            std::cout << "frame ms: " << frame.total_ms;
+            for (size_t s = 0; s < frame.stage_ms.size(); ++s)
+            {
+                std::cout << ", " << rst::stage_name(rst::Stage(s)) << ' ' << frame.stage_ms[s];
+            }
+            std::cout << '\n';
+            r.profiler().write(profile_path);
+        }
+
         return 0;
     }
 
+    // Frame N is converted and written out in the background while frame N + 1 renders
+    rst::frame_pipeline pipeline(700, 700, 2, 16, filename);
     while(key != 27)
     {
+        r.profiler().begin_frame();
+        // Re-rendered only in frames where the model turned
+        shadows.update(light_positions(), get_view_matrix(eye_pos) * get_model_matrix(angle));
         r.clear(rst::Buffers::Color | rst::Buffers::Depth);
 
         r.set_model(get_model_matrix(angle));
         r.set_view(get_view_matrix(eye_pos));
         r.set_projection(get_projection_matrix(45.0, 1, 0.1, 50));
-        //r.draw(pos_id, ind_id, col_id, rst::Primitive::Triangle);
-        r.draw(TriangleList);
-        cv::Mat image(700, 700, CV_32FC3, r.frame_buffer().data());
-        image.convertTo(image, CV_8UC3, 1.0f);
-        cv::cvtColor(image, image, cv::COLOR_RGB2BGR);
+        r.draw(pos_id, col_id, meshes);
 
-        cv::imshow("image", image);
-        cv::imwrite(filename, image);
-        key = cv::waitKey(10);
+        cv::Mat image;
+        if (pipeline.present(image))
+        {
+            cv::imshow("image", image);
+        }
+        pipeline.submit(r.frame_buffer());
+        r.profiler().end_frame();
+        key = cv::waitKey(pipeline.frame_wait_ms());
 
         if (key == 'a' )
         {
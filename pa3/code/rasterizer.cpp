@@ -3,43 +3,49 @@
 //
 
 #include <algorithm>
+#include <thread>
 #include "rasterizer.hpp"
 #include <opencv2/opencv.hpp>
 #include <math.h>
+#include <stdexcept>
 
 
-rst::pos_buf_id rst::rasterizer::load_positions(const std::vector<Eigen::Vector3f> &positions)
+rst::pos_buf_id rst::rasterizer::load_positions(std::vector<Eigen::Vector3f> positions)
 {
-    auto id = get_next_id();
-    pos_buf.emplace(id, positions);
-
-    return {id};
+    return pos_buf.create(std::move(positions));
 }
 
-rst::ind_buf_id rst::rasterizer::load_indices(const std::vector<Eigen::Vector3i> &indices)
+rst::ind_buf_id rst::rasterizer::load_indices(std::vector<Eigen::Vector3i> indices)
 {
-    auto id = get_next_id();
-    ind_buf.emplace(id, indices);
-
-    return {id};
+    return ind_buf.create(std::move(indices));
 }
 
-rst::col_buf_id rst::rasterizer::load_colors(const std::vector<Eigen::Vector3f> &cols)
+rst::col_buf_id rst::rasterizer::load_colors(std::vector<Eigen::Vector3f> cols)
 {
-    auto id = get_next_id();
-    col_buf.emplace(id, cols);
+    return col_buf.create(std::move(cols));
+}
 
-    return {id};
+rst::col_buf_id rst::rasterizer::load_normals(std::vector<Eigen::Vector3f> normals)
+{
+    normal_id = nor_buf.create(std::move(normals));
+    return normal_id;
 }
 
-rst::col_buf_id rst::rasterizer::load_normals(const std::vector<Eigen::Vector3f>& normals)
+rst::col_buf_id rst::rasterizer::load_tangents(std::vector<Eigen::Vector4f> tangents)
 {
-    auto id = get_next_id();
-    nor_buf.emplace(id, normals);
+    tangent_id = tan_buf.create(std::move(tangents));
+    return tangent_id;
+}
 
-    normal_id = id;
+rst::tex_buf_id rst::rasterizer::load_texcoords(std::vector<Eigen::Vector2f> texcoords)
+{
+    texcoord_id = tex_buf.create(std::move(texcoords));
+    return texcoord_id;
+}
 
-    return {id};
+rst::inst_buf_id rst::rasterizer::load_instances(std::vector<Eigen::Matrix4f> transforms)
+{
+    return inst_buf.create(std::move(transforms));
 }
 
 
@@ -170,74 +176,589 @@ static std::tuple<float, float, float> computeBarycentric2D(float x, float y, co
     return {c1,c2,c3};
 }
 
-void rst::rasterizer::draw(std::vector<Triangle *> &TriangleList) {
+void rst::rasterizer::draw(pos_buf_id pos_buffer, ind_buf_id ind_buffer, col_buf_id col_buffer, Primitive type)
+{
+    if (type != rst::Primitive::Triangle)
+    {
+        throw std::runtime_error("Drawing primitives other than triangle is not implemented yet!");
+    }
 
-    float f1 = (50 - 0.1) / 2.0;
-    float f2 = (50 + 0.1) / 2.0;
+    Eigen::Matrix2Xf texcoords;
+    Eigen::Matrix3Xf colors;
+    transform_vertices(pos_buffer, col_buffer, texcoords, colors);
+    bind_material(current_material);
+    assemble_triangles(ind_buf.get(ind_buffer), texcoords, colors);
+}
+
+void rst::rasterizer::draw(pos_buf_id pos_buffer, col_buf_id col_buffer, const std::vector<submesh>& meshes)
+{
+    Eigen::Matrix2Xf texcoords;
+    Eigen::Matrix3Xf colors;
+    transform_vertices(pos_buffer, col_buffer, texcoords, colors);
+
+    int bound_id = -2;
+    for (auto* mesh : material_order(meshes))
+    {
+        if (mesh->material.mat_id != bound_id)
+        {
+            bound_id = mesh->material.mat_id;
+            bind_material(bound_id >= 0 ? materials[bound_id] : current_material);
+        }
+        assemble_triangles(ind_buf.get(mesh->indices), texcoords, colors);
+    }
+}
 
-    Eigen::Matrix4f mvp = projection * view * model;
-    for (const auto& t:TriangleList)
+std::vector<const rst::submesh*> rst::rasterizer::material_order(const std::vector<submesh>& meshes) const
+{
+    std::vector<const submesh*> order;
+    order.reserve(meshes.size());
+    for (auto& mesh : meshes)
     {
-        Triangle newtri = *t;
+        order.push_back(&mesh);
+    }
+    // Opaque materials first, so transparent fragments are tested against all of them
+    auto transparent = [this](const submesh* mesh) {
+        int id = mesh->material.mat_id;
+        return (id >= 0 ? materials[id] : current_material).opacity < 1.0f;
+    };
+    std::stable_sort(order.begin(), order.end(), [&](const submesh* a, const submesh* b) {
+        return std::make_pair(transparent(a), a->material.mat_id) < std::make_pair(transparent(b), b->material.mat_id);
+    });
+    return order;
+}
 
-        std::array<Eigen::Vector4f, 3> mm {
-                (view * model * t->v[0]),
-                (view * model * t->v[1]),
-                (view * model * t->v[2])
-        };
+void rst::rasterizer::transform_vertices(pos_buf_id pos_buffer, col_buf_id col_buffer,
+                                         Eigen::Matrix2Xf& texcoords, Eigen::Matrix3Xf& colors)
+{
+    auto timer = profiling.time(Stage::Vertex);
+    auto& buf = pos_buf.get(pos_buffer);
+    auto& col = col_buf.get(col_buffer);
 
-        std::array<Eigen::Vector3f, 3> viewspace_pos;
+    const auto num_vertices = Eigen::Index(buf.size());
+
+    // Colors are required per vertex; attributes that do not cover every vertex are left at zero,
+    // as in draw_indexed
+    if (col.size() != buf.size())
+    {
+        throw std::invalid_argument("color buffer of " + std::to_string(col.size()) + " entries for " +
+                                    std::to_string(buf.size()) + " vertices");
+    }
 
-        std::transform(mm.begin(), mm.end(), viewspace_pos.begin(), [](auto& v) {
-            return v.template head<3>();
-        });
+    Eigen::Matrix3Xf normals = Eigen::Matrix3Xf::Zero(3, num_vertices);
+    if (nor_buf.valid(normal_id) && nor_buf.size(normal_id) == buf.size())
+    {
+        auto& nor = nor_buf.get(normal_id);
+        normals = Eigen::Map<const Eigen::Matrix3Xf>(nor.data()->data(), 3, num_vertices);
+    }
 
-        Eigen::Vector4f v[] = {
-                mvp * t->v[0],
-                mvp * t->v[1],
-                mvp * t->v[2]
-        };
-        //Homogeneous division
-        for (auto& vec : v) {
-            vec.x()/=vec.w();
-            vec.y()/=vec.w();
-            vec.z()/=vec.w();
+    texcoords = Eigen::Matrix2Xf::Zero(2, num_vertices);
+    if (tex_buf.valid(texcoord_id) && tex_buf.size(texcoord_id) == buf.size())
+    {
+        auto& tex = tex_buf.get(texcoord_id);
+        texcoords = Eigen::Map<const Eigen::Matrix2Xf>(tex.data()->data(), 2, num_vertices);
+    }
+
+    // Colors are loaded in [0, 255] like in the previous assignment
+    colors = Eigen::Map<const Eigen::Matrix3Xf>(col.data()->data(), 3, num_vertices) / 255.f;
+
+    Eigen::Matrix4Xf tangents = Eigen::Matrix4Xf::Zero(4, num_vertices);
+    if (tan_buf.valid(tangent_id) && tan_buf.size(tangent_id) == buf.size())
+    {
+        auto& tan = tan_buf.get(tangent_id);
+        tangents = Eigen::Map<const Eigen::Matrix4Xf>(tan.data()->data(), 4, num_vertices);
+    }
+
+    Eigen::Matrix3Xf shaded;
+    const Eigen::Matrix3Xf& object_pos = shade_vertices(Eigen::Map<const Eigen::Matrix3Xf>(buf.data()->data(), 3, num_vertices), shaded);
+    process_vertices(object_pos, normals, tangents, model);
+}
+
+rst::material_id rst::rasterizer::add_material(const material& m)
+{
+    materials.push_back(m);
+    return {int(materials.size()) - 1};
+}
+
+void rst::rasterizer::bind_material(const material& m)
+{
+    bound_diffuse = texture_manager.get(m.diffuse);
+    bound_normal = texture_manager.get(m.normal);
+    bound_height = texture_manager.get(m.height);
+    bound_opacity = std::clamp(m.opacity, 0.0f, 1.0f);
+    blend_transparent = transparency != TransparencyMode::Off && bound_opacity < 1.0f;
+}
+
+void rst::rasterizer::set_transparency(TransparencyMode mode, size_t arena_fragments)
+{
+    transparency = mode;
+    oit_arena.clear();
+    oit_arena.shrink_to_fit();
+    oit_heads.clear();
+    oit_accum.clear();
+    oit_revealage.clear();
+    if (mode == TransparencyMode::ABuffer)
+    {
+        oit_arena.resize(arena_fragments);
+        oit_heads.assign(layout.size(), -1);
+    }
+    else if (mode == TransparencyMode::WeightedBlended)
+    {
+        oit_accum.assign(layout.size(), Eigen::Vector4f::Zero());
+        oit_revealage.assign(layout.size(), 1.0f);
+    }
+    oit_used = 0;
+    oit_pending = false;
+}
+
+void rst::rasterizer::add_transparent_fragment(int index, const Eigen::Vector3f& color, float depth, float view_depth)
+{
+    frame_counters& counters = profiling.counters();
+    counters.transparent_fragments++;
+    oit_pending = true;
+
+    if (transparency == TransparencyMode::ABuffer)
+    {
+        if (oit_used == oit_arena.size())
+        {
+            counters.transparent_dropped++;
+            return;
         }
+        int node = int(oit_used++);
+        oit_arena[node] = {color, depth, bound_opacity, oit_heads[index]};
+        oit_heads[index] = node;
+        return;
+    }
+
+    // McGuire and Bavoil 2013, equation 7: nearer fragments get a larger weight
+    float d = view_depth;
+    float weight = bound_opacity * std::clamp(10.0f / (1e-5f + std::pow(d / 5.0f, 2.0f) + std::pow(d / 200.0f, 6.0f)), 1e-2f, 3e3f);
+    oit_accum[index] += Eigen::Vector4f(color.x(), color.y(), color.z(), 1.0f) * (bound_opacity * weight);
+    oit_revealage[index] *= 1.0f - bound_opacity;
+}
+
+// Pixels with more transparent layers than this keep only the nearest ones
+static constexpr int max_oit_layers = 32;
 
-        Eigen::Matrix4f inv_trans = (view * model).inverse().transpose();
-        Eigen::Vector4f n[] = {
-                inv_trans * to_vec4(t->normal[0], 0.0f),
-                inv_trans * to_vec4(t->normal[1], 0.0f),
-                inv_trans * to_vec4(t->normal[2], 0.0f)
+// Consumes the fragments, the next resolve only composites the ones drawn after this one
+void rst::rasterizer::resolve_transparency()
+{
+    oit_pending = false;
+    auto resolve_range = [this](size_t begin, size_t end) {
+        struct layer
+        {
+            float depth;
+            float alpha;
+            Eigen::Vector3f color;
         };
+        std::array<layer, max_oit_layers> layers;
 
-        //Viewport transformation
-        for (auto & vert : v)
+        for (size_t i = begin; i < end; ++i)
         {
-            vert.x() = 0.5*width*(vert.x()+1.0);
-            vert.y() = 0.5*height*(vert.y()+1.0);
-            vert.z() = vert.z() * f1 + f2;
+            if (transparency == TransparencyMode::WeightedBlended)
+            {
+                float revealage = oit_revealage[i];
+                if (revealage == 1.0f)
+                    continue;
+                Eigen::Vector4f accum = oit_accum[i];
+                oit_revealage[i] = 1.0f;
+                oit_accum[i].setZero();
+                Eigen::Vector3f average = accum.head<3>() / std::max(accum.w(), 1e-5f);
+                color_buf.set(i, average * (1.0f - revealage) + color_buf.get(i) * revealage);
+                continue;
+            }
+
+            // Insertion sort by depth, nearest first; fragments behind the final opaque surface
+            // were drawn before it and are skipped
+            int count = 0;
+            int head = oit_heads[i];
+            oit_heads[i] = -1;
+            for (int node = head; node >= 0; node = oit_arena[node].next)
+            {
+                const oit_fragment& f = oit_arena[node];
+                if (f.depth >= depth_buf[i])
+                    continue;
+                int k = std::min(count, max_oit_layers - 1);
+                if (count == max_oit_layers && f.depth >= layers[k].depth)
+                    continue;
+                for (; k > 0 && layers[k - 1].depth > f.depth; --k)
+                    layers[k] = layers[k - 1];
+                layers[k] = {f.depth, f.alpha, f.color};
+                count = std::min(count + 1, max_oit_layers);
+            }
+            if (count == 0)
+                continue;
+
+            Eigen::Vector3f color = color_buf.get(i);
+            for (int k = count - 1; k >= 0; --k)
+                color = layers[k].alpha * layers[k].color + (1.0f - layers[k].alpha) * color;
+            color_buf.set(i, color);
         }
+    };
+
+    // Pixels resolve independently, the layout is split into one contiguous range per thread
+    size_t num_slots = size_t(layout.size());
+    size_t num_threads = std::clamp<size_t>(std::thread::hardware_concurrency(), 1, 16);
+    num_threads = std::min(num_threads, std::max<size_t>(1, num_slots / 16384));
+    std::vector<std::thread> workers;
+    for (size_t t = 1; t < num_threads; ++t)
+    {
+        workers.emplace_back(resolve_range, num_slots * t / num_threads, num_slots * (t + 1) / num_threads);
+    }
+    resolve_range(0, num_slots / num_threads);
+    for (auto& w : workers)
+    {
+        w.join();
+    }
+    oit_used = 0;
+}
+
+// Clip-space outcodes. A triangle whose vertices share a frustum bit is invisible, and only
+// triangles touching the near plane or leaving the guard band need to be clipped; everything
+// else is rasterized directly with its bounding box clamped to the viewport.
+static constexpr unsigned char CLIP_LEFT = 1 << 0;
+static constexpr unsigned char CLIP_RIGHT = 1 << 1;
+static constexpr unsigned char CLIP_BOTTOM = 1 << 2;
+static constexpr unsigned char CLIP_TOP = 1 << 3;
+static constexpr unsigned char CLIP_NEAR = 1 << 4;
+static constexpr unsigned char CLIP_FAR = 1 << 5;
+static constexpr unsigned char CLIP_GUARD = 1 << 6;
+static constexpr unsigned char CLIP_FRUSTUM = CLIP_LEFT | CLIP_RIGHT | CLIP_BOTTOM | CLIP_TOP | CLIP_NEAR | CLIP_FAR;
+
+// Guard band half extent in NDC units, i.e. four viewports on each side of the screen
+static constexpr float guard_band = 4.0f;
+
+static unsigned char compute_clip_code(const Eigen::Vector4f& p)
+{
+    unsigned char code = 0;
+    if (p.x() < -p.w()) code |= CLIP_LEFT;
+    if (p.x() > p.w()) code |= CLIP_RIGHT;
+    if (p.y() < -p.w()) code |= CLIP_BOTTOM;
+    if (p.y() > p.w()) code |= CLIP_TOP;
+    if (p.z() < -p.w()) code |= CLIP_NEAR;
+    if (p.z() > p.w()) code |= CLIP_FAR;
+    float guard = guard_band * p.w();
+    if (p.x() < -guard || p.x() > guard || p.y() < -guard || p.y() > guard) code |= CLIP_GUARD;
+    return code;
+}
+
+struct clip_vertex
+{
+    Eigen::Vector4f pos;
+    Eigen::Vector3f view_pos;
+    Eigen::Vector3f normal;
+    Eigen::Vector4f tangent;
+    Eigen::Vector2f tex_coords;
+    Eigen::Vector3f color;
+};
+
+static clip_vertex lerp(const clip_vertex& a, const clip_vertex& b, float t)
+{
+    return {a.pos + t * (b.pos - a.pos),
+            a.view_pos + t * (b.view_pos - a.view_pos),
+            a.normal + t * (b.normal - a.normal),
+            a.tangent + t * (b.tangent - a.tangent),
+            a.tex_coords + t * (b.tex_coords - a.tex_coords),
+            a.color + t * (b.color - a.color)};
+}
+
+// Sutherland-Hodgman against the clip-space half space dot(plane, pos) >= 0
+static void clip_polygon(std::vector<clip_vertex>& polygon, const Eigen::Vector4f& plane)
+{
+    std::vector<clip_vertex> result;
+    result.reserve(polygon.size() + 1);
+
+    for (size_t i = 0; i < polygon.size(); ++i)
+    {
+        const auto& cur = polygon[i];
+        const auto& next = polygon[(i + 1) % polygon.size()];
+        float d_cur = plane.dot(cur.pos);
+        float d_next = plane.dot(next.pos);
+
+        if (d_cur >= 0)
+            result.push_back(cur);
+        if ((d_cur >= 0) != (d_next >= 0))
+            result.push_back(lerp(cur, next, d_cur / (d_cur - d_next)));
+    }
+
+    polygon.swap(result);
+}
+
+const Eigen::Matrix3Xf& rst::rasterizer::shade_vertices(const Eigen::Matrix3Xf& positions, Eigen::Matrix3Xf& shaded)
+{
+    if (!vertex_shader)
+    {
+        return positions;
+    }
+    auto timer = profiling.time(Stage::Vertex);
+    shaded.resize(3, positions.cols());
+    vertex_shader_payload payload;
+    for (Eigen::Index i = 0; i < positions.cols(); ++i)
+    {
+        payload.position = positions.col(i);
+        shaded.col(i) = vertex_shader(payload);
+    }
+    return shaded;
+}
+
+void rst::rasterizer::process_vertices(const Eigen::Matrix3Xf& positions, const Eigen::Matrix3Xf& normals,
+                                       const Eigen::Matrix4Xf& tangents, const Eigen::Matrix4f& model_matrix)
+{
+    auto timer = profiling.time(Stage::Vertex);
+    // Per-draw uniforms, computed once instead of once per triangle
+    Eigen::Matrix4f mv = view * model_matrix;
+    Eigen::Matrix4f mvp = projection * mv;
+    Eigen::Matrix3f normal_matrix = mv.topLeftCorner<3, 3>().inverse().transpose();
+    const Eigen::Matrix3Xf* object_pos = &positions;
+
+    // Whole-batch transforms; Eigen evaluates these as vectorized matrix products
+    post_transform.view_pos = (mv.topLeftCorner<3, 3>() * *object_pos).colwise() + mv.topRightCorner<3, 1>();
+    post_transform.view_normal = normal_matrix * normals;
+    // Tangents lie in the surface, they transform like positions
+    post_transform.view_tangent.resize(4, tangents.cols());
+    post_transform.view_tangent.topRows<3>() = mv.topLeftCorner<3, 3>() * tangents.topRows<3>();
+    post_transform.view_tangent.row(3) = tangents.row(3);
+    post_transform.clip_pos = (mvp.leftCols<3>() * *object_pos).colwise() + mvp.col(3);
+
+    const auto num_vertices = post_transform.clip_pos.cols();
+    post_transform.screen_pos.resize(4, num_vertices);
+    post_transform.clip_codes.resize(num_vertices);
+    for (Eigen::Index i = 0; i < num_vertices; ++i)
+    {
+        post_transform.clip_codes[i] = compute_clip_code(post_transform.clip_pos.col(i));
+        // Only meaningful for vertices in front of the near plane, the others always get clipped
+        post_transform.screen_pos.col(i) = viewport_transform(post_transform.clip_pos.col(i));
+    }
+}
+
+// True when the box [lo, hi] transformed by mvp lies entirely outside one frustum plane
+static bool box_outside(const Eigen::Vector3f& lo, const Eigen::Vector3f& hi, const Eigen::Matrix4f& mvp)
+{
+    unsigned char code_and = CLIP_FRUSTUM;
+    for (int corner = 0; corner < 8 && code_and; ++corner)
+    {
+        Eigen::Vector4f p(corner & 1 ? hi.x() : lo.x(), corner & 2 ? hi.y() : lo.y(), corner & 4 ? hi.z() : lo.z(), 1.0f);
+        code_and &= compute_clip_code(mvp * p);
+    }
+    return code_and & CLIP_FRUSTUM;
+}
+
+void rst::rasterizer::draw_indexed(pos_buf_id positions, col_buf_id normals, tex_buf_id texcoords, ind_buf_id indices,
+                                   inst_buf_id instances)
+{
+    // The current material, which the submesh form binds whenever it is left unset
+    draw_indexed(positions, normals, texcoords, {submesh{indices, material_id{-1}}}, instances);
+}
+
+void rst::rasterizer::draw_indexed(pos_buf_id positions, col_buf_id normals, tex_buf_id texcoords,
+                                   const std::vector<submesh>& meshes, inst_buf_id instances)
+{
+    const auto& pos = pos_buf.get(positions);
+    const auto& transforms = inst_buf.get(instances);
+    const auto num_vertices = Eigen::Index(pos.size());
 
-        for (int i = 0; i < 3; ++i)
+    // Everything that does not depend on the instance is done once per call
+    Eigen::Matrix3Xf object_pos = Eigen::Map<const Eigen::Matrix3Xf>(pos.data()->data(), 3, num_vertices);
+    Eigen::Matrix3Xf object_normals = Eigen::Matrix3Xf::Zero(3, num_vertices);
+    Eigen::Matrix2Xf object_texcoords = Eigen::Matrix2Xf::Zero(2, num_vertices);
+    Eigen::Matrix4Xf object_tangents = Eigen::Matrix4Xf::Zero(4, num_vertices);
+    Eigen::Matrix3Xf shaded_storage;
+    const Eigen::Matrix3Xf* shaded_pos;
+    {
+        auto timer = profiling.time(Stage::Vertex);
+        if (nor_buf.valid(normals) && nor_buf.size(normals) == pos.size())
         {
-            //screen space coordinates
-            newtri.setVertex(i, v[i]);
+            object_normals = Eigen::Map<const Eigen::Matrix3Xf>(nor_buf.get(normals).data()->data(), 3, num_vertices);
         }
+        if (tex_buf.valid(texcoords) && tex_buf.size(texcoords) == pos.size())
+        {
+            object_texcoords = Eigen::Map<const Eigen::Matrix2Xf>(tex_buf.get(texcoords).data()->data(), 2, num_vertices);
+        }
+        if (tan_buf.valid(tangent_id) && tan_buf.size(tangent_id) == pos.size())
+        {
+            object_tangents = Eigen::Map<const Eigen::Matrix4Xf>(tan_buf.get(tangent_id).data()->data(), 4, num_vertices);
+        }
+        shaded_pos = &shade_vertices(object_pos, shaded_storage);
+    }
+    Eigen::Matrix3Xf colors = Eigen::Vector3f(148, 121.0, 92.0).replicate(1, num_vertices) / 255.f;
+    if (num_vertices == 0)
+    {
+        return;
+    }
+    Eigen::Vector3f lo = shaded_pos->rowwise().minCoeff();
+    Eigen::Vector3f hi = shaded_pos->rowwise().maxCoeff();
 
-        for (int i = 0; i < 3; ++i)
+    std::vector<const submesh*> order = material_order(meshes);
+    Eigen::Matrix4f view_projection = projection * view;
+    int bound_id = -2;
+    for (const Eigen::Matrix4f& instance : transforms)
+    {
+        Eigen::Matrix4f instance_model = model * instance;
+        if (box_outside(lo, hi, view_projection * instance_model))
         {
-            //view space normal
-            newtri.setNormal(i, n[i].head<3>());
+            statistics.instances_culled++;
+            continue;
         }
+        process_vertices(*shaded_pos, object_normals, object_tangents, instance_model);
 
-        newtri.setColor(0, 148,121.0,92.0);
-        newtri.setColor(1, 148,121.0,92.0);
-        newtri.setColor(2, 148,121.0,92.0);
+        for (auto* mesh : order)
+        {
+            // A single material stays bound across instances
+            if (mesh->material.mat_id != bound_id)
+            {
+                bound_id = mesh->material.mat_id;
+                bind_material(bound_id >= 0 ? materials[bound_id] : current_material);
+            }
+            assemble_triangles(ind_buf.get(mesh->indices), object_texcoords, colors);
+        }
+    }
+}
 
-        // Also pass view space vertice position
-        rasterize_triangle(newtri, viewspace_pos);
+Eigen::Vector4f rst::rasterizer::viewport_transform(const Eigen::Vector4f& clip_pos) const
+{
+    float f1 = (50 - 0.1) / 2.0;
+    float f2 = (50 + 0.1) / 2.0;
+
+    //Homogeneous division
+    float w_reciprocal = 1.0f / clip_pos.w();
+    //Viewport transformation
+    return {0.5f * width * (clip_pos.x() * w_reciprocal + 1.0f),
+            0.5f * height * (clip_pos.y() * w_reciprocal + 1.0f),
+            clip_pos.z() * w_reciprocal * f1 + f2,
+            clip_pos.w()};
+}
+
+void rst::rasterizer::assemble_triangles(const std::vector<Eigen::Vector3i>& indices,
+                                         const Eigen::Matrix2Xf& texcoords, const Eigen::Matrix3Xf& colors)
+{
+    auto timer = profiling.time(Stage::Setup);
+    const auto& codes = post_transform.clip_codes;
+    std::vector<clip_vertex> polygon;
+
+    for (auto& i : indices)
+    {
+        unsigned char code_and = codes[i[0]] & codes[i[1]] & codes[i[2]];
+        unsigned char code_or = codes[i[0]] | codes[i[1]] | codes[i[2]];
+
+        statistics.submitted++;
+
+        // Completely outside one of the frustum planes
+        if (code_and & CLIP_FRUSTUM)
+        {
+            statistics.frustum_culled++;
+            continue;
+        }
+
+        Triangle newtri;
+        std::array<Eigen::Vector3f, 3> viewspace_pos;
+
+        if (!(code_or & (CLIP_NEAR | CLIP_GUARD)))
+        {
+            for (int j = 0; j < 3; ++j)
+            {
+                //screen space coordinates
+                newtri.setVertex(j, post_transform.screen_pos.col(i[j]));
+                //view space normal
+                newtri.setNormal(j, post_transform.view_normal.col(i[j]));
+                newtri.tangent[j] = post_transform.view_tangent.col(i[j]);
+                newtri.setTexCoord(j, texcoords.col(i[j]));
+                newtri.color[j] = colors.col(i[j]);
+                viewspace_pos[j] = post_transform.view_pos.col(i[j]);
+            }
+
+            if (!cull_triangle(newtri))
+            {
+                // Also pass view space vertice position
+                rasterize_triangle(newtri, viewspace_pos);
+            }
+            continue;
+        }
+
+        {
+            auto clip_timer = profiling.time(Stage::Clip);
+            polygon.clear();
+            for (int j = 0; j < 3; ++j)
+            {
+                polygon.push_back({post_transform.clip_pos.col(i[j]), post_transform.view_pos.col(i[j]),
+                                   post_transform.view_normal.col(i[j]), post_transform.view_tangent.col(i[j]),
+                                   texcoords.col(i[j]), colors.col(i[j])});
+            }
+
+            if (code_or & CLIP_NEAR)
+            {
+                clip_polygon(polygon, Eigen::Vector4f(0, 0, 1, 1));
+            }
+            if (code_or & CLIP_GUARD)
+            {
+                clip_polygon(polygon, Eigen::Vector4f(1, 0, 0, guard_band));
+                clip_polygon(polygon, Eigen::Vector4f(-1, 0, 0, guard_band));
+                clip_polygon(polygon, Eigen::Vector4f(0, 1, 0, guard_band));
+                clip_polygon(polygon, Eigen::Vector4f(0, -1, 0, guard_band));
+            }
+        }
+
+        // The clipped polygon is convex, split it into a fan
+        for (size_t k = 1; k + 1 < polygon.size(); ++k)
+        {
+            const clip_vertex* fan[] = {&polygon[0], &polygon[k], &polygon[k + 1]};
+            for (int j = 0; j < 3; ++j)
+            {
+                newtri.setVertex(j, viewport_transform(fan[j]->pos));
+                newtri.setNormal(j, fan[j]->normal);
+                newtri.tangent[j] = fan[j]->tangent;
+                newtri.setTexCoord(j, fan[j]->tex_coords);
+                newtri.color[j] = fan[j]->color;
+                viewspace_pos[j] = fan[j]->view_pos;
+            }
+            if (!cull_triangle(newtri))
+            {
+                rasterize_triangle(newtri, viewspace_pos);
+            }
+        }
+    }
+}
+
+// Screen positions are snapped to 1/256 of a pixel before setup, so the signed area below is
+// exact and a triangle that collapsed to a line or a point is recognized reliably.
+static constexpr float subpixel_steps = 256.0f;
+
+bool rst::rasterizer::cull_triangle(Triangle& t)
+{
+    for (auto& vert : t.v)
+    {
+        vert.x() = std::round(vert.x() * subpixel_steps) / subpixel_steps;
+        vert.y() = std::round(vert.y() * subpixel_steps) / subpixel_steps;
+    }
+
+    // Twice the signed area, positive for counter clockwise triangles (y points up)
+    double area = (double(t.v[1].x()) - t.v[0].x()) * (double(t.v[2].y()) - t.v[0].y()) -
+                  (double(t.v[2].x()) - t.v[0].x()) * (double(t.v[1].y()) - t.v[0].y());
+
+    if (area == 0)
+    {
+        statistics.degenerate_culled++;
+        return true;
+    }
+    if ((cull_mode == CullMode::Back && area < 0) || (cull_mode == CullMode::Front && area > 0))
+    {
+        statistics.backface_culled++;
+        return true;
     }
+
+    // Pixel centers sit at integer + 0.5; a bounding box that straddles none of them in x or
+    // in y cannot cover a sample
+    float x_min = std::min(std::min(t.v[0].x(), t.v[1].x()), t.v[2].x());
+    float x_max = std::max(std::max(t.v[0].x(), t.v[1].x()), t.v[2].x());
+    float y_min = std::min(std::min(t.v[0].y(), t.v[1].y()), t.v[2].y());
+    float y_max = std::max(std::max(t.v[0].y(), t.v[1].y()), t.v[2].y());
+    if (std::floor(x_max - 0.5f) < std::ceil(x_min - 0.5f) || std::floor(y_max - 0.5f) < std::ceil(y_min - 0.5f))
+    {
+        statistics.small_culled++;
+        return true;
+    }
+
+    statistics.rasterized++;
+    profiling.counters().triangles++;
+    return false;
 }
 
 static Eigen::Vector3f interpolate(float alpha, float beta, float gamma, const Eigen::Vector3f& vert1, const Eigen::Vector3f& vert2, const Eigen::Vector3f& vert3, float weight)
@@ -256,41 +777,252 @@ static Eigen::Vector2f interpolate(float alpha, float beta, float gamma, const E
     return Eigen::Vector2f(u, v);
 }
 
+// Depth-only triangles, for shadow maps. Window depth is affine in screen space, so it and the
+// edge functions are stepped by constant increments instead of solving barycentrics per pixel.
+void rst::rasterizer::rasterize_depth(const Triangle& t, int x_min, int x_max, int y_min, int y_max)
+{
+    const Eigen::Vector4f* v = t.v;
+    float area = (v[1].x() - v[0].x()) * (v[2].y() - v[0].y()) - (v[2].x() - v[0].x()) * (v[1].y() - v[0].y());
+    float sign = area < 0 ? -1.0f : 1.0f;
+
+    // Edge i is opposite vertex i, positive inside for either winding
+    float a[3], b[3], c[3];
+    for (int i = 0; i < 3; ++i)
+    {
+        const Eigen::Vector4f& p = v[(i + 1) % 3];
+        const Eigen::Vector4f& q = v[(i + 2) % 3];
+        a[i] = sign * (p.y() - q.y());
+        b[i] = sign * (q.x() - p.x());
+        c[i] = sign * (p.x() * q.y() - q.x() * p.y());
+    }
+    float inv_area = 1.0f / std::abs(area);
+    float dz_dx = (a[0] * v[0].z() + a[1] * v[1].z() + a[2] * v[2].z()) * inv_area;
+
+    frame_counters& counters = profiling.counters();
+    for (int y = y_min; y <= y_max; y++)
+    {
+        float px = float(x_min) + 0.5f, py = float(y) + 0.5f;
+        float e0 = a[0] * px + b[0] * py + c[0];
+        float e1 = a[1] * px + b[1] * py + c[1];
+        float e2 = a[2] * px + b[2] * py + c[2];
+        float z = (e0 * v[0].z() + e1 * v[1].z() + e2 * v[2].z()) * inv_area;
+        for (int x = x_min; x <= x_max; x++)
+        {
+            if (e0 >= 0 && e1 >= 0 && e2 >= 0)
+            {
+                counters.fragments++;
+                float& depth = depth_buf[get_index(x, y)];
+                if (z < depth)
+                {
+                    counters.depth_passed++;
+                    depth = z;
+                }
+                else
+                {
+                    counters.depth_failed++;
+                }
+            }
+            e0 += a[0];
+            e1 += a[1];
+            e2 += a[2];
+            z += dz_dx;
+        }
+    }
+}
+
 //Screen space rasterization
 void rst::rasterizer::rasterize_triangle(const Triangle& t, const std::array<Eigen::Vector3f, 3>& view_pos) 
 {
 
     auto v = t.toVector4();
 
-    int x_min = std::floor(std::min(std::min(v[0].x(), v[1].x()), v[2].x()));
-    int x_max = std::ceil(std::max(std::max(v[0].x(), v[1].x()), v[2].x()));
-    int y_min = std::floor(std::min(std::min(v[0].y(), v[1].y()), v[2].y()));
-    int y_max = std::ceil(std::max(std::max(v[0].y(), v[1].y()), v[2].y()));
+    // Bounding box clamped to the viewport, the guard band keeps these values well inside int range
+    int x_min = std::max(0, int(std::floor(std::min(std::min(v[0].x(), v[1].x()), v[2].x()))));
+    int x_max = std::min(width - 1, int(std::ceil(std::max(std::max(v[0].x(), v[1].x()), v[2].x()))));
+    int y_min = std::max(0, int(std::floor(std::min(std::min(v[0].y(), v[1].y()), v[2].y()))));
+    int y_max = std::min(height - 1, int(std::ceil(std::max(std::max(v[0].y(), v[1].y()), v[2].y()))));
+
+    // Texture coordinates are interpolated linearly in screen space, so their derivatives are
+    // constant over the triangle. Culling has already rejected zero area triangles.
+    Eigen::Vector2f e1 = t.v[1].head<2>() - t.v[0].head<2>();
+    Eigen::Vector2f e2 = t.v[2].head<2>() - t.v[0].head<2>();
+    Eigen::Vector2f duv1 = t.tex_coords[1] - t.tex_coords[0];
+    Eigen::Vector2f duv2 = t.tex_coords[2] - t.tex_coords[0];
+    float inv_det = 1.0f / (e1.x() * e2.y() - e2.x() * e1.y());
+    Eigen::Vector2f tex_dx = (duv1 * e2.y() - duv2 * e1.y()) * inv_det;
+    Eigen::Vector2f tex_dy = (duv2 * e1.x() - duv1 * e2.x()) * inv_det;
+
+    auto timer = profiling.time(Stage::Raster);
+    frame_counters& counters = profiling.counters();
+    if (depth_only)
+    {
+        rasterize_depth(t, x_min, x_max, y_min, y_max);
+        return;
+    }
+    if (quad_fragment_shader)
+    {
+        rasterize_quads(t, view_pos, x_min, x_max, y_min, y_max, tex_dx, tex_dy);
+        return;
+    }
 
     for (int x = x_min; x <= x_max; x++) {
         for (int y = y_min; y <= y_max; y++) {
                 if (insideTriangle(float(x)+0.5f, float(y)+0.5f, t.v)) {
+                    counters.fragments++;
                     auto[alpha, beta, gamma] = computeBarycentric2D(float(x)+0.5f,float(y)+0.5f, t.v);
                     float w_reciprocal = 1.0f / (alpha / v[0].w() + beta / v[1].w() + gamma / v[2].w());
                     float z_interpolated =
                             alpha * v[0].z() / v[0].w() + beta * v[1].z() / v[1].w() + gamma * v[2].z() / v[2].w();
                     z_interpolated *= w_reciprocal;
                     if (z_interpolated < depth_buf[get_index(x, y)]) {
-                        depth_buf[get_index(x, y)] = z_interpolated;
+                        counters.depth_passed++;
+                        if (!blend_transparent)
+                            depth_buf[get_index(x, y)] = z_interpolated;
                         auto interpolated_color = interpolate(alpha, beta, gamma, t.color[0], t.color[1], t.color[2], 1.0f);
                         auto interpolated_normal = interpolate(alpha, beta, gamma, t.normal[0], t.normal[1], t.normal[2], 1.0f);
                         auto interpolated_texcoords = interpolate(alpha, beta, gamma, t.tex_coords[0], t.tex_coords[1], t.tex_coords[2], 1.0f);
                         auto interpolated_shadingcoords = interpolate(alpha, beta, gamma, view_pos[0], view_pos[1], view_pos[2], 1);
-                        auto payload = fragment_shader_payload(interpolated_color, interpolated_normal.normalized(), interpolated_texcoords, texture? &texture.value():nullptr);
+                        auto payload = fragment_shader_payload(interpolated_color, interpolated_normal.normalized(), interpolated_texcoords, bound_diffuse);
                         payload.view_pos = interpolated_shadingcoords;
-                        auto final_color = fragment_shader(payload);
-                        set_pixel(Vector2i(x, y), final_color);
+                        payload.tex_dx = tex_dx;
+                        payload.tex_dy = tex_dy;
+                        payload.tangent = alpha * t.tangent[0] + beta * t.tangent[1] + gamma * t.tangent[2];
+                        payload.normal_map = bound_normal;
+                        payload.height_map = bound_height;
+                        payload.shadows = shadows;
+                        Eigen::Vector3f final_color;
+                        {
+                            auto shade_timer = profiling.time(Stage::Shade);
+                            counters.shader_invocations++;
+                            final_color = fragment_shader(payload);
+                        }
+                        if (blend_transparent)
+                            add_transparent_fragment(get_index(x, y), final_color, z_interpolated, -interpolated_shadingcoords.z());
+                        else
+                            set_pixel(Vector2i(x, y), final_color);
+                    } else {
+                        counters.depth_failed++;
                     }
             }
         }
     }
 }
 
+// Attribute of all four lanes: the vertex values weighted by each lane's barycentrics
+template <typename Vec>
+static Eigen::Array<float, quad_lanes, Vec::RowsAtCompileTime> interpolate_lanes(
+    const lane_float& alpha, const lane_float& beta, const lane_float& gamma, const Vec& vert1, const Vec& vert2, const Vec& vert3)
+{
+    Eigen::Array<float, quad_lanes, Vec::RowsAtCompileTime> result;
+    for (int k = 0; k < Vec::RowsAtCompileTime; ++k)
+    {
+        result.col(k) = alpha * vert1[k] + beta * vert2[k] + gamma * vert3[k];
+    }
+    return result;
+}
+
+void rst::rasterizer::rasterize_quads(const Triangle& t, const std::array<Eigen::Vector3f, 3>& view_pos,
+                                      int x_min, int x_max, int y_min, int y_max,
+                                      const Eigen::Vector2f& tex_dx, const Eigen::Vector2f& tex_dy)
+{
+    auto v = t.toVector4();
+
+    // The edge tests of insideTriangle and the formulas of computeBarycentric2D, set up once per
+    // triangle and then evaluated for the four lanes of a quad together
+    Eigen::Vector3f p[3];
+    for (int i = 0; i < 3; ++i)
+        p[i] = {v[i].x(), v[i].y(), 1.0f};
+    Eigen::Vector3f edge[3] = {p[1].cross(p[0]), p[2].cross(p[1]), p[0].cross(p[2])};
+    float side[3] = {edge[0].dot(p[2]), edge[1].dot(p[0]), edge[2].dot(p[1])};
+
+    float x0 = v[0].x(), y0 = v[0].y(), x1 = v[1].x(), y1 = v[1].y(), x2 = v[2].x(), y2 = v[2].y();
+    float denom[3] = {x0*(y1 - y2) + (x2 - x1)*y0 + x1*y2 - x2*y1,
+                      x1*(y2 - y0) + (x0 - x2)*y1 + x2*y0 - x0*y2,
+                      x2*(y0 - y1) + (x1 - x0)*y2 + x0*y1 - x1*y0};
+
+    const lane_float lane_x = (lane_float() << 0.5f, 1.5f, 0.5f, 1.5f).finished();
+    const lane_float lane_y = (lane_float() << 0.5f, 0.5f, 1.5f, 1.5f).finished();
+
+    frame_counters& counters = profiling.counters();
+    fragment_quad_payload quad;
+    quad.tex_dx = tex_dx;
+    quad.tex_dy = tex_dy;
+    quad.texture = bound_diffuse;
+    quad.normal_map = bound_normal;
+    quad.height_map = bound_height;
+    quad.shadows = shadows;
+
+    // Quads are aligned to even pixel coordinates
+    for (int y = y_min & ~1; y <= y_max; y += 2) {
+        for (int x = x_min & ~1; x <= x_max; x += 2) {
+            lane_float cx = lane_x + float(x), cy = lane_y + float(y);
+
+            auto covered = (cx > float(x_min)) && (cx < float(x_max + 1)) && (cy > float(y_min)) && (cy < float(y_max + 1)) &&
+                           ((cx * edge[0].x() + cy * edge[0].y() + edge[0].z()) * side[0] > 0) &&
+                           ((cx * edge[1].x() + cy * edge[1].y() + edge[1].z()) * side[1] > 0) &&
+                           ((cx * edge[2].x() + cy * edge[2].y() + edge[2].z()) * side[2] > 0);
+            Eigen::Array<bool, quad_lanes, 1> coverage = covered;
+            if (!coverage.any()) {
+                continue;
+            }
+
+            lane_float alpha = (cx*(y1 - y2) + (x2 - x1)*cy + x1*y2 - x2*y1) / denom[0];
+            lane_float beta = (cx*(y2 - y0) + (x0 - x2)*cy + x2*y0 - x0*y2) / denom[1];
+            lane_float gamma = (cx*(y0 - y1) + (x1 - x0)*cy + x0*y1 - x1*y0) / denom[2];
+
+            lane_float w_reciprocal = 1.0f / (alpha / v[0].w() + beta / v[1].w() + gamma / v[2].w());
+            lane_float z_interpolated =
+                    alpha * v[0].z() / v[0].w() + beta * v[1].z() / v[1].w() + gamma * v[2].z() / v[2].w();
+            z_interpolated *= w_reciprocal;
+
+            unsigned mask = 0;
+            for (int i = 0; i < quad_lanes; ++i) {
+                if (!coverage[i]) {
+                    continue;
+                }
+                counters.fragments++;
+                float& depth = depth_buf[get_index(x + (i & 1), y + (i >> 1))];
+                if (z_interpolated[i] < depth) {
+                    if (!blend_transparent)
+                        depth = z_interpolated[i];
+                    mask |= 1u << i;
+                    counters.depth_passed++;
+                } else {
+                    counters.depth_failed++;
+                }
+            }
+            if (!mask) {
+                continue;
+            }
+
+            quad.mask = mask;
+            quad.color = interpolate_lanes(alpha, beta, gamma, t.color[0], t.color[1], t.color[2]);
+            quad.normal = normalize_lanes(interpolate_lanes(alpha, beta, gamma, t.normal[0], t.normal[1], t.normal[2]));
+            quad.tangent = interpolate_lanes(alpha, beta, gamma, t.tangent[0], t.tangent[1], t.tangent[2]);
+            quad.tex_coords = interpolate_lanes(alpha, beta, gamma, t.tex_coords[0], t.tex_coords[1], t.tex_coords[2]);
+            quad.view_pos = interpolate_lanes(alpha, beta, gamma, view_pos[0], view_pos[1], view_pos[2]);
+
+            lane_vec3 colors;
+            {
+                auto shade_timer = profiling.time(Stage::Shade);
+                counters.shader_invocations++;
+                colors = quad_fragment_shader(quad);
+            }
+            for (int i = 0; i < quad_lanes; ++i) {
+                if (!(mask & (1u << i))) {
+                    continue;
+                }
+                if (blend_transparent) {
+                    add_transparent_fragment(get_index(x + (i & 1), y + (i >> 1)), colors.row(i).transpose().matrix(),
+                                             z_interpolated[i], -quad.view_pos(i, 2));
+                } else {
+                    set_pixel(Vector2i(x + (i & 1), y + (i >> 1)), colors.row(i).transpose().matrix());
+                }
+            }
+        }
+    }
+}
+
 void rst::rasterizer::set_model(const Eigen::Matrix4f& m)
 {
     model = m;
@@ -310,7 +1042,16 @@ void rst::rasterizer::clear(rst::Buffers buff)
 {
     if ((buff & rst::Buffers::Color) == rst::Buffers::Color)
     {
-        std::fill(frame_buf.begin(), frame_buf.end(), Eigen::Vector3f{0, 0, 0});
+        color_buf.fill(Eigen::Vector3f{0, 0, 0});
+        // Fragments that were drawn but never read back
+        if (oit_pending)
+        {
+            std::fill(oit_heads.begin(), oit_heads.end(), -1);
+            std::fill(oit_accum.begin(), oit_accum.end(), Eigen::Vector4f::Zero());
+            std::fill(oit_revealage.begin(), oit_revealage.end(), 1.0f);
+            oit_used = 0;
+            oit_pending = false;
+        }
     }
     if ((buff & rst::Buffers::Depth) == rst::Buffers::Depth)
     {
@@ -318,24 +1059,54 @@ void rst::rasterizer::clear(rst::Buffers buff)
     }
 }
 
-rst::rasterizer::rasterizer(int w, int h) : width(w), height(h)
+rst::rasterizer::rasterizer(int w, int h, ColorFormat format) : layout(w, h), color_buf(format), width(w), height(h)
 {
+    color_buf.resize(layout.size());
+    depth_buf.resize(layout.size());
     frame_buf.resize(w * h);
-    depth_buf.resize(w * h);
 
-    texture = std::nullopt;
 }
 
-int rst::rasterizer::get_index(int x, int y)
+std::vector<Eigen::Vector3f>& rst::rasterizer::frame_buffer()
 {
-    return (height-y)*width + x;
+    auto timer = profiling.time(Stage::Resolve);
+    if (oit_pending)
+    {
+        resolve_transparency();
+    }
+    for (int y = 0; y < height; ++y)
+    {
+        auto row = frame_buf.begin() + (height - 1 - y) * width;
+        for (int x = 0; x < width; ++x)
+        {
+            row[x] = color_buf.get(get_index(x, y));
+        }
+    }
+    return frame_buf;
+}
+
+void rst::rasterizer::depth_buffer(std::vector<float>& ndc_depth) const
+{
+    // Inverse of the depth mapping in viewport_transform
+    float f1 = (50 - 0.1) / 2.0;
+    float f2 = (50 + 0.1) / 2.0;
+
+    ndc_depth.resize(size_t(width) * height);
+    for (int y = 0; y < height; ++y)
+    {
+        for (int x = 0; x < width; ++x)
+        {
+            float z = depth_buf[get_index(x, y)];
+            ndc_depth[size_t(y) * width + x] = std::isinf(z) ? z : (z - f2) / f1;
+        }
+    }
 }
 
 void rst::rasterizer::set_pixel(const Vector2i &point, const Eigen::Vector3f &color)
 {
-    //old index: auto ind = point.y() + point.x() * width;
-    int ind = (height-point.y())*width + point.x();
-    frame_buf[ind] = color;
+    if (point.x() < 0 || point.x() >= width ||
+        point.y() < 0 || point.y() >= height) return;
+    color_buf.set(get_index(point.x(), point.y()), color);
 }
 
 void rst::rasterizer::set_vertex_shader(std::function<Eigen::Vector3f(vertex_shader_payload)> vert_shader)
@@ -346,5 +1117,11 @@ void rst::rasterizer::set_vertex_shader(std::function<Eigen::Vector3f(vertex_sha
 void rst::rasterizer::set_fragment_shader(std::function<Eigen::Vector3f(fragment_shader_payload)> frag_shader)
 {
     fragment_shader = frag_shader;
+    quad_fragment_shader = nullptr;
 }
 
+void rst::rasterizer::set_quad_fragment_shader(std::function<lane_vec3(const fragment_quad_payload&)> quad_shader)
+{
+    quad_fragment_shader = quad_shader;
+    fragment_shader = nullptr;
+}
@@ -8,6 +8,9 @@
 #include <optional>
 #include <algorithm>
 #include "global.hpp"
+#include "BufferRegistry.hpp"
+#include "Framebuffer.hpp"
+#include "Profiler.hpp"
 #include "Shader.hpp"
 #include "Triangle.hpp"
 
@@ -37,84 +40,293 @@ namespace rst
         Triangle
     };
 
+    // Which screen-space winding gets discarded; counter clockwise triangles face the camera
+    enum class CullMode
+    {
+        None,
+        Back,
+        Front
+    };
+
+    // How fragments of materials with an opacity below 1 are composited
+    enum class TransparencyMode
+    {
+        Off,              // drawn like opaque ones
+        ABuffer,          // per-pixel fragment lists, sorted and blended exactly when resolved
+        WeightedBlended   // depth weighted average, one accumulation per pixel and no sorting
+    };
+
+    // Triangle counters of the culling stage, accumulated until reset_stats() is called
+    struct pipeline_stats
+    {
+        int submitted = 0;          // triangles assembled from the index buffer
+        int frustum_culled = 0;     // completely outside one frustum plane
+        int backface_culled = 0;    // rejected by the cull mode
+        int degenerate_culled = 0;  // zero area after snapping
+        int small_culled = 0;       // bounding box covers no pixel center
+        int rasterized = 0;         // triangles handed to the rasterizer, clipped fans count each piece
+        int instances_culled = 0;   // instances of draw_indexed whose bounds are outside the frustum
+
+        int culled() const { return frustum_culled + backface_culled + degenerate_culled + small_culled; }
+    };
+
     /*
      * For the curious : The draw function takes two buffer id's as its arguments. These two structs
      * make sure that if you mix up with their orders, the compiler won't compile it.
      * Aka : Type safety
      * */
-    struct pos_buf_id
+    struct pos_buf_id : buffer_handle
+    {
+    };
+
+    struct ind_buf_id : buffer_handle
+    {
+    };
+
+    struct col_buf_id : buffer_handle
+    {
+    };
+
+    struct tex_buf_id : buffer_handle
+    {
+    };
+
+    // Model matrices of the instances of a draw_indexed
+    struct inst_buf_id : buffer_handle
+    {
+    };
+
+    // Textures a mesh is shaded with, any of them may be left unset
+    struct material
     {
-        int pos_id = 0;
+        texture_handle diffuse;
+        texture_handle normal;
+        texture_handle height;
+        float opacity = 1.0f;   // below 1 the material takes the transparency path
     };
 
-    struct ind_buf_id
+    struct material_id
     {
-        int ind_id = 0;
+        int mat_id = -1;
     };
 
-    struct col_buf_id
+    // One piece of a multi-mesh draw: its triangles, indexing the draw's shared vertex buffers
+    struct submesh
     {
-        int col_id = 0;
+        ind_buf_id indices;
+        material_id material;
     };
 
     class rasterizer
     {
     public:
-        rasterizer(int w, int h);
-        pos_buf_id load_positions(const std::vector<Eigen::Vector3f>& positions);
-        ind_buf_id load_indices(const std::vector<Eigen::Vector3i>& indices);
-        col_buf_id load_colors(const std::vector<Eigen::Vector3f>& colors);
-        col_buf_id load_normals(const std::vector<Eigen::Vector3f>& normals);
+        rasterizer(int w, int h, ColorFormat format = ColorFormat::RGB32F);
+        // The vectors are taken by value: pass an rvalue to move the data in instead of copying it.
+        // Normals, texcoords and tangents become the ones every following draw uses.
+        pos_buf_id load_positions(std::vector<Eigen::Vector3f> positions);
+        ind_buf_id load_indices(std::vector<Eigen::Vector3i> indices);
+        col_buf_id load_colors(std::vector<Eigen::Vector3f> colors);
+        col_buf_id load_normals(std::vector<Eigen::Vector3f> normals);
+        tex_buf_id load_texcoords(std::vector<Eigen::Vector2f> texcoords);
+        // xyz is the direction of increasing u, w (+1 or -1) the side of the bitangent, see Shader.hpp
+        col_buf_id load_tangents(std::vector<Eigen::Vector4f> tangents);
+        inst_buf_id load_instances(std::vector<Eigen::Matrix4f> transforms);
+
+        // The buffers behind the ids, for in-place updates, mapped writes and release
+        buffer_registry<Eigen::Vector3f, pos_buf_id>& position_buffers() { return pos_buf; }
+        buffer_registry<Eigen::Vector3i, ind_buf_id>& index_buffers() { return ind_buf; }
+        buffer_registry<Eigen::Vector3f, col_buf_id>& color_buffers() { return col_buf; }
+        buffer_registry<Eigen::Vector3f, col_buf_id>& normal_buffers() { return nor_buf; }
+        buffer_registry<Eigen::Vector2f, tex_buf_id>& texcoord_buffers() { return tex_buf; }
+        buffer_registry<Eigen::Vector4f, col_buf_id>& tangent_buffers() { return tan_buf; }
+        buffer_registry<Eigen::Matrix4f, inst_buf_id>& instance_buffers() { return inst_buf; }
 
         void set_model(const Eigen::Matrix4f& m);
         void set_view(const Eigen::Matrix4f& v);
         void set_projection(const Eigen::Matrix4f& p);
 
-        void set_texture(Texture tex) { texture = tex; }
+        // Textures are registered with the rasterizer's TextureManager and streamed on first use
+        texture_handle load_texture(const std::string& path) { return texture_manager.load(path); }
+        texture_handle load_normal_map(const std::string& height_path, float scale) { return texture_manager.load_normal_map(height_path, scale); }
+        material_id add_material(const material& m);
+
+        // Material used by the single-mesh draw. set_texture binds tex as both the diffuse and
+        // the height map, the way the bump and displacement shaders have always used it.
+        void set_material(const material& m) { current_material = m; }
+        void set_texture(texture_handle tex) { current_material = {tex, {}, tex}; }
+        TextureManager& textures() { return texture_manager; }
 
         void set_vertex_shader(std::function<Eigen::Vector3f(vertex_shader_payload)> vert_shader);
         void set_fragment_shader(std::function<Eigen::Vector3f(fragment_shader_payload)> frag_shader);
+        // Shades 2x2 pixel quads at a time instead, see fragment_quad_payload. Setting either kind
+        // of fragment shader replaces the other.
+        void set_quad_fragment_shader(std::function<lane_vec3(const fragment_quad_payload&)> quad_shader);
 
         void set_pixel(const Vector2i &point, const Eigen::Vector3f &color);
 
+        // Only depth is tested and written, no fragment is shaded; used for shadow maps
+        void set_depth_only(bool enabled) { depth_only = enabled; }
+        // Shadow maps handed to the fragment shaders through their payload, may be nullptr
+        void set_shadows(const shadow_atlas* atlas) { shadows = atlas; }
+
+        void set_cull_mode(CullMode mode) { cull_mode = mode; }
+
+        /*
+         * Order-independent transparency. Fragments of transparent materials are depth tested
+         * against the opaque ones without writing depth, and composited over them when the frame
+         * is read back with frame_buffer(); triangles need no sorting. Draws with opaque materials
+         * should come first in WeightedBlended mode, whose fragments are only tested when they
+         * arrive. The A-buffer takes up to arena_fragments fragments per frame (24 bytes each);
+         * fragments beyond that are dropped and counted by the profiler.
+         */
+        void set_transparency(TransparencyMode mode, size_t arena_fragments = size_t(1) << 20);
+        const pipeline_stats& stats() const { return statistics; }
+        void reset_stats() { statistics = pipeline_stats(); }
+        // Stage timers and per-frame counters; frames are delimited by the caller
+        frame_profiler& profiler() { return profiling; }
+
         void clear(Buffers buff);
 
         void draw(pos_buf_id pos_buffer, ind_buf_id ind_buffer, col_buf_id col_buffer, Primitive type);
-        void draw(std::vector<Triangle *> &TriangleList);
+        // Draws many meshes sharing one set of vertex buffers in a single pass. The vertex stage
+        // runs once, the meshes are rasterized grouped by material so every material is bound once.
+        // Submeshes without a material shade with the current material, as in draw_indexed.
+        void draw(pos_buf_id pos_buffer, col_buf_id col_buffer, const std::vector<submesh>& meshes);
 
-        std::vector<Eigen::Vector3f>& frame_buffer() { return frame_buf; }
+        /*
+         * Draws every instance of an indexed mesh in one call, instance i placed by
+         * model * instances[i]. The vertex shader runs once per draw; each instance's vertices are
+         * transformed once and shared by its triangles, and instances whose bounding box is
+         * outside the frustum are skipped whole. Normals and texcoords may be left unset (zero);
+         * the current tangent buffer is used when it matches the positions. Vertices get the flat
+         * color of the spot model. The first form, and submeshes without a material, shade with the
+         * current material.
+         */
+        void draw_indexed(pos_buf_id positions, col_buf_id normals, tex_buf_id texcoords, ind_buf_id indices,
+                          inst_buf_id instances);
+        void draw_indexed(pos_buf_id positions, col_buf_id normals, tex_buf_id texcoords,
+                          const std::vector<submesh>& meshes, inst_buf_id instances);
+
+        // Converts the tiled color buffer to a linear, top row first image for OpenCV
+        std::vector<Eigen::Vector3f>& frame_buffer();
+        // Normalized device depth in [-1, 1], +inf where nothing was drawn. Rows are in screen
+        // order, row 0 at the bottom.
+        void depth_buffer(std::vector<float>& ndc_depth) const;
 
     private:
         void draw_line(Eigen::Vector3f begin, Eigen::Vector3f end);
 
         void rasterize_triangle(const Triangle& t, const std::array<Eigen::Vector3f, 3>& world_pos);
+        // Quad shading path of rasterize_triangle, walks the bounding box in 2x2 blocks
+        void rasterize_quads(const Triangle& t, const std::array<Eigen::Vector3f, 3>& view_pos,
+                             int x_min, int x_max, int y_min, int y_max,
+                             const Eigen::Vector2f& tex_dx, const Eigen::Vector2f& tex_dy);
+        // Depth-only path of rasterize_triangle, for shadow maps
+        void rasterize_depth(const Triangle& t, int x_min, int x_max, int y_min, int y_max);
+
+        // Snaps the screen-space vertices and returns true if the triangle can be discarded
+        bool cull_triangle(Triangle& t);
 
         // VERTEX SHADER -> MVP -> Clipping -> /.W -> VIEWPORT -> DRAWLINE/DRAWTRI -> FRAGSHADER
 
+        // Object space positions after the vertex shader; positions itself when there is none
+        const Eigen::Matrix3Xf& shade_vertices(const Eigen::Matrix3Xf& positions, Eigen::Matrix3Xf& shaded);
+        // Transforms shaded vertices once per unique vertex, filling the post-transform cache
+        void process_vertices(const Eigen::Matrix3Xf& positions, const Eigen::Matrix3Xf& normals,
+                              const Eigen::Matrix4Xf& tangents, const Eigen::Matrix4f& model_matrix);
+        // Assembles triangles from the post-transform cache, clips them and rasterizes them.
+        void assemble_triangles(const std::vector<Eigen::Vector3i>& indices,
+                                const Eigen::Matrix2Xf& texcoords, const Eigen::Matrix3Xf& colors);
+        // Maps the vertex buffers of a draw and runs the vertex stage on them
+        void transform_vertices(pos_buf_id pos_buffer, col_buf_id col_buffer,
+                                Eigen::Matrix2Xf& texcoords, Eigen::Matrix3Xf& colors);
+        // Resolves the handles of a material to the textures the fragment shader receives
+        void bind_material(const material& m);
+        // Meshes of a draw in the order they are rasterized: opaque materials first, grouped by material
+        std::vector<const submesh*> material_order(const std::vector<submesh>& meshes) const;
+        // Records a shaded fragment of a transparent material; depth is in the depth buffer's
+        // range, view_depth the positive view space distance
+        void add_transparent_fragment(int index, const Eigen::Vector3f& color, float depth, float view_depth);
+        // Composites the transparent fragments of the frame over the opaque colors
+        void resolve_transparency();
+        // Homogeneous division followed by the viewport transform, keeps w
+        Eigen::Vector4f viewport_transform(const Eigen::Vector4f& clip_pos) const;
+
     private:
         Eigen::Matrix4f model;
         Eigen::Matrix4f view;
         Eigen::Matrix4f projection;
 
-        int normal_id = -1;
+        CullMode cull_mode = CullMode::None;
+        pipeline_stats statistics;
+        frame_profiler profiling;
+
+        // Attribute buffers of the following draws; released or never loaded ones are left out
+        col_buf_id normal_id;
+        tex_buf_id texcoord_id;
+        col_buf_id tangent_id;
+
+        buffer_registry<Eigen::Vector3f, pos_buf_id> pos_buf;
+        buffer_registry<Eigen::Vector3i, ind_buf_id> ind_buf;
+        buffer_registry<Eigen::Vector3f, col_buf_id> col_buf;
+        buffer_registry<Eigen::Vector3f, col_buf_id> nor_buf;
+        buffer_registry<Eigen::Vector2f, tex_buf_id> tex_buf;
+        buffer_registry<Eigen::Vector4f, col_buf_id> tan_buf;
+        buffer_registry<Eigen::Matrix4f, inst_buf_id> inst_buf;
 
-        std::map<int, std::vector<Eigen::Vector3f>> pos_buf;
-        std::map<int, std::vector<Eigen::Vector3i>> ind_buf;
-        std::map<int, std::vector<Eigen::Vector3f>> col_buf;
-        std::map<int, std::vector<Eigen::Vector3f>> nor_buf;
+        TextureManager texture_manager;
+        std::vector<material> materials;
+        material current_material;
 
-        std::optional<Texture> texture;
+        // Textures of the bound material
+        Texture* bound_diffuse = nullptr;
+        Texture* bound_normal = nullptr;
+        Texture* bound_height = nullptr;
+        float bound_opacity = 1.0f;
+        const shadow_atlas* shadows = nullptr;
+        bool depth_only = false;
+        bool blend_transparent = false;   // the bound material takes the transparency path
+
+        // Transparency, indexed by the tiled layout like the color buffer
+        struct oit_fragment
+        {
+            Eigen::Vector3f color;
+            float depth;
+            float alpha;
+            int next;   // next fragment of the pixel, -1 at the end
+        };
+        TransparencyMode transparency = TransparencyMode::Off;
+        std::vector<oit_fragment> oit_arena;
+        size_t oit_used = 0;
+        std::vector<int> oit_heads;                 // A-buffer: first fragment of each pixel
+        std::vector<Eigen::Vector4f> oit_accum;     // weighted: sum of premultiplied color and alpha
+        std::vector<float> oit_revealage;           // weighted: product of (1 - alpha)
+        bool oit_pending = false;                   // transparent fragments not resolved yet
 
         std::function<Eigen::Vector3f(fragment_shader_payload)> fragment_shader;
+        std::function<lane_vec3(const fragment_quad_payload&)> quad_fragment_shader;
         std::function<Eigen::Vector3f(vertex_shader_payload)> vertex_shader;
 
-        std::vector<Eigen::Vector3f> frame_buf;
+        // Post-transform cache, one column per unique vertex of the current draw
+        struct vertex_cache
+        {
+            Eigen::Matrix3Xf view_pos;
+            Eigen::Matrix3Xf view_normal;
+            Eigen::Matrix4Xf view_tangent;
+            Eigen::Matrix4Xf clip_pos;
+            Eigen::Matrix4Xf screen_pos; // x, y in pixels, z in depth range, w = clip w
+            std::vector<unsigned char> clip_codes;
+        };
+        vertex_cache post_transform;
+
+        // Color and depth share one tiled layout; frame_buf only holds the linear copy handed out
+        // by frame_buffer()
+        tiled_layout layout;
+        color_buffer color_buf;
         std::vector<float> depth_buf;
-        int get_index(int x, int y);
+        std::vector<Eigen::Vector3f> frame_buf;
+        int get_index(int x, int y) const { return layout.index(x, y); }
 
         int width, height;
-
-        int next_id = 0;
-        int get_next_id() { return next_id++; }
     };
 }
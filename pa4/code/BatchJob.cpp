@@ -0,0 +1,277 @@
+//
+// Job scripts of the headless batch mode.
+//
+
+#include "BatchJob.hpp"
+#include <fstream>
+#include <random>
+#include <sstream>
+#include <stdexcept>
+
+static std::runtime_error script_error(int line, const std::string& message)
+{
+    return std::runtime_error("job script line " + std::to_string(line) + ": " + message);
+}
+
+static float parse_float(const std::string& value, int line)
+{
+    try
+    {
+        size_t end;
+        float f = std::stof(value, &end);
+        if (end == value.size())
+        {
+            return f;
+        }
+    }
+    catch (const std::exception&)
+    {
+    }
+    throw script_error(line, "expected a number, got '" + value + "'");
+}
+
+static int parse_int(const std::string& value, int line)
+{
+    float f = parse_float(value, line);
+    if (f != float(int(f)) || f <= 0)
+    {
+        throw script_error(line, "expected a positive integer, got '" + value + "'");
+    }
+    return int(f);
+}
+
+// Comma separated numbers, exactly count of them
+static std::vector<float> parse_list(const std::string& value, size_t count, const std::string& form, int line)
+{
+    std::vector<float> numbers;
+    std::stringstream items(value);
+    for (std::string item; std::getline(items, item, ',');)
+    {
+        numbers.push_back(parse_float(item, line));
+    }
+    if (numbers.size() != count)
+    {
+        throw script_error(line, "expected " + form + ", got '" + value + "'");
+    }
+    return numbers;
+}
+
+static cv::Vec3b parse_color(const std::string& value, int line)
+{
+    std::vector<float> rgb = parse_list(value, 3, "<r>,<g>,<b>", line);
+    for (float c : rgb)
+    {
+        if (c < 0 || c > 255)
+        {
+            throw script_error(line, "color components are 0 to 255, got '" + value + "'");
+        }
+    }
+    return cv::Vec3b(uchar(rgb[2]), uchar(rgb[1]), uchar(rgb[0]));
+}
+
+// Applies one key=value to an image, returns false for keys that are not image settings
+static bool set_job_value(curve_job& job, const std::string& key, const std::string& value, int line)
+{
+    if (key == "out")
+    {
+        job.output = value;
+    }
+    else if (key == "size")
+    {
+        auto x = value.find('x');
+        if (x == std::string::npos)
+        {
+            throw script_error(line, "size is <width>x<height>");
+        }
+        job.width = parse_int(value.substr(0, x), line);
+        job.height = parse_int(value.substr(x + 1), line);
+    }
+    else if (key == "background")
+    {
+        job.background = parse_color(value, line);
+    }
+    else if (key == "tolerance")
+    {
+        job.tolerance = parse_float(value, line);
+        if (job.tolerance <= 0)
+        {
+            throw script_error(line, "tolerance must be positive");
+        }
+    }
+    else
+    {
+        return false;
+    }
+    return true;
+}
+
+// Applies one key=value to a curve, returns false for keys that are not curve settings
+static bool set_item_value(curve_item& item, const std::string& key, const std::string& value, int line)
+{
+    if (key == "type")
+    {
+        if (value == "bezier")
+            item.shape.type = CurveType::Bezier;
+        else if (value == "bspline")
+            item.shape.type = CurveType::BSpline;
+        else
+            throw script_error(line, "type is bezier or bspline");
+    }
+    else if (key == "degree")
+    {
+        item.shape.degree = parse_int(value, line);
+    }
+    else if (key == "color")
+    {
+        item.color = parse_color(value, line);
+    }
+    else if (key == "rule")
+    {
+        if (value == "nonzero")
+            item.rule = FillRule::NonZero;
+        else if (value == "evenodd")
+            item.rule = FillRule::EvenOdd;
+        else
+            throw script_error(line, "rule is nonzero or evenodd");
+    }
+    else
+    {
+        return false;
+    }
+    return true;
+}
+
+curve_script parse_curve_script(std::istream& in)
+{
+    curve_script script;
+    curve_job job_defaults;
+    curve_item item_defaults;
+    std::string text;
+
+    for (int line = 1; std::getline(in, text); ++line)
+    {
+        std::stringstream words(text);
+        std::string command;
+        if (!(words >> command) || command[0] == '#')
+        {
+            continue;
+        }
+
+        if (command == "threads")
+        {
+            std::string n;
+            words >> n;
+            script.threads = parse_int(n, line);
+            continue;
+        }
+        if (command != "set" && command != "image" && command != "curve" && command != "fill" &&
+            command != "random")
+        {
+            throw script_error(line, "unknown command '" + command + "'");
+        }
+        if (command != "set" && command != "image" && script.jobs.empty())
+        {
+            throw script_error(line, command + " before the first image");
+        }
+
+        curve_job job = job_defaults;
+        job.line = line;
+        curve_item item = item_defaults;
+        item.fill = command == "fill";
+        int count = 0, num_points = 4, seed = 1;
+        if (command == "random")
+        {
+            std::string n;
+            words >> n;
+            count = parse_int(n, line);
+        }
+
+        for (std::string arg; words >> arg;)
+        {
+            auto eq = arg.find('=');
+            if (eq == std::string::npos)
+            {
+                if (command != "curve" && command != "fill")
+                {
+                    throw script_error(line, "expected key=value, got '" + arg + "'");
+                }
+                std::vector<float> xy = parse_list(arg, 2, "<x>,<y>", line);
+                item.shape.points.emplace_back(xy[0], xy[1]);
+                continue;
+            }
+            std::string key = arg.substr(0, eq), value = arg.substr(eq + 1);
+            bool image_key = command == "set" || command == "image";
+            bool curve_key = command != "image";
+            if (image_key && set_job_value(job, key, value, line))
+            {
+                continue;
+            }
+            if (curve_key && set_item_value(item, key, value, line))
+            {
+                continue;
+            }
+            if (command == "random" && key == "points")
+            {
+                num_points = parse_int(value, line);
+            }
+            else if (command == "random" && key == "seed")
+            {
+                seed = parse_int(value, line);
+            }
+            else
+            {
+                throw script_error(line, "unknown key '" + key + "'");
+            }
+        }
+
+        if (command == "set")
+        {
+            job_defaults = job;
+            item_defaults = item;
+            item_defaults.shape.points.clear();
+            continue;
+        }
+        if (command == "image")
+        {
+            if (job.output.empty())
+            {
+                throw script_error(line, "image needs out=<path>");
+            }
+            script.jobs.push_back(job);
+            continue;
+        }
+
+        curve_job& image = script.jobs.back();
+        if (command == "random")
+        {
+            std::mt19937 rng(seed);
+            std::uniform_real_distribution<float> x(0, float(image.width)), y(0, float(image.height));
+            for (int i = 0; i < count; ++i)
+            {
+                curve_item random_item = item;
+                for (int k = 0; k < num_points; ++k)
+                {
+                    random_item.shape.points.emplace_back(x(rng), y(rng));
+                }
+                image.items.push_back(std::move(random_item));
+            }
+            continue;
+        }
+        if (item.shape.points.size() < 2)
+        {
+            throw script_error(line, command + " needs at least two points");
+        }
+        image.items.push_back(std::move(item));
+    }
+    return script;
+}
+
+curve_script load_curve_script(const std::string& path)
+{
+    std::ifstream in(path);
+    if (!in)
+    {
+        throw std::runtime_error("cannot read job script " + path);
+    }
+    return parse_curve_script(in);
+}
@@ -0,0 +1,58 @@
+//
+// Job scripts of the headless batch mode.
+//
+
+#ifndef BEZIERCURVE_BATCHJOB_H
+#define BEZIERCURVE_BATCHJOB_H
+
+#include "Path.hpp"
+#include <istream>
+#include <string>
+#include <vector>
+
+// One curve of an image, drawn as a line or filled as a shape closed by a line back to its start
+struct curve_item
+{
+    curve shape;
+    bool fill = false;
+    FillRule rule = FillRule::NonZero;
+    cv::Vec3b color{0, 255, 0};         // BGR, like the image
+};
+
+// One image of a batch
+struct curve_job
+{
+    std::string output;
+    int width = 700, height = 700;
+    cv::Vec3b background{0, 0, 0};
+    float tolerance = 0.25f;            // pixels between a curve and its polyline
+    std::vector<curve_item> items;      // drawn in order
+    int line = 0;                       // where the image was started in the script
+};
+
+struct curve_script
+{
+    int threads = 0;                    // 0 uses every hardware thread
+    std::vector<curve_job> jobs;
+};
+
+/*
+ * A job script has one command per line; lines starting with '#' are comments:
+ *
+ *   threads <n>                  number of render threads, shared between the images in flight
+ *   set <key=value>...           changes the defaults of the following images and curves
+ *   image <key=value>...         starts an image; the curves after it are drawn into it
+ *   curve <key=value>... <x>,<y>...   a curve through (Bezier) or along (B-spline) the points
+ *   fill <key=value>... <x>,<y>...    the same curve closed by a line, filled
+ *   random <n> <key=value>...    n curves of points=<k> (default 4) uniformly random points,
+ *                                from seed=<s> (default 1)
+ *
+ * Image keys: out=<path>, size=<w>x<h>, background=<r>,<g>,<b>, tolerance=<pixels>. An out path
+ * ending in .raw gets the bare 8 bit BGR pixels, rows top to bottom; any other is written with
+ * cv::imwrite. Curve keys: type=bezier|bspline, degree=<n> (B-spline), color=<r>,<g>,<b>,
+ * rule=nonzero|evenodd (fill). Malformed lines throw std::runtime_error naming the line.
+ */
+curve_script parse_curve_script(std::istream& in);
+curve_script load_curve_script(const std::string& path);
+
+#endif //BEZIERCURVE_BATCHJOB_H
@@ -0,0 +1,328 @@
+//
+// Bezier and B-spline curves, flattened to polylines for drawing.
+//
+
+#include "Curve.hpp"
+#include <algorithm>
+#include <atomic>
+#include <cmath>
+#include <thread>
+
+static std::atomic<size_t> worker_limit{0};
+
+void set_max_workers(size_t n)
+{
+    worker_limit = n;
+}
+
+size_t max_workers()
+{
+    size_t limit = worker_limit;
+    if (limit > 0)
+    {
+        return limit;
+    }
+    return std::min<size_t>(std::max(1u, std::thread::hardware_concurrency()), 16);
+}
+
+void parallel_for(size_t count, size_t min_per_thread, const std::function<void(size_t, size_t)>& body)
+{
+    size_t num_threads = std::min(max_workers(), std::max<size_t>(1, count / min_per_thread));
+    std::vector<std::thread> workers;
+    for (size_t t = 1; t < num_threads; ++t)
+    {
+        workers.emplace_back(body, count * t / num_threads, count * (t + 1) / num_threads);
+    }
+    body(0, count / num_threads);
+    for (auto& w : workers)
+    {
+        w.join();
+    }
+}
+
+// Row n of Pascal's triangle
+static std::vector<double> binomials(int n)
+{
+    std::vector<double> row(n + 1, 1.0);
+    for (int k = 1; k < n; ++k)
+    {
+        row[k] = row[k - 1] * (n - k + 1) / k;
+    }
+    return row;
+}
+
+static cv::Point2d bernstein_sum(const std::vector<cv::Point2f>& points, const std::vector<double>& binomial, double t)
+{
+    int n = int(points.size()) - 1;
+    // t^k grows with k; only (1 - t)^(n - k) needs a pow
+    cv::Point2d sum(0, 0);
+    double t_power = 1;
+    for (int k = 0; k <= n; ++k)
+    {
+        sum += binomial[k] * t_power * std::pow(1 - t, n - k) * cv::Point2d(points[k]);
+        t_power *= t;
+    }
+    return sum;
+}
+
+cv::Point2f bezier_point(const std::vector<cv::Point2f>& points, float t)
+{
+    if (points.empty())
+    {
+        return {0, 0};
+    }
+    cv::Point2d p = bernstein_sum(points, binomials(int(points.size()) - 1), t);
+    return {float(p.x), float(p.y)};
+}
+
+std::vector<std::vector<cv::Point2f>> bspline_to_bezier(const std::vector<cv::Point2f>& points, int degree)
+{
+    std::vector<std::vector<cv::Point2f>> pieces;
+    int m = int(points.size()) - 1;
+    int p = std::min(degree, m);
+    if (p < 1)
+    {
+        return pieces;
+    }
+
+    // Clamped uniform knots: p + 1 zeros, 1 .. m - p, p + 1 copies of m - p + 1
+    std::vector<double> knots(m + p + 2);
+    for (int i = 0; i < int(knots.size()); ++i)
+    {
+        knots[i] = std::min(std::max(i - p, 0), m - p + 1);
+    }
+
+    std::vector<cv::Point2d> d(p + 1);
+    std::vector<double> params(p);
+    for (int span = p; span <= m; ++span)
+    {
+        double u0 = knots[span], u1 = knots[span + 1];
+        if (u1 <= u0)
+        {
+            continue;
+        }
+        // Bezier point k of the span is the blossom at (u0 x (p - k), u1 x k): de Boor's algorithm
+        // with a parameter of its own at every level
+        std::vector<cv::Point2f> piece(p + 1);
+        for (int k = 0; k <= p; ++k)
+        {
+            for (int r = 0; r < p; ++r)
+            {
+                params[r] = r < p - k ? u0 : u1;
+            }
+            for (int j = 0; j <= p; ++j)
+            {
+                d[j] = cv::Point2d(points[span - p + j]);
+            }
+            for (int r = 1; r <= p; ++r)
+            {
+                for (int j = p; j >= r; --j)
+                {
+                    double lo = knots[span - p + j], hi = knots[span + 1 + j - r];
+                    double alpha = (params[r - 1] - lo) / (hi - lo);
+                    d[j] = (1 - alpha) * d[j - 1] + alpha * d[j];
+                }
+            }
+            piece[k] = cv::Point2f(float(d[p].x), float(d[p].y));
+        }
+        pieces.push_back(std::move(piece));
+    }
+    return pieces;
+}
+
+static const int max_differenced_degree = 4;
+
+// Appends the points of one Bezier piece after its first one
+static void flatten_bezier(const std::vector<cv::Point2f>& points, float tolerance, polyline& out)
+{
+    int n = int(points.size()) - 1;
+    if (n < 1)
+    {
+        return;
+    }
+
+    // Wang's bound: n steps of t keep a degree n curve within tolerance of its chords when
+    // steps^2 >= n (n - 1) / 8 * max |P[i] - 2 P[i + 1] + P[i + 2]| / tolerance
+    double second = 0;
+    for (int i = 0; i + 2 <= n; ++i)
+    {
+        second = std::max(second, cv::norm(points[i] - 2 * points[i + 1] + points[i + 2]));
+    }
+    double bound = n * (n - 1) / 8.0 * second / std::max(tolerance, 1e-3f);
+    int steps = std::min(4096, std::max(1, int(std::ceil(std::sqrt(bound)))));
+    if (n == 1)
+    {
+        steps = 1;
+    }
+
+    // Rounding in the k-th difference grows like steps^k, which stays far below a pixel up to
+    // quartics; higher degrees sum the Bernstein basis at every point instead
+    std::vector<double> binomial = binomials(n);
+    if (steps <= n || n > max_differenced_degree)
+    {
+        for (int s = 1; s <= steps; ++s)
+        {
+            cv::Point2d p = bernstein_sum(points, binomial, double(s) / steps);
+            out.emplace_back(float(p.x), float(p.y));
+        }
+        return;
+    }
+
+    // Forward differences of the first n + 1 samples; the n-th difference of a degree n
+    // polynomial is constant, so every further step is n additions
+    std::vector<cv::Point2d> delta(n + 1);
+    for (int k = 0; k <= n; ++k)
+    {
+        delta[k] = bernstein_sum(points, binomial, double(k) / steps);
+    }
+    for (int order = 1; order <= n; ++order)
+    {
+        for (int k = n; k >= order; --k)
+        {
+            delta[k] -= delta[k - 1];
+        }
+    }
+    for (int s = 1; s <= steps; ++s)
+    {
+        for (int k = 0; k < n; ++k)
+        {
+            delta[k] += delta[k + 1];
+        }
+        out.emplace_back(float(delta[0].x), float(delta[0].y));
+    }
+    // The end point exactly, whatever rounding the differences picked up
+    out.back() = points.back();
+}
+
+void flatten(const curve& c, float tolerance, polyline& out)
+{
+    out.clear();
+    if (c.points.empty())
+    {
+        return;
+    }
+    out.push_back(c.points.front());
+    if (c.type == CurveType::Bezier)
+    {
+        flatten_bezier(c.points, tolerance, out);
+        return;
+    }
+    for (auto& piece : bspline_to_bezier(c.points, c.degree))
+    {
+        flatten_bezier(piece, tolerance, out);
+    }
+}
+
+polyline flatten(const curve& c, float tolerance)
+{
+    polyline out;
+    flatten(c, tolerance, out);
+    return out;
+}
+
+std::vector<polyline> flatten_all(const std::vector<curve>& curves, float tolerance)
+{
+    std::vector<polyline> lines(curves.size());
+    parallel_for(curves.size(), 64, [&](size_t first, size_t last) {
+        for (size_t i = first; i < last; ++i)
+        {
+            flatten(curves[i], tolerance, lines[i]);
+        }
+    });
+    return lines;
+}
+
+// Wu line from a to b, only the pixels in rows [y_lo, y_hi]. Pixel (x, y) covers
+// [x, x + 1) x [y, y + 1); the line is evaluated at every column or row rather than stepped, so a
+// band's pixels do not depend on where the band starts.
+template <typename Plot>
+static void wu_line(cv::Point2f a, cv::Point2f b, int y_lo, int y_hi, Plot plot)
+{
+    float dx = b.x - a.x;
+    float dy = b.y - a.y;
+    if (std::abs(dx) >= std::abs(dy))
+    {
+        if (dx < 0)
+        {
+            std::swap(a, b);
+        }
+        float slope = b.x > a.x ? (b.y - a.y) / (b.x - a.x) : 0.0f;
+        int x_first = int(std::floor(a.x));
+        int x_last = int(std::floor(b.x));
+        if (slope != 0)
+        {
+            float x0 = a.x + (float(y_lo - 1) - a.y) / slope - 0.5f;
+            float x1 = a.x + (float(y_hi + 2) - a.y) / slope - 0.5f;
+            x_first = std::max(x_first, int(std::floor(std::min(x0, x1))));
+            x_last = std::min(x_last, int(std::ceil(std::max(x0, x1))));
+        }
+        for (int x = x_first; x <= x_last; ++x)
+        {
+            float center = a.y + (float(x) + 0.5f - a.x) * slope - 0.5f;
+            int row = int(std::floor(center));
+            float f = center - float(row);
+            plot(x, row, 1.0f - f);
+            plot(x, row + 1, f);
+        }
+    }
+    else
+    {
+        if (dy < 0)
+        {
+            std::swap(a, b);
+        }
+        float slope = (b.x - a.x) / (b.y - a.y);
+        int y_first = std::max(y_lo, int(std::floor(a.y)));
+        int y_last = std::min(y_hi, int(std::floor(b.y)));
+        for (int y = y_first; y <= y_last; ++y)
+        {
+            float center = a.x + (float(y) + 0.5f - a.y) * slope - 0.5f;
+            int column = int(std::floor(center));
+            float f = center - float(column);
+            plot(column, y, 1.0f - f);
+            plot(column + 1, y, f);
+        }
+    }
+}
+
+void draw_polylines(const std::vector<polyline>& lines, cv::Mat& image, const cv::Vec3b& color)
+{
+    CV_Assert(image.type() == CV_8UC3);
+    const int width = image.cols;
+    const int height = image.rows;
+
+    size_t num_segments = 0;
+    for (auto& line : lines)
+    {
+        num_segments += line.size() > 1 ? line.size() - 1 : 0;
+    }
+    size_t num_bands = std::min({max_workers(), std::max<size_t>(1, num_segments / 1024), size_t(std::max(1, height / 16))});
+
+    parallel_for(num_bands, 1, [&](size_t first_band, size_t last_band) {
+        for (size_t band = first_band; band < last_band; ++band)
+        {
+            int y_lo = int(band * height / num_bands);
+            int y_hi = int((band + 1) * height / num_bands) - 1;
+
+            auto plot = [&](int x, int y, float coverage) {
+                if (x < 0 || x >= width || y < y_lo || y > y_hi || coverage <= 0)
+                    return;
+                cv::Vec3b& pixel = image.ptr<cv::Vec3b>(y)[x];
+                for (int i = 0; i < 3; ++i)
+                    pixel[i] = std::max(pixel[i], uchar(color[i] * coverage + 0.5f));
+            };
+
+            for (auto& line : lines)
+            {
+                for (size_t i = 1; i < line.size(); ++i)
+                {
+                    const cv::Point2f& a = line[i - 1];
+                    const cv::Point2f& b = line[i];
+                    if (std::max(a.y, b.y) < float(y_lo - 1) || std::min(a.y, b.y) > float(y_hi + 2))
+                        continue;
+                    wu_line(a, b, y_lo, y_hi, plot);
+                }
+            }
+        }
+    });
+}
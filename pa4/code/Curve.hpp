@@ -0,0 +1,62 @@
+//
+// Bezier and B-spline curves, flattened to polylines for drawing.
+//
+
+#ifndef BEZIERCURVE_CURVE_H
+#define BEZIERCURVE_CURVE_H
+
+#include <functional>
+#include <opencv2/opencv.hpp>
+#include <vector>
+
+using polyline = std::vector<cv::Point2f>;
+
+enum class CurveType
+{
+    Bezier,   // one piece through all control points, of degree points - 1
+    BSpline   // clamped uniform B-spline of the given degree, starts and ends at its end points
+};
+
+struct curve
+{
+    CurveType type = CurveType::Bezier;
+    int degree = 3;                      // B-spline only
+    std::vector<cv::Point2f> points;
+};
+
+// Number of threads the batch functions use: the hardware threads, at most 16, unless set to n
+// (0 goes back to the hardware threads)
+size_t max_workers();
+void set_max_workers(size_t n);
+
+// Calls body(begin, end) on contiguous slices of [0, count), one per thread, with fewer threads
+// when a slice would hold less than min_per_thread items
+void parallel_for(size_t count, size_t min_per_thread, const std::function<void(size_t, size_t)>& body);
+
+// Point of the Bezier curve with these control points at t, summed over the Bernstein basis
+cv::Point2f bezier_point(const std::vector<cv::Point2f>& points, float t);
+
+// Bezier control points of every non-empty piece of a clamped uniform B-spline, by blossoming
+std::vector<std::vector<cv::Point2f>> bspline_to_bezier(const std::vector<cv::Point2f>& points, int degree);
+
+/*
+ * Polyline that stays within tolerance pixels of the curve. Every Bezier piece is split into as
+ * many equal steps of t as its flatness needs (Wang's bound on the second differences of the
+ * control points), so a short or nearly straight piece costs a few points and a long, curly one
+ * more. Up to degree 4 the points are produced by forward differencing, n additions per point for
+ * degree n; higher degrees, where the differences would drift, sum the Bernstein basis per point.
+ */
+void flatten(const curve& c, float tolerance, polyline& out);
+polyline flatten(const curve& c, float tolerance = 0.25f);
+
+// flatten for many curves, spread over the hardware threads
+std::vector<polyline> flatten_all(const std::vector<curve>& curves, float tolerance = 0.25f);
+
+/*
+ * Anti-aliased (Xiaolin Wu) lines through the points of every polyline, drawn into an 8 bit, 3
+ * channel image. Pixels keep the brighter of their old color and the line's. The image is split
+ * into bands of rows drawn by separate threads, so no two threads write the same pixel.
+ */
+void draw_polylines(const std::vector<polyline>& lines, cv::Mat& image, const cv::Vec3b& color);
+
+#endif //BEZIERCURVE_CURVE_H
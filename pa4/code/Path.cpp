@@ -0,0 +1,282 @@
+//
+// Filled vector paths: closed contours of lines and Bezier segments, rasterized by area coverage.
+//
+
+#include "Path.hpp"
+#include <algorithm>
+#include <cmath>
+
+void path::move_to(cv::Point2f p)
+{
+    contours.emplace_back();
+    start = current = p;
+    open = true;
+}
+
+void path::segment_to(std::vector<cv::Point2f> points)
+{
+    // A segment after close() or before any move_to starts a contour of its own
+    if (!open)
+    {
+        move_to(current);
+    }
+    curve c;
+    c.points = std::move(points);
+    current = c.points.back();
+    contours.back().push_back(std::move(c));
+}
+
+void path::line_to(cv::Point2f p)
+{
+    segment_to({current, p});
+}
+
+void path::quad_to(cv::Point2f control, cv::Point2f p)
+{
+    segment_to({current, control, p});
+}
+
+void path::cubic_to(cv::Point2f control1, cv::Point2f control2, cv::Point2f p)
+{
+    segment_to({current, control1, control2, p});
+}
+
+void path::close()
+{
+    current = start;
+    open = false;
+}
+
+std::vector<polyline> path::flatten(float tolerance) const
+{
+    std::vector<polyline> lines;
+    polyline piece;
+    for (auto& contour : contours)
+    {
+        if (contour.empty())
+        {
+            continue;
+        }
+        polyline line;
+        for (auto& segment : contour)
+        {
+            ::flatten(segment, tolerance, piece);
+            line.insert(line.end(), line.empty() ? piece.begin() : piece.begin() + 1, piece.end());
+        }
+        lines.push_back(std::move(line));
+    }
+    return lines;
+}
+
+namespace
+{
+    struct edge
+    {
+        cv::Point2f a, b;
+    };
+}
+
+// Pieces of the edge a-b on either side of x = 0 and x = width, each pressed onto [0, width].
+// Left of the box a piece becomes a vertical edge on its border, which winds the pixels to its
+// right the same; right of the box its area falls into the padding cells past the last column.
+static void clip_edge(cv::Point2f a, cv::Point2f b, float width, std::vector<edge>& out)
+{
+    if (a.y == b.y)
+    {
+        return;
+    }
+    float cuts[2];
+    int num_cuts = 0;
+    for (float border : {0.0f, width})
+    {
+        if ((a.x - border) * (b.x - border) < 0)
+        {
+            cuts[num_cuts++] = (border - a.x) / (b.x - a.x);
+        }
+    }
+    if (num_cuts == 2 && cuts[0] > cuts[1])
+    {
+        std::swap(cuts[0], cuts[1]);
+    }
+
+    auto clamp_x = [&](cv::Point2f p) { return cv::Point2f(std::min(std::max(p.x, 0.0f), width), p.y); };
+    cv::Point2f from = a;
+    for (int i = 0; i < num_cuts; ++i)
+    {
+        cv::Point2f to = a + (b - a) * cuts[i];
+        out.push_back({clamp_x(from), clamp_x(to)});
+        from = to;
+    }
+    out.push_back({clamp_x(from), clamp_x(b)});
+}
+
+// Adds the signed area of one edge to rows [row_lo, row_hi) of a band. Row y of the band is
+// acc + (y - row_lo) * stride and the edge's x stays within [0, stride - 2].
+static void accumulate_edge(const edge& e, float* acc, int stride, int row_lo, int row_hi)
+{
+    cv::Point2f p0 = e.a, p1 = e.b;
+    float dir = 1;
+    if (p0.y > p1.y)
+    {
+        std::swap(p0, p1);
+        dir = -1;
+    }
+    float dxdy = (p1.x - p0.x) / (p1.y - p0.y);
+    int y_first = std::max(row_lo, int(std::floor(p0.y)));
+    int y_end = std::min(row_hi, int(std::ceil(p1.y)));
+
+    for (int y = y_first; y < y_end; ++y)
+    {
+        float top = std::max(float(y), p0.y);
+        float bottom = std::min(float(y + 1), p1.y);
+        if (bottom <= top)
+        {
+            continue;
+        }
+        // Evaluated per row rather than stepped, so a band does not depend on where it starts
+        float xa = p0.x + (top - p0.y) * dxdy;
+        float xb = p0.x + (bottom - p0.y) * dxdy;
+        float d = (bottom - top) * dir;
+        float* row = acc + (y - row_lo) * stride;
+
+        float x0 = std::min(xa, xb), x1 = std::max(xa, xb);
+        int x0i = int(std::floor(x0));
+        int x1i = int(std::ceil(x1));
+        if (x1i <= x0i + 1)
+        {
+            // Within one column: the part of it right of the edge, the rest to the next column
+            float mid = 0.5f * (xa + xb) - float(x0i);
+            row[x0i] += d - d * mid;
+            row[x0i + 1] += d * mid;
+            continue;
+        }
+
+        // Across several columns: triangle in the first, trapezoids of slope s in between,
+        // triangle in the last, whatever is left of d one column after
+        float s = 1.0f / (x1 - x0);
+        float x0f = x0 - float(x0i);
+        float a0 = 0.5f * s * (1 - x0f) * (1 - x0f);
+        float x1f = x1 - float(x1i) + 1;
+        float am = 0.5f * s * x1f * x1f;
+        row[x0i] += d * a0;
+        if (x1i == x0i + 2)
+        {
+            row[x0i + 1] += d * (1 - a0 - am);
+        }
+        else
+        {
+            float a1 = s * (1.5f - x0f);
+            row[x0i + 1] += d * (a1 - a0);
+            for (int x = x0i + 2; x < x1i - 1; ++x)
+            {
+                row[x] += d * s;
+            }
+            float a2 = a1 + float(x1i - x0i - 3) * s;
+            row[x1i - 1] += d * (1 - a2 - am);
+        }
+        row[x1i] += d * am;
+    }
+}
+
+void fill_polygons(const std::vector<polyline>& contours, FillRule rule, cv::Mat& image, const cv::Vec3b& color)
+{
+    CV_Assert(image.type() == CV_8UC3);
+
+    // Bounding box of the shape, cut to the image
+    float x_min = 1e30f, y_min = 1e30f, x_max = -1e30f, y_max = -1e30f;
+    for (auto& contour : contours)
+    {
+        for (auto& p : contour)
+        {
+            x_min = std::min(x_min, p.x);
+            x_max = std::max(x_max, p.x);
+            y_min = std::min(y_min, p.y);
+            y_max = std::max(y_max, p.y);
+        }
+    }
+    int left = std::max(0, int(std::floor(x_min)));
+    int right = std::min(image.cols, int(std::ceil(x_max)));
+    int top = std::max(0, int(std::floor(y_min)));
+    int bottom = std::min(image.rows, int(std::ceil(y_max)));
+    if (left >= right || top >= bottom)
+    {
+        return;
+    }
+    const int width = right - left;
+    const int height = bottom - top;
+    const int stride = width + 2;
+
+    // Edges in box coordinates, every contour closed back to its first point
+    std::vector<edge> edges;
+    const cv::Point2f origin{float(left), float(top)};
+    for (auto& contour : contours)
+    {
+        for (size_t i = 0; i < contour.size() && contour.size() > 2; ++i)
+        {
+            const cv::Point2f& a = contour[i];
+            const cv::Point2f& b = contour[(i + 1) % contour.size()];
+            clip_edge(a - origin, b - origin, float(width), edges);
+        }
+    }
+
+    const bool even_odd = rule == FillRule::EvenOdd;
+    const float c[3] = {float(color[0]), float(color[1]), float(color[2])};
+    size_t num_bands = std::min(max_workers(), std::max<size_t>(1, size_t(height) / 32));
+
+    parallel_for(num_bands, 1, [&](size_t first_band, size_t last_band) {
+        std::vector<float> acc;
+        for (size_t band = first_band; band < last_band; ++band)
+        {
+            int row_lo = int(band * height / num_bands);
+            int row_hi = int((band + 1) * height / num_bands);
+            acc.assign(size_t(row_hi - row_lo) * stride, 0.0f);
+
+            for (auto& e : edges)
+            {
+                if (std::max(e.a.y, e.b.y) <= float(row_lo) || std::min(e.a.y, e.b.y) >= float(row_hi))
+                    continue;
+                accumulate_edge(e, acc.data(), stride, row_lo, row_hi);
+            }
+
+            for (int y = row_lo; y < row_hi; ++y)
+            {
+                float* row = acc.data() + (y - row_lo) * stride;
+
+                // Winding number at every pixel: the running sum of the row
+                float winding = 0;
+                for (int x = 0; x < width; ++x)
+                {
+                    winding += row[x];
+                    row[x] = winding;
+                }
+
+                // Coverage, then color over the pixels by it; no branches, so both vectorize
+                if (even_odd)
+                {
+                    for (int x = 0; x < width; ++x)
+                        row[x] = std::abs(row[x] - 2.0f * std::floor(0.5f * row[x] + 0.5f));
+                }
+                else
+                {
+                    for (int x = 0; x < width; ++x)
+                        row[x] = std::min(std::abs(row[x]), 1.0f);
+                }
+
+                uchar* pixels = image.ptr<uchar>(top + y) + left * 3;
+                for (int x = 0; x < width; ++x)
+                {
+                    for (int k = 0; k < 3; ++k)
+                    {
+                        float p = float(pixels[x * 3 + k]);
+                        pixels[x * 3 + k] = uchar(p + (c[k] - p) * row[x] + 0.5f);
+                    }
+                }
+            }
+        }
+    });
+}
+
+void fill_path(const path& shape, FillRule rule, cv::Mat& image, const cv::Vec3b& color, float tolerance)
+{
+    fill_polygons(shape.flatten(tolerance), rule, image, color);
+}
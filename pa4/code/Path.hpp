@@ -0,0 +1,59 @@
+//
+// Filled vector paths: closed contours of lines and Bezier segments, rasterized by area coverage.
+//
+
+#ifndef BEZIERCURVE_PATH_H
+#define BEZIERCURVE_PATH_H
+
+#include "Curve.hpp"
+
+enum class FillRule
+{
+    NonZero,  // inside where the contours wind around a point any number of times
+    EvenOdd   // inside where they wind an odd number of times
+};
+
+/*
+ * A shape as a list of contours, each one started by move_to and made of line, quadratic and
+ * cubic segments from the current point. Contours are closed implicitly when filled; close()
+ * only moves the current point back to the start of the contour.
+ */
+class path
+{
+public:
+    void move_to(cv::Point2f p);
+    void line_to(cv::Point2f p);
+    void quad_to(cv::Point2f control, cv::Point2f p);
+    void cubic_to(cv::Point2f control1, cv::Point2f control2, cv::Point2f p);
+    void close();
+
+    bool empty() const { return contours.empty(); }
+
+    // Every contour as a polyline within tolerance pixels of it
+    std::vector<polyline> flatten(float tolerance = 0.25f) const;
+
+private:
+    void segment_to(std::vector<cv::Point2f> points);
+
+    std::vector<std::vector<curve>> contours;
+    cv::Point2f start{0, 0};
+    cv::Point2f current{0, 0};
+    bool open = false;
+};
+
+/*
+ * Fills the closed polygons into an 8 bit, 3 channel image, blending color over the pixels by
+ * the fraction of their area the shape covers (exact for polygons, no supersampling).
+ *
+ * Every edge adds its signed area to the cells it crosses and the rest of its height to the cell
+ * after them, into a float accumulation buffer that spans the shape's bounding box. A running sum
+ * along each row then gives the winding number at every pixel center, fractional at the edges,
+ * which the fill rule turns into coverage. The sum and the blend are straight loops over
+ * contiguous floats that the compiler vectorizes. Bands of rows are accumulated and blended by
+ * separate threads.
+ */
+void fill_polygons(const std::vector<polyline>& contours, FillRule rule, cv::Mat& image, const cv::Vec3b& color);
+
+void fill_path(const path& shape, FillRule rule, cv::Mat& image, const cv::Vec3b& color, float tolerance = 0.25f);
+
+#endif //BEZIERCURVE_PATH_H
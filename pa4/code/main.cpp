@@ -1,7 +1,14 @@
+#include <atomic>
 #include <chrono>
+#include <fstream>
 #include <iostream>
+#include <mutex>
+#include <thread>
 #include <opencv2/opencv.hpp>
 
+#include "BatchJob.hpp"
+#include "Curve.hpp"
+
 
 std::vector<cv::Point2f> control_points;
 
@@ -57,31 +64,135 @@ void naive_bezier(const std::vector<cv::Point2f> &points, cv::Mat &window)
     }
 }
 
-cv::Point2f recursive_bezier(const std::vector<cv::Point2f> &control_points, float t)
+void bezier(const std::vector<cv::Point2f> &control_points, cv::Mat &window)
+{
+    curve c;
+    c.points = control_points;
+    draw_polylines({flatten(c)}, window, cv::Vec3b(0, 255, 0));
+}
+
+
+static void write_image(const cv::Mat& image, const std::string& path)
 {
-    std::vector<cv::Point2f> tmp_control_points;
-    tmp_control_points.assign(control_points.begin(), control_points.end());
-    for (auto j=tmp_control_points.size(); j > 0; j--) {
-        for (auto i = 0; i < j-1; i++){
-            tmp_control_points[i] = tmp_control_points[i]*t + tmp_control_points[i+1]*(1-t);
+    bool raw = path.size() >= 4 && path.compare(path.size() - 4, 4, ".raw") == 0;
+    if (raw)
+    {
+        std::ofstream out(path, std::ios::binary);
+        for (int y = 0; y < image.rows && out; ++y)
+        {
+            out.write(reinterpret_cast<const char*>(image.ptr<uchar>(y)), std::streamsize(image.cols) * 3);
+        }
+        if (!out)
+        {
+            throw std::runtime_error("cannot write " + path);
         }
     }
-    return tmp_control_points[0];
+    else if (!cv::imwrite(path, image))
+    {
+        throw std::runtime_error("cannot write " + path);
+    }
+}
 
+// Draws the curves of one image in order. Consecutive curves of one color are flattened and drawn
+// as a single batch.
+static void render_curves(const curve_job& job, cv::Mat& image)
+{
+    std::vector<curve> batch;
+    for (size_t i = 0; i < job.items.size(); ++i)
+    {
+        const curve_item& item = job.items[i];
+        if (item.fill)
+        {
+            fill_polygons({flatten(item.shape, job.tolerance)}, item.rule, image, item.color);
+            continue;
+        }
+        batch.push_back(item.shape);
+        const bool last = i + 1 == job.items.size() || job.items[i + 1].fill || job.items[i + 1].color != item.color;
+        if (last)
+        {
+            draw_polylines(flatten_all(batch, job.tolerance), image, item.color);
+            batch.clear();
+        }
+    }
 }
 
-void bezier(const std::vector<cv::Point2f> &control_points, cv::Mat &window)
+// Renders the images of a script without a window. Images are spread over workers; the threads
+// of the script are split between them, and each image's curves are flattened and drawn with its
+// share.
+int render_batch(const std::string& script_path)
 {
+    curve_script script = load_curve_script(script_path);
+    auto start = std::chrono::steady_clock::now();
+
+    int num_threads = script.threads > 0 ? script.threads : int(std::max(1u, std::thread::hardware_concurrency()));
+    int num_workers = std::min(num_threads, std::max(1, int(script.jobs.size())));
+    set_max_workers(size_t(std::max(1, num_threads / num_workers)));
+
+    std::atomic<size_t> next_job{0};
+    std::atomic<int> failures{0};
+    std::atomic<size_t> num_curves{0};
+    std::mutex output_mutex;
+    auto worker = [&]() {
+        for (size_t i = next_job++; i < script.jobs.size(); i = next_job++)
+        {
+            const curve_job& job = script.jobs[i];
+            auto job_start = std::chrono::steady_clock::now();
+            try
+            {
+                const cv::Vec3b& b = job.background;
+                cv::Mat image(job.height, job.width, CV_8UC3, cv::Scalar(b[0], b[1], b[2]));
+                render_curves(job, image);
+                write_image(image, job.output);
+                num_curves += job.items.size();
+
+                double ms = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - job_start).count();
+                std::lock_guard<std::mutex> lock(output_mutex);
+                std::cout << "[" << i + 1 << "/" << script.jobs.size() << "] " << job.output << ": "
+                          << job.items.size() << " curves (" << ms << " ms)\n";
+            }
+            catch (const std::exception& e)
+            {
+                failures++;
+                std::lock_guard<std::mutex> lock(output_mutex);
+                std::cerr << "image at line " << job.line << " failed: " << e.what() << '\n';
+            }
+        }
+    };
 
-    for (double t = 0.0; t <= 1.0; t += 0.001) {
-        auto point = recursive_bezier(control_points, t);
-        draw_dot(point, window, cv::Vec3b(0, 255, 0), true);
+    std::vector<std::thread> workers;
+    for (int i = 1; i < num_workers; ++i)
+    {
+        workers.emplace_back(worker);
     }
-}
+    worker();
+    for (auto& w : workers)
+    {
+        w.join();
+    }
+    set_max_workers(0);
 
+    double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+    std::cout << script.jobs.size() - failures << " of " << script.jobs.size() << " images, " << num_curves
+              << " curves rendered with " << num_threads << " threads in " << seconds << " s\n";
+    return failures ? 1 : 0;
+}
 
-int main() 
+int main(int argc, const char** argv)
 {
+    // BezierCurve --batch <job script> renders the images of the script without a window
+    if (argc == 3 && std::string(argv[1]) == "--batch")
+    {
+        try
+        {
+            return render_batch(argv[2]);
+        }
+        catch (const std::exception& e)
+        {
+            std::cerr << e.what() << '\n';
+            return 1;
+        }
+    }
+
     cv::Mat window = cv::Mat(700, 700, CV_8UC3, cv::Scalar(0));
     cv::cvtColor(window, window, cv::COLOR_BGR2RGB);
     cv::namedWindow("Bezier Curve", cv::WINDOW_AUTOSIZE);
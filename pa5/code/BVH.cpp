@@ -0,0 +1,138 @@
+#include <algorithm>
+#include <numeric>
+#include "BVH.hpp"
+
+constexpr int nBuckets = 12;
+// Past this depth nodes are split at the median count, which bounds the depth of any tree
+constexpr int maxSAHDepth = 32;
+
+struct BucketInfo
+{
+    int count = 0;
+    Bounds3 bounds;
+};
+
+BVH::BVH(const std::vector<Bounds3>& primBounds, int maxPrims)
+    : maxPrimsInNode(std::max(1, std::min(255, maxPrims)))
+{
+    if (primBounds.empty())
+        return;
+
+    primIndices.resize(primBounds.size());
+    std::iota(primIndices.begin(), primIndices.end(), 0u);
+    std::vector<Vector3f> centroids(primBounds.size());
+    for (size_t i = 0; i < primBounds.size(); ++i)
+        centroids[i] = primBounds[i].Centroid();
+
+    nodes.reserve(2 * primBounds.size());
+    build(primBounds, centroids, 0, uint32_t(primBounds.size()), 0);
+}
+
+void BVH::build(const std::vector<Bounds3>& primBounds, const std::vector<Vector3f>& centroids, uint32_t first,
+                uint32_t last, int depth)
+{
+    uint32_t index = uint32_t(nodes.size());
+    nodes.emplace_back();
+
+    Bounds3 bounds, centroidBounds;
+    for (uint32_t i = first; i < last; ++i)
+    {
+        bounds = Union(bounds, primBounds[primIndices[i]]);
+        centroidBounds = Union(centroidBounds, centroids[primIndices[i]]);
+    }
+    nodes[index].bounds = bounds;
+
+    uint32_t count = last - first;
+    auto makeLeaf = [&]() {
+        nodes[index].offset = first;
+        nodes[index].count = uint16_t(count);
+    };
+    if (count == 1)
+    {
+        makeLeaf();
+        return;
+    }
+
+    int dim = centroidBounds.maxExtent();
+    float lo = centroidBounds.pMin[dim], extent = centroidBounds.pMax[dim] - lo;
+    uint32_t mid = first + count / 2;
+    bool splitBySAH = false;
+
+    if (extent <= 0)
+    {
+        // Every centroid in one place, no split separates them
+        if (int(count) <= maxPrimsInNode)
+        {
+            makeLeaf();
+            return;
+        }
+    }
+    else if (depth < maxSAHDepth)
+    {
+        auto bucketOf = [&](uint32_t prim) {
+            int b = int(nBuckets * (centroids[prim][dim] - lo) / extent);
+            return std::min(b, nBuckets - 1);
+        };
+        BucketInfo buckets[nBuckets];
+        for (uint32_t i = first; i < last; ++i)
+        {
+            BucketInfo& b = buckets[bucketOf(primIndices[i])];
+            b.count++;
+            b.bounds = Union(b.bounds, primBounds[primIndices[i]]);
+        }
+
+        // Cost of every split between buckets from prefix and suffix sweeps
+        float costBelow[nBuckets - 1];
+        Bounds3 b0;
+        int count0 = 0;
+        for (int i = 0; i < nBuckets - 1; ++i)
+        {
+            b0 = Union(b0, buckets[i].bounds);
+            count0 += buckets[i].count;
+            costBelow[i] = count0 > 0 ? count0 * b0.SurfaceArea() : 0;
+        }
+        float minCost = kInfinity;
+        int minCostSplit = -1;
+        Bounds3 b1;
+        int count1 = 0;
+        for (int i = nBuckets - 1; i > 0; --i)
+        {
+            b1 = Union(b1, buckets[i].bounds);
+            count1 += buckets[i].count;
+            float cost = costBelow[i - 1] + (count1 > 0 ? count1 * b1.SurfaceArea() : 0);
+            if (cost < minCost)
+            {
+                minCost = cost;
+                minCostSplit = i - 1;
+            }
+        }
+        // Relative to testing every primitive; a box test costs about an eighth of one
+        float area = bounds.SurfaceArea();
+        minCost = 0.125f + (area > 0 ? minCost / area : 0);
+
+        if (int(count) <= maxPrimsInNode && minCost >= float(count))
+        {
+            makeLeaf();
+            return;
+        }
+        uint32_t* split = std::partition(&primIndices[first], &primIndices[first] + count,
+                                         [&](uint32_t prim) { return bucketOf(prim) <= minCostSplit; });
+        uint32_t candidate = uint32_t(split - primIndices.data());
+        if (candidate != first && candidate != last)
+        {
+            mid = candidate;
+            splitBySAH = true;
+        }
+    }
+
+    if (!splitBySAH)
+    {
+        std::nth_element(&primIndices[first], &primIndices[mid], &primIndices[first] + count,
+                         [&](uint32_t a, uint32_t b) { return centroids[a][dim] < centroids[b][dim]; });
+    }
+
+    build(primBounds, centroids, first, mid, depth + 1);
+    nodes[index].offset = uint32_t(nodes.size());
+    nodes[index].axis = uint8_t(dim);
+    build(primBounds, centroids, mid, last, depth + 1);
+}
@@ -0,0 +1,136 @@
+#pragma once
+
+#include "Bounds3.hpp"
+#include <cstdint>
+#include <vector>
+
+// [comment]
+// Bounding volume hierarchy over primitives that it knows only by their index and bounds, so the
+// same structure serves the objects of a scene and the triangles of a mesh.
+//
+// Nodes are stored in one array in depth-first order: an interior node is followed by its left
+// child and records where its right child is, and a leaf records a range of the primitive
+// indices, which the build reorders so every leaf's primitives are contiguous. Splits minimize
+// the surface area heuristic over binned centroids.
+// [/comment]
+class BVH
+{
+public:
+    BVH() = default;
+    explicit BVH(const std::vector<Bounds3>& primBounds, int maxPrimsInNode = 4);
+
+    bool empty() const { return nodes.empty(); }
+    size_t primitiveCount() const { return primIndices.size(); }
+    Bounds3 WorldBound() const { return nodes.empty() ? Bounds3() : nodes[0].bounds; }
+
+    // [comment]
+    // Visits the primitives whose boxes the ray enters before tNear, the nearer child of every
+    // node first. hit(index, tNear) tests one primitive; when it finds a closer hit it shortens
+    // tNear, which prunes the rest of the walk, and returns true. Returns whether any call did.
+    // [/comment]
+    template <typename Hit>
+    bool intersect(const Vector3f& orig, const Vector3f& dir, float& tNear, Hit&& hit) const
+    {
+        return walk<false>(orig, dir, tNear, [&](uint32_t first, uint32_t count, float& t) {
+            bool found = false;
+            for (uint32_t i = first; i < first + count; ++i)
+                found |= hit(primIndices[i], t);
+            return found;
+        });
+    }
+
+    // [comment]
+    // Occlusion only: whether any primitive blocks the ray before tMax. hit(index, tMax) returns
+    // true for a blocker and the walk stops right there, in whatever order it got there.
+    // [/comment]
+    template <typename Hit>
+    bool intersectP(const Vector3f& orig, const Vector3f& dir, float tMax, Hit&& hit) const
+    {
+        return walk<true>(orig, dir, tMax, [&](uint32_t first, uint32_t count, float t) {
+            for (uint32_t i = first; i < first + count; ++i)
+                if (hit(primIndices[i], t))
+                    return true;
+            return false;
+        });
+    }
+
+    // [comment]
+    // The same walks handing over a whole leaf at a time: hit(first, count, tNear) tests the
+    // primitives order()[first] to order()[first + count - 1]. A primitive that keeps its data in
+    // arrays permuted by order() can then test a leaf as one contiguous block.
+    // [/comment]
+    template <typename LeafHit>
+    bool intersectLeaves(const Vector3f& orig, const Vector3f& dir, float& tNear, LeafHit&& hit) const
+    {
+        return walk<false>(orig, dir, tNear, hit);
+    }
+
+    template <typename LeafHit>
+    bool intersectLeavesP(const Vector3f& orig, const Vector3f& dir, float tMax, LeafHit&& hit) const
+    {
+        return walk<true>(orig, dir, tMax, hit);
+    }
+
+    // Primitive indices in leaf order
+    const std::vector<uint32_t>& order() const { return primIndices; }
+
+private:
+    struct Node
+    {
+        Bounds3 bounds;
+        uint32_t offset = 0;    // leaf: its first entry in primIndices; interior: its right child
+        uint16_t count = 0;     // primitives of a leaf, 0 for an interior node
+        uint8_t axis = 0;       // split axis of an interior node
+    };
+
+    template <bool anyHit, typename LeafHit>
+    bool walk(const Vector3f& orig, const Vector3f& dir, float& tNear, LeafHit&& hit) const;
+
+    void build(const std::vector<Bounds3>& primBounds, const std::vector<Vector3f>& centroids, uint32_t first,
+               uint32_t last, int depth);
+
+    std::vector<Node> nodes;
+    std::vector<uint32_t> primIndices;
+    int maxPrimsInNode = 4;
+};
+
+template <bool anyHit, typename LeafHit>
+bool BVH::walk(const Vector3f& orig, const Vector3f& dir, float& tNear, LeafHit&& hit) const
+{
+    if (nodes.empty())
+        return false;
+
+    const Vector3f invDir(1 / dir.x, 1 / dir.y, 1 / dir.z);
+    const bool dirIsNeg[3] = {dir.x < 0, dir.y < 0, dir.z < 0};
+    bool found = false;
+
+    // The build keeps the depth within 64: at most 32 levels of SAH splits, then median splits
+    uint32_t stack[64];
+    int top = 0;
+    uint32_t current = 0;
+    while (true)
+    {
+        const Node& node = nodes[current];
+        if (node.bounds.IntersectP(orig, invDir, tNear))
+        {
+            if (node.count == 0)
+            {
+                uint32_t left = current + 1, right = node.offset;
+                bool rightFirst = dirIsNeg[node.axis];
+                stack[top++] = rightFirst ? left : right;
+                current = rightFirst ? right : left;
+                continue;
+            }
+            if (hit(node.offset, uint32_t(node.count), tNear))
+            {
+                if (anyHit)
+                    return true;
+                found = true;
+            }
+        }
+        if (top == 0)
+            break;
+        current = stack[--top];
+    }
+    return found;
+}
@@ -0,0 +1,84 @@
+#pragma once
+
+#include "Vector.hpp"
+#include "global.hpp"
+#include <limits>
+
+// Axis-aligned bounding box; a default constructed one is empty and grows by Union
+class Bounds3
+{
+public:
+    Vector3f pMin, pMax;
+
+    Bounds3()
+        : pMin(kInfinity)
+        , pMax(-kInfinity)
+    {}
+    explicit Bounds3(const Vector3f& p)
+        : pMin(p)
+        , pMax(p)
+    {}
+    Bounds3(const Vector3f& p1, const Vector3f& p2)
+        : pMin(Vector3f::Min(p1, p2))
+        , pMax(Vector3f::Max(p1, p2))
+    {}
+
+    Vector3f Diagonal() const { return pMax - pMin; }
+
+    int maxExtent() const
+    {
+        Vector3f d = Diagonal();
+        if (d.x > d.y && d.x > d.z)
+            return 0;
+        else if (d.y > d.z)
+            return 1;
+        else
+            return 2;
+    }
+
+    float SurfaceArea() const
+    {
+        Vector3f d = Diagonal();
+        return 2 * (d.x * d.y + d.x * d.z + d.y * d.z);
+    }
+
+    Vector3f Centroid() const { return 0.5f * pMin + 0.5f * pMax; }
+
+    // Whether the ray orig + t * dir enters the box for some t in [0, tMax]; invDir is 1 / dir.
+    // Written so that the NaN of a ray parallel to a slab and starting on its plane is ignored.
+    // Exit distances are pushed out by the rounding bound of their computation, so a ray grazing
+    // the box is never rejected when the exact test would accept it (a triangle on the border).
+    bool IntersectP(const Vector3f& orig, const Vector3f& invDir, float tMax) const
+    {
+        float tEnter = 0, tExit = tMax;
+        for (int i = 0; i < 3; ++i)
+        {
+            float t0 = (pMin[i] - orig[i]) * invDir[i];
+            float t1 = (pMax[i] - orig[i]) * invDir[i];
+            if (t0 > t1)
+                std::swap(t0, t1);
+            t1 *= 1 + 2 * 3 * std::numeric_limits<float>::epsilon();
+            tEnter = t0 > tEnter ? t0 : tEnter;
+            tExit = t1 < tExit ? t1 : tExit;
+            if (tEnter > tExit)
+                return false;
+        }
+        return true;
+    }
+};
+
+inline Bounds3 Union(const Bounds3& b1, const Bounds3& b2)
+{
+    Bounds3 ret;
+    ret.pMin = Vector3f::Min(b1.pMin, b2.pMin);
+    ret.pMax = Vector3f::Max(b1.pMax, b2.pMax);
+    return ret;
+}
+
+inline Bounds3 Union(const Bounds3& b, const Vector3f& p)
+{
+    Bounds3 ret;
+    ret.pMin = Vector3f::Min(b.pMin, p);
+    ret.pMax = Vector3f::Max(b.pMax, p);
+    return ret;
+}
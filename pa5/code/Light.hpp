@@ -1,6 +1,7 @@
 #pragma once
 
 #include "Vector.hpp"
+#include <limits>
 
 class Light
 {
@@ -12,4 +13,6 @@ public:
     virtual ~Light() = default;
     Vector3f position;
     Vector3f intensity;
+    // Points farther away than this are not lit by the light at all
+    float range = std::numeric_limits<float>::max();
 };
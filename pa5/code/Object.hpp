@@ -1,5 +1,6 @@
 #pragma once
 
+#include "Bounds3.hpp"
 #include "Vector.hpp"
 #include "global.hpp"
 
@@ -19,9 +20,23 @@ public:
 
     virtual bool intersect(const Vector3f&, const Vector3f&, float&, uint32_t&, Vector2f&) const = 0;
 
+    // [comment]
+    // Whether the object blocks the ray before tMax. Defaults to the closest hit; objects with
+    // many parts override it to stop at the first one.
+    // [/comment]
+    virtual bool intersectP(const Vector3f& orig, const Vector3f& dir, float tMax) const
+    {
+        float t = tMax;
+        uint32_t index = 0;
+        Vector2f uv;
+        return intersect(orig, dir, t, index, uv) && t < tMax;
+    }
+
     virtual void getSurfaceProperties(const Vector3f&, const Vector3f&, const uint32_t&, const Vector2f&, Vector3f&,
                                       Vector2f&) const = 0;
 
+    virtual Bounds3 getBounds() const = 0;
+
     virtual Vector3f evalDiffuseColor(const Vector2f&) const
     {
         return diffuseColor;
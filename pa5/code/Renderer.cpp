@@ -1,5 +1,10 @@
+#include <atomic>
 #include <fstream>
+#include <mutex>
+#include <stdexcept>
+#include <thread>
 #include "Vector.hpp"
+#include "ImageWriter.hpp"
 #include "Renderer.hpp"
 #include "Scene.hpp"
 #include <optional>
@@ -73,7 +78,7 @@ float fresnel(const Vector3f &I, const Vector3f &N, const float &ior)
 //
 // \param orig is the ray origin
 // \param dir is the ray direction
-// \param objects is the list of objects the scene contains
+// \param scene holds the objects, searched through its BVH
 // \param[out] tNear contains the distance to the cloesest intersected object.
 // \param[out] index stores the index of the intersect triangle if the interesected object is a mesh.
 // \param[out] uv stores the u and v barycentric coordinates of the intersected point
@@ -82,29 +87,52 @@ float fresnel(const Vector3f &I, const Vector3f &N, const float &ior)
 // [/comment]
 std::optional<hit_payload> trace(
         const Vector3f &orig, const Vector3f &dir,
-        const std::vector<std::unique_ptr<Object> > &objects)
+        const Scene &scene)
 {
+    const auto& objects = scene.get_objects();
     float tNear = kInfinity;
     std::optional<hit_payload> payload;
-    for (const auto & object : objects)
-    {
-        float tNearK = kInfinity;
-        uint32_t indexK;
+    scene.get_bvh().intersect(orig, dir, tNear, [&](uint32_t k, float& tClosest) {
+        // Starting from the closest hit so far lets a mesh skip whatever lies behind it
+        float tNearK = tClosest;
+        uint32_t indexK = 0;
         Vector2f uvK;
-        if (object->intersect(orig, dir, tNearK, indexK, uvK) && tNearK < tNear)
+        if (objects[k]->intersect(orig, dir, tNearK, indexK, uvK) && tNearK < tClosest)
         {
             payload.emplace();
-            payload->hit_obj = object.get();
+            payload->hit_obj = objects[k].get();
             payload->tNear = tNearK;
             payload->index = indexK;
             payload->uv = uvK;
-            tNear = tNearK;
+            tClosest = tNearK;
+            return true;
         }
-    }
+        return false;
+    });
 
     return payload;
 }
 
+// [comment]
+// Returns true if an object blocks the ray before tMax. The light's last blocker is tried first,
+// then the scene's BVH, which stops at the first blocker it finds rather than the closest.
+// [/comment]
+bool occluded(const Vector3f &orig, const Vector3f &dir, float tMax, const Scene &scene, const Object *&hint)
+{
+    if (hint && hint->intersectP(orig, dir, tMax))
+        return true;
+
+    const auto& objects = scene.get_objects();
+    const Object* tested = hint;
+    return scene.get_bvh().intersectP(orig, dir, tMax, [&](uint32_t k, float tLimit) {
+        const Object* object = objects[k].get();
+        if (object == tested || !object->intersectP(orig, dir, tLimit))
+            return false;
+        hint = object;
+        return true;
+    });
+}
+
 // [comment]
 // Implementation of the Whitted-style light transport algorithm (E [S*] (D|G) L)
 //
@@ -123,14 +151,14 @@ std::optional<hit_payload> trace(
 // [/comment]
 Vector3f castRay(
         const Vector3f &orig, const Vector3f &dir, const Scene& scene,
-        int depth)
+        int depth, shadow_hints &hints)
 {
     if (depth > scene.maxDepth) {
         return Vector3f(0.0,0.0,0.0);
     }
 
     Vector3f hitColor = scene.backgroundColor;
-    if (auto payload = trace(orig, dir, scene.get_objects()); payload)
+    if (auto payload = trace(orig, dir, scene); payload)
     {
         Vector3f hitPoint = orig + dir * payload->tNear;
         Vector3f N; // normal
@@ -147,8 +175,8 @@ Vector3f castRay(
                 Vector3f refractionRayOrig = (dotProduct(refractionDirection, N) < 0) ?
                                              hitPoint - N * scene.epsilon :
                                              hitPoint + N * scene.epsilon;
-                Vector3f reflectionColor = castRay(reflectionRayOrig, reflectionDirection, scene, depth + 1);
-                Vector3f refractionColor = castRay(refractionRayOrig, refractionDirection, scene, depth + 1);
+                Vector3f reflectionColor = castRay(reflectionRayOrig, reflectionDirection, scene, depth + 1, hints);
+                Vector3f refractionColor = castRay(refractionRayOrig, refractionDirection, scene, depth + 1, hints);
                 float kr = fresnel(dir, N, payload->hit_obj->ior);
                 hitColor = reflectionColor * kr + refractionColor * (1 - kr);
                 break;
@@ -160,7 +188,7 @@ Vector3f castRay(
                 Vector3f reflectionRayOrig = (dotProduct(reflectionDirection, N) < 0) ?
                                              hitPoint + N * scene.epsilon :
                                              hitPoint - N * scene.epsilon;
-                hitColor = castRay(reflectionRayOrig, reflectionDirection, scene, depth + 1) * kr;
+                hitColor = castRay(reflectionRayOrig, reflectionDirection, scene, depth + 1, hints) * kr;
                 break;
             }
             default:
@@ -176,22 +204,35 @@ Vector3f castRay(
                 // [comment]
                 // Loop over all lights in the scene and sum their contribution up
                 // We also apply the lambert cosine law
+                //
+                // Lights out of range or below the scene's threshold are skipped, and so is the
+                // shadow ray of a light that would add nothing here, lit or not. A shadowed light
+                // adds neither diffuse nor specular light.
                 // [/comment]
-                for (auto& light : scene.get_lights()) {
-                    Vector3f lightDir = light->position - hitPoint;
+                const auto& lights = scene.get_lights();
+                hints.blocker.resize(lights.size(), nullptr);
+                for (size_t l = 0; l < lights.size(); ++l) {
+                    const Light& light = *lights[l];
+                    if (std::max(light.intensity.x, std::max(light.intensity.y, light.intensity.z)) < scene.lightThreshold)
+                        continue;
+                    Vector3f lightDir = light.position - hitPoint;
                     // square of the distance between hitPoint and the light
                     float lightDistance2 = dotProduct(lightDir, lightDir);
+                    if (lightDistance2 > light.range * light.range)
+                        continue;
                     lightDir = normalize(lightDir);
                     float LdotN = std::max(0.f, dotProduct(lightDir, N));
-                    // is the point in shadow, and is the nearest occluding object closer to the object than the light itself?
-                    auto shadow_res = trace(shadowPointOrig, lightDir, scene.get_objects());
-                    bool inShadow = shadow_res && (shadow_res->tNear * shadow_res->tNear < lightDistance2);
-
-                    lightAmt += inShadow ? 0 : light->intensity * LdotN;
                     Vector3f reflectionDirection = reflect(-lightDir, N);
+                    float specular = std::max(0.f, -dotProduct(reflectionDirection, dir));
+                    if (LdotN <= 0 && specular <= 0)
+                        continue;
 
-                    specularColor += powf(std::max(0.f, -dotProduct(reflectionDirection, dir)),
-                        payload->hit_obj->specularExponent) * light->intensity;
+                    // is an object between the point and the light?
+                    if (occluded(shadowPointOrig, lightDir, std::sqrt(lightDistance2), scene, hints.blocker[l]))
+                        continue;
+
+                    lightAmt += light.intensity * LdotN;
+                    specularColor += powf(specular, payload->hit_obj->specularExponent) * light.intensity;
                 }
 
                 hitColor = lightAmt * payload->hit_obj->evalDiffuseColor(st) * payload->hit_obj->Kd + specularColor * payload->hit_obj->Ks;
@@ -207,9 +248,16 @@ Vector3f castRay(
 // The main render function. This where we iterate over all pixels in the image, generate
 // primary rays and cast these rays into the scene. The content of the framebuffer is
 // saved to a file.
+//
+// The image is cut into square tiles that worker threads take from a shared counter, so
+// threads that draw cheap tiles (background) pick up more of them. Every pixel is computed
+// the same way whichever thread draws it, so the image does not depend on the thread count.
 // [/comment]
 void Renderer::Render(const Scene& scene)
 {
+    if (scene.get_bvh().primitiveCount() != scene.get_objects().size())
+        throw std::logic_error("Scene::buildBVH() must be called after the last object is added");
+
     std::vector<Vector3f> framebuffer(scene.width * scene.height);
 
     float scale = std::tan(deg2rad(scene.fov * 0.5f));
@@ -217,36 +265,61 @@ void Renderer::Render(const Scene& scene)
 
     // Use this variable as the eye position to start your rays.
     Vector3f eye_pos(0);
-    int m = 0;
-    for (int j = 0; j < scene.height; ++j)
-    {
-        for (int i = 0; i < scene.width; ++i)
+
+    const int tilesX = (scene.width + tileSize - 1) / tileSize;
+    const int tilesY = (scene.height + tileSize - 1) / tileSize;
+    const int numTiles = tilesX * tilesY;
+    std::atomic<int> nextTile{0}, tilesDone{0};
+    std::mutex progressMutex;
+
+    // Opened first so a bad path fails before the render; it is written as tile rows complete
+    ImageWriter image(output, scene.width, scene.height, framebuffer.data());
+    std::vector<std::atomic<int>> rowTilesDone(tilesY);
+
+    auto worker = [&]() {
+        shadow_hints hints;
+        for (int tile = nextTile++; tile < numTiles; tile = nextTile++)
         {
-            // generate primary ray direction
-            float x;
-            float y;
-
-            x = float(i)/float(scene.width) - 0.5f;
-            x = 2 * x * scale * imageAspectRatio;
-            y = float(scene.height-j) / float(scene.height) - 0.5f;
-            y = 2 * y * scale;
-
-            Vector3f dir = Vector3f(x, y, -1);
-            dir = normalize(dir);
-            framebuffer[m++] = castRay(eye_pos, dir, scene, 0);
+            int x0 = (tile % tilesX) * tileSize, y0 = (tile / tilesX) * tileSize;
+            int x1 = std::min(x0 + tileSize, scene.width), y1 = std::min(y0 + tileSize, scene.height);
+            for (int j = y0; j < y1; ++j)
+            {
+                for (int i = x0; i < x1; ++i)
+                {
+                    // generate primary ray direction
+                    float x;
+                    float y;
+
+                    x = float(i)/float(scene.width) - 0.5f;
+                    x = 2 * x * scale * imageAspectRatio;
+                    y = float(scene.height-j) / float(scene.height) - 0.5f;
+                    y = 2 * y * scale;
+
+                    Vector3f dir = Vector3f(x, y, -1);
+                    dir = normalize(dir);
+                    framebuffer[j * scene.width + i] = castRay(eye_pos, dir, scene, 0, hints);
+                }
+            }
+            if (++rowTilesDone[tile / tilesX] == tilesX)
+                image.rowsDone(y0, y1);
+            int done = ++tilesDone;
+            // Whoever finishes a tile reports, unless another thread is printing already
+            std::unique_lock<std::mutex> lock(progressMutex, std::try_to_lock);
+            if (lock)
+                UpdateProgress(done / (float)numTiles);
         }
-        UpdateProgress(j / (float)scene.height);
-    }
+    };
 
-    // save framebuffer to file
-    FILE* fp = fopen("binary.ppm", "wb");
-    (void)fprintf(fp, "P6\n%d %d\n255\n", scene.width, scene.height);
-    for (auto i = 0; i < scene.height * scene.width; ++i) {
-        static unsigned char color[3];
-        color[0] = (char)(255 * clamp(0, 1, framebuffer[i].x));
-        color[1] = (char)(255 * clamp(0, 1, framebuffer[i].y));
-        color[2] = (char)(255 * clamp(0, 1, framebuffer[i].z));
-        fwrite(color, 1, 3, fp);
-    }
-    fclose(fp);    
+    int numWorkers = threads > 0 ? threads : int(std::max(1u, std::thread::hardware_concurrency()));
+    numWorkers = std::min(numWorkers, numTiles);
+    std::vector<std::thread> workers;
+    for (int t = 1; t < numWorkers; ++t)
+        workers.emplace_back(worker);
+    worker();
+    for (auto& w : workers)
+        w.join();
+    UpdateProgress(1.f);
+    std::cout << '\n';
+
+    image.finish();
 }
@@ -1,4 +1,5 @@
 #pragma once
+#include <string>
 #include "Scene.hpp"
 
 struct hit_payload
@@ -9,10 +10,21 @@ struct hit_payload
     Object* hit_obj;
 };
 
+// Per render thread: for every light, the object that last blocked a shadow ray to it. Blockers
+// come in runs across neighbouring pixels, so it is tried before the scene's BVH.
+struct shadow_hints
+{
+    std::vector<const Object*> blocker;
+};
+
 class Renderer
 {
 public:
     void Render(const Scene& scene);
 
+    int threads = 0;                // render threads, 0 uses every hardware thread
+    std::string output = "binary.ppm";  // .ppm, .png or .pfm, see ImageWriter
+    static constexpr int tileSize = 16;
+
 private:
 };
\ No newline at end of file
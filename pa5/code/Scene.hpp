@@ -2,6 +2,7 @@
 
 #include <vector>
 #include <memory>
+#include "BVH.hpp"
 #include "Vector.hpp"
 #include "Object.hpp"
 #include "Light.hpp"
@@ -16,6 +17,8 @@ public:
     Vector3f backgroundColor = Vector3f(0.235294, 0.67451, 0.843137);
     int maxDepth = 5;
     float epsilon = 0.00001;
+    // Lights whose brightest channel is below this are skipped
+    float lightThreshold = 0;
 
     Scene(int w, int h) : width(w), height(h)
     {}
@@ -25,9 +28,14 @@ public:
 
     [[nodiscard]] const std::vector<std::unique_ptr<Object> >& get_objects() const { return objects; }
     [[nodiscard]] const std::vector<std::unique_ptr<Light> >&  get_lights() const { return lights; }
+    [[nodiscard]] const BVH& get_bvh() const { return bvh; }
+
+    // Builds the hierarchy over the objects that trace() walks; call it after the last Add
+    void buildBVH();
 
 private:
     // creating the scene (adding objects and lights)
     std::vector<std::unique_ptr<Object> > objects;
     std::vector<std::unique_ptr<Light> > lights;
+    BVH bvh;
 };
\ No newline at end of file
@@ -3,6 +3,36 @@
 #include "Object.hpp"
 #include "Vector.hpp"
 
+// [comment]
+// Ray-sphere intersection in the geometric form of "Precision Improvements for Ray/Sphere
+// Intersection" (Ray Tracing Gems, ch. 7). The discriminant comes from the squared distance between
+// the center and the ray's closest point, not from b * b - 4 * a * c, which cancels catastrophically
+// for small spheres far from the origin. The two roots are formed the stable way, one from q and one
+// from c / q. Returns the nearer root in front of orig, or the farther one when orig is inside.
+// [/comment]
+inline bool raySphereIntersect(const Vector3f& orig, const Vector3f& dir, const Vector3f& center, float radius2,
+                               float& tnear)
+{
+    Vector3f f = orig - center;
+    float a = dotProduct(dir, dir);
+    float b = -dotProduct(f, dir);
+    Vector3f l = f + (b / a) * dir;
+    float discr = radius2 - dotProduct(l, l);
+    if (discr < 0)
+        return false;
+    float c = dotProduct(f, f) - radius2;
+    float q = b + std::copysign(std::sqrt(a * discr), b);
+    float t0 = c / q, t1 = q / a;
+    if (t0 > t1)
+        std::swap(t0, t1);
+    if (t0 < 0)
+        t0 = t1;
+    if (!(t0 >= 0))
+        return false;
+    tnear = t0;
+    return true;
+}
+
 class Sphere : public Object
 {
 public:
@@ -14,21 +44,7 @@ public:
 
     bool intersect(const Vector3f& orig, const Vector3f& dir, float& tnear, uint32_t&, Vector2f&) const override
     {
-        // analytic solution
-        Vector3f L = orig - center;
-        float a = dotProduct(dir, dir);
-        float b = 2 * dotProduct(dir, L);
-        float c = dotProduct(L, L) - radius2;
-        float t0, t1;
-        if (!solveQuadratic(a, b, c, t0, t1))
-            return false;
-        if (t0 < 0)
-            t0 = t1;
-        if (t0 < 0)
-            return false;
-        tnear = t0;
-
-        return true;
+        return raySphereIntersect(orig, dir, center, radius2, tnear);
     }
 
     void getSurfaceProperties(const Vector3f& P, const Vector3f&, const uint32_t&, const Vector2f&,
@@ -37,6 +53,11 @@ public:
         N = normalize(P - center);
     }
 
+    Bounds3 getBounds() const override
+    {
+        return Bounds3(center - Vector3f(radius), center + Vector3f(radius));
+    }
+
     Vector3f center;
     float radius, radius2;
 };
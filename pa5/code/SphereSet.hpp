@@ -0,0 +1,122 @@
+#pragma once
+
+#include "BVH.hpp"
+#include "Sphere.hpp"
+
+#include <vector>
+
+// Spheres tested together, at least the float lanes of the widest vector unit in use
+constexpr int sphereBlock = 8;
+
+// [comment]
+// raySphereIntersect over sphereBlock consecutive spheres kept as separate arrays of center
+// coordinates and squared radii, the layout the compiler can vectorize (with -fno-math-errno, so
+// sqrt needs no branch to set errno). The first loop runs every lane without a branch, a miss or a
+// lane at or past count yielding infinity; the second picks the nearest. Returns the lane of the
+// nearest hit before tMax, or -1.
+// [/comment]
+inline int raySphereBlockIntersect(const Vector3f& orig, const Vector3f& dir, const float* cx, const float* cy,
+                                   const float* cz, const float* radius2, int count, float tMax, float& tnear)
+{
+    float a = dotProduct(dir, dir), invA = 1 / a;
+    float t[sphereBlock];
+    for (int i = 0; i < sphereBlock; ++i)
+    {
+        float fx = orig.x - cx[i], fy = orig.y - cy[i], fz = orig.z - cz[i];
+        float b = -(fx * dir.x + fy * dir.y + fz * dir.z);
+        float lx = fx + b * invA * dir.x, ly = fy + b * invA * dir.y, lz = fz + b * invA * dir.z;
+        float discr = radius2[i] - (lx * lx + ly * ly + lz * lz);
+        float c = fx * fx + fy * fy + fz * fz - radius2[i];
+        float q = b + std::copysign(std::sqrt(std::max(a * discr, 0.0f)), b);
+        float t0 = c / q, t1 = q * invA;
+        float tMin = std::min(t0, t1), tMaxRoot = std::max(t0, t1);
+        float ti = tMin >= 0 ? tMin : tMaxRoot;
+        t[i] = ((discr >= 0) & (ti >= 0) & (i < count)) ? ti : kInfinity;
+    }
+
+    int nearest = -1;
+    for (int i = 0; i < sphereBlock; ++i)
+    {
+        if (t[i] < tMax)
+        {
+            tMax = t[i];
+            nearest = i;
+        }
+    }
+    if (nearest >= 0)
+        tnear = tMax;
+    return nearest;
+}
+
+// [comment]
+// Many spheres sharing one material as a single object, for particle-like scenes where an Object
+// per sphere would cost a virtual call and a heap allocation each. The spheres get their own BVH
+// with up to a block of them per leaf, and their arrays are stored in its leaf order so a leaf is
+// one contiguous block for raySphereBlockIntersect. The index of a hit is that stored position.
+// [/comment]
+class SphereSet : public Object
+{
+public:
+    SphereSet(const std::vector<Vector3f>& centers, const std::vector<float>& radii)
+    {
+        std::vector<Bounds3> sphereBounds(centers.size());
+        for (size_t k = 0; k < centers.size(); ++k)
+            sphereBounds[k] = Bounds3(centers[k] - Vector3f(radii[k]), centers[k] + Vector3f(radii[k]));
+        bvh = BVH(sphereBounds, sphereBlock);
+
+        // A full block can be read from any leaf; the padding never hits
+        size_t padded = centers.size() + sphereBlock;
+        cx.assign(padded, 0);
+        cy.assign(padded, 0);
+        cz.assign(padded, 0);
+        radius2.assign(padded, -1);
+        const std::vector<uint32_t>& order = bvh.order();
+        for (size_t i = 0; i < order.size(); ++i)
+        {
+            const Vector3f& c = centers[order[i]];
+            cx[i] = c.x;
+            cy[i] = c.y;
+            cz[i] = c.z;
+            radius2[i] = radii[order[i]] * radii[order[i]];
+        }
+    }
+
+    // Only hits closer than the tnear passed in count, like a mesh
+    bool intersect(const Vector3f& orig, const Vector3f& dir, float& tnear, uint32_t& index, Vector2f&) const override
+    {
+        return bvh.intersectLeaves(orig, dir, tnear, [&](uint32_t first, uint32_t count, float& tClosest) {
+            int lane = raySphereBlockIntersect(orig, dir, &cx[first], &cy[first], &cz[first], &radius2[first],
+                                               int(count), tClosest, tClosest);
+            if (lane < 0)
+                return false;
+            index = first + uint32_t(lane);
+            return true;
+        });
+    }
+
+    bool intersectP(const Vector3f& orig, const Vector3f& dir, float tMax) const override
+    {
+        return bvh.intersectLeavesP(orig, dir, tMax, [&](uint32_t first, uint32_t count, float tLimit) {
+            float t;
+            return raySphereBlockIntersect(orig, dir, &cx[first], &cy[first], &cz[first], &radius2[first],
+                                           int(count), tLimit, t) >= 0;
+        });
+    }
+
+    void getSurfaceProperties(const Vector3f& P, const Vector3f&, const uint32_t& index, const Vector2f&, Vector3f& N,
+                              Vector2f&) const override
+    {
+        N = normalize(P - Vector3f(cx[index], cy[index], cz[index]));
+    }
+
+    Bounds3 getBounds() const override
+    {
+        return bvh.WorldBound();
+    }
+
+    size_t size() const { return bvh.primitiveCount(); }
+
+private:
+    BVH bvh;
+    std::vector<float> cx, cy, cz, radius2;
+};
@@ -1,5 +1,6 @@
 #pragma once
 
+#include "BVH.hpp"
 #include "Object.hpp"
 
 #include <cstring>
@@ -38,29 +39,42 @@ public:
         numTriangles = numTris;
         stCoordinates = std::unique_ptr<Vector2f[]>(new Vector2f[maxIndex]);
         memcpy(stCoordinates.get(), st, sizeof(Vector2f) * maxIndex);
+
+        std::vector<Bounds3> triangleBounds(numTris);
+        for (uint32_t k = 0; k < numTris; ++k)
+            triangleBounds[k] = Union(Bounds3(vertices[vertexIndex[k * 3]], vertices[vertexIndex[k * 3 + 1]]),
+                                      vertices[vertexIndex[k * 3 + 2]]);
+        bvh = BVH(triangleBounds);
     }
 
+    // Only hits closer than the tnear passed in count, so the triangles' BVH can skip the rest
     bool intersect(const Vector3f& orig, const Vector3f& dir, float& tnear, uint32_t& index,
                    Vector2f& uv) const override
     {
-        bool intersect = false;
-        for (uint32_t k = 0; k < numTriangles; ++k)
-        {
+        return bvh.intersect(orig, dir, tnear, [&](uint32_t k, float& tClosest) {
             const Vector3f& v0 = vertices[vertexIndex[k * 3]];
             const Vector3f& v1 = vertices[vertexIndex[k * 3 + 1]];
             const Vector3f& v2 = vertices[vertexIndex[k * 3 + 2]];
             float t, u, v;
-            if (rayTriangleIntersect(v0, v1, v2, orig, dir, t, u, v) && t < tnear)
+            if (rayTriangleIntersect(v0, v1, v2, orig, dir, t, u, v) && t < tClosest)
             {
-                tnear = t;
+                tClosest = t;
                 uv.x = u;
                 uv.y = v;
                 index = k;
-                intersect |= true;
+                return true;
             }
-        }
+            return false;
+        });
+    }
 
-        return intersect;
+    bool intersectP(const Vector3f& orig, const Vector3f& dir, float tMax) const override
+    {
+        return bvh.intersectP(orig, dir, tMax, [&](uint32_t k, float tLimit) {
+            float t, u, v;
+            return rayTriangleIntersect(vertices[vertexIndex[k * 3]], vertices[vertexIndex[k * 3 + 1]],
+                                        vertices[vertexIndex[k * 3 + 2]], orig, dir, t, u, v) && t < tLimit;
+        });
     }
 
     void getSurfaceProperties(const Vector3f&, const Vector3f&, const uint32_t& index, const Vector2f& uv, Vector3f& N,
@@ -78,6 +92,11 @@ public:
         st = st0 * (1 - uv.x - uv.y) + st1 * uv.x + st2 * uv.y;
     }
 
+    Bounds3 getBounds() const override
+    {
+        return bvh.WorldBound();
+    }
+
     Vector3f evalDiffuseColor(const Vector2f& st) const override
     {
         float scale = 5;
@@ -89,4 +108,5 @@ public:
     uint32_t numTriangles;
     std::unique_ptr<uint32_t[]> vertexIndex;
     std::unique_ptr<Vector2f[]> stCoordinates;
+    BVH bvh;
 };
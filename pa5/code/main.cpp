@@ -1,26 +1,93 @@
 #include "Scene.hpp"
 #include "Sphere.hpp"
+#include "SphereSet.hpp"
 #include "Triangle.hpp"
 #include "Light.hpp"
 #include "Renderer.hpp"
+#include "ImageWriter.hpp"
+
+#include <cstdlib>
+#include <random>
+#include <string>
 
 // In the main function of the program, we create the scene (create objects and lights)
 // as well as set the options for the render (image width and height, maximum recursion
 // depth, field-of-view, etc.). We then call the render function().
-int main()
+//
+// Usage: RayTracing [--particles <n>] [output]
+// The image goes to output, binary.ppm by default. With --particles the two spheres are replaced
+// by a cloud of n small random spheres, all drawn through one SphereSet.
+int main(int argc, char** argv)
 {
+    auto usage = [&] {
+        std::cerr << "usage: " << argv[0] << " [--particles <n>] [output.ppm|.png|.pfm]\n";
+        return 1;
+    };
+
+    int particles = 0;
+    std::string output;
+    for (int i = 1; i < argc; ++i)
+    {
+        std::string arg = argv[i];
+        if (arg == "--particles" && i + 1 < argc)
+        {
+            particles = std::atoi(argv[++i]);
+            if (particles <= 0)
+            {
+                std::cerr << "--particles needs a positive count\n";
+                return 1;
+            }
+        }
+        else if (output.empty() && arg.compare(0, 2, "--") != 0)
+            output = arg;
+        else
+            return usage();
+    }
+    if (!output.empty())
+    {
+        // A mistyped extension is reported before the scene is built, not after
+        try
+        {
+            ImageWriter::formatOf(output);
+        }
+        catch (const std::exception& e)
+        {
+            std::cerr << e.what() << '\n';
+            return usage();
+        }
+    }
+
     Scene scene(1280, 960);
 
-    auto sph1 = std::make_unique<Sphere>(Vector3f(-1, 0, -12), 2);
-    sph1->materialType = DIFFUSE_AND_GLOSSY;
-    sph1->diffuseColor = Vector3f(0.6, 0.7, 0.8);
+    if (particles > 0)
+    {
+        std::mt19937 rng(1);
+        std::uniform_real_distribution<float> x(-5, 5), y(-3, 2), z(-16, -6), radius(0.01f, 0.04f);
+        std::vector<Vector3f> centers(particles);
+        std::vector<float> radii(particles);
+        for (int i = 0; i < particles; ++i)
+        {
+            radii[i] = radius(rng);
+            centers[i] = Vector3f(x(rng), y(rng), z(rng));
+        }
+        auto cloud = std::make_unique<SphereSet>(centers, radii);
+        cloud->materialType = DIFFUSE_AND_GLOSSY;
+        cloud->diffuseColor = Vector3f(0.6, 0.7, 0.8);
+        scene.Add(std::move(cloud));
+    }
+    else
+    {
+        auto sph1 = std::make_unique<Sphere>(Vector3f(-1, 0, -12), 2);
+        sph1->materialType = DIFFUSE_AND_GLOSSY;
+        sph1->diffuseColor = Vector3f(0.6, 0.7, 0.8);
 
-    auto sph2 = std::make_unique<Sphere>(Vector3f(0.5, -0.5, -8), 1.5);
-    sph2->ior = 1.5;
-    sph2->materialType = REFLECTION_AND_REFRACTION;
+        auto sph2 = std::make_unique<Sphere>(Vector3f(0.5, -0.5, -8), 1.5);
+        sph2->ior = 1.5;
+        sph2->materialType = REFLECTION_AND_REFRACTION;
 
-    scene.Add(std::move(sph1));
-    scene.Add(std::move(sph2));
+        scene.Add(std::move(sph1));
+        scene.Add(std::move(sph2));
+    }
 
     Vector3f verts[4] = {{-5,-3,-6}, {5,-3,-6}, {5,-3,-16}, {-5,-3,-16}};
     uint32_t vertIndex[6] = {0, 1, 3, 1, 2, 3};
@@ -30,10 +97,21 @@ int main()
 
     scene.Add(std::move(mesh));
     scene.Add(std::make_unique<Light>(Vector3f(-20, 70, 20), 0.5));
-    scene.Add(std::make_unique<Light>(Vector3f(30, 50, -12), 0.5));    
+    scene.Add(std::make_unique<Light>(Vector3f(30, 50, -12), 0.5));
+    scene.buildBVH();
 
     Renderer r;
-    r.Render(scene);
+    if (!output.empty())
+        r.output = output;
+    try
+    {
+        r.Render(scene);
+    }
+    catch (const std::exception& e)
+    {
+        std::cerr << e.what() << '\n';
+        return 1;
+    }
 
     return 0;
 }
\ No newline at end of file
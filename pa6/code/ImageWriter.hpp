@@ -0,0 +1,81 @@
+#pragma once
+
+#include "Vector.hpp"
+#include <condition_variable>
+#include <cstdint>
+#include <cstdio>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+enum class ImageFormat
+{
+    PPM,
+    PNG,
+    PFM
+};
+
+// [comment]
+// Writes a framebuffer to an image file while it is still being rendered. The renderer reports
+// rows as they become final, in any order; a thread of the writer encodes them in order and
+// writes every run of them with one call, so little is left to do once the last pixel is done.
+//
+// The format follows the extension of the path:
+//   .ppm  binary PPM, 8 bits a channel
+//   .png  RGB PNG, 8 bits a channel, in uncompressed deflate blocks
+//   .pfm  PFM of the radiance itself, 32 bit floats neither clamped nor raised to the exponent
+// The 8 bit formats clamp every channel to [0, 1] and raise it to exponent before quantizing.
+// [/comment]
+class ImageWriter
+{
+public:
+    // Creates path and writes the header, throwing std::runtime_error if it cannot. The framebuffer
+    // holds width * height pixels, rows top to bottom, and must outlive the writer.
+    ImageWriter(const std::string& path, int width, int height, const Vector3f* framebuffer, float exponent = 1);
+    ~ImageWriter();
+
+    ImageWriter(const ImageWriter&) = delete;
+    ImageWriter& operator=(const ImageWriter&) = delete;
+
+    // Rows y0 to y1 - 1 of the framebuffer are final
+    void rowsDone(int y0, int y1);
+
+    // Waits until every row is written and closes the file. Throws std::logic_error if a row was
+    // never reported and std::runtime_error if writing failed.
+    void finish();
+
+    static ImageFormat formatOf(const std::string& path);
+
+private:
+    void run();
+    void writeHeader();
+    void writeRows(int y0, int y1);
+    void writeTrailer();
+    void quantizeRow(const Vector3f* row, unsigned char* out) const;
+    void writePNGChunk(const char* type, const unsigned char* data, size_t size);
+    void put(const void* data, size_t size);
+
+    std::string path;
+    ImageFormat format;
+    int width, height;
+    const Vector3f* framebuffer;
+    float exponent;
+    // For exponents other than 1: thresholds[k] is the least value that quantizes to k or more,
+    // with an infinite sentinel at 256, and bucketLevel[i] the level of i / (buckets - 1)
+    static constexpr int buckets = 4096;
+    float thresholds[257];
+    std::vector<unsigned char> bucketLevel;
+    FILE* file = nullptr;
+    bool failed = false;
+    long headerSize = 0;
+    uint32_t adler = 1;                 // of the PNG's uncompressed data so far
+    std::vector<unsigned char> bytes;   // encoding buffer of the writer thread
+
+    std::mutex mutex;
+    std::condition_variable wake;
+    std::vector<char> ready;            // per row, whether it was reported
+    int nextRow = 0;                    // first row not written yet
+    bool stopping = false;
+    std::thread writer;
+};
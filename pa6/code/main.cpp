@@ -8,7 +8,8 @@
 // In the main function of the program, we create the scene (create objects and
 // lights) as well as set the options for the render (image width and height,
 // maximum recursion depth, field-of-view, etc.). We then call the render
-// function().
+// function(). The image goes to the path given as the first argument,
+// binary.ppm by default.
 int main(int argc, char** argv)
 {
     Scene scene(1280, 960);
@@ -21,9 +22,19 @@ int main(int argc, char** argv)
     scene.buildBVH();
 
     Renderer r;
+    if (argc > 1)
+        r.output = argv[1];
 
     auto start = std::chrono::system_clock::now();
-    r.Render(scene);
+    try
+    {
+        r.Render(scene);
+    }
+    catch (const std::exception& e)
+    {
+        std::cerr << e.what() << '\n';
+        return 1;
+    }
     auto stop = std::chrono::system_clock::now();
 
     std::cout << "Render complete: \n";
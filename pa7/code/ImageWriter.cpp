@@ -0,0 +1,323 @@
+#include <algorithm>
+#include <cctype>
+#include <cmath>
+#include <cstring>
+#include <limits>
+#include <stdexcept>
+#include "ImageWriter.hpp"
+#include "global.hpp"
+
+static_assert(sizeof(Vector3f) == 3 * sizeof(float), "PFM rows are written straight from the framebuffer");
+
+// Largest stored deflate block
+constexpr size_t maxStoredBlock = 65535;
+
+static uint32_t crc32(uint32_t crc, const unsigned char* data, size_t size)
+{
+    static const std::vector<uint32_t> table = [] {
+        std::vector<uint32_t> t(256);
+        for (uint32_t n = 0; n < 256; ++n)
+        {
+            uint32_t c = n;
+            for (int k = 0; k < 8; ++k)
+                c = (c & 1) ? 0xedb88320u ^ (c >> 1) : c >> 1;
+            t[n] = c;
+        }
+        return t;
+    }();
+    crc = ~crc;
+    for (size_t i = 0; i < size; ++i)
+        crc = table[(crc ^ data[i]) & 0xff] ^ (crc >> 8);
+    return ~crc;
+}
+
+static uint32_t adler32(uint32_t adler, const unsigned char* data, size_t size)
+{
+    uint32_t a = adler & 0xffff, b = adler >> 16;
+    while (size > 0)
+    {
+        // The most bytes the sums take before they can overflow
+        size_t n = std::min<size_t>(size, 5552);
+        for (size_t i = 0; i < n; ++i)
+        {
+            a += data[i];
+            b += a;
+        }
+        a %= 65521;
+        b %= 65521;
+        data += n;
+        size -= n;
+    }
+    return (b << 16) | a;
+}
+
+static void putBigEndian(std::vector<unsigned char>& out, uint32_t v)
+{
+    unsigned char b[4] = {(unsigned char)(v >> 24), (unsigned char)(v >> 16), (unsigned char)(v >> 8),
+                          (unsigned char)v};
+    out.insert(out.end(), b, b + 4);
+}
+
+ImageFormat ImageWriter::formatOf(const std::string& path)
+{
+    auto dot = path.rfind('.');
+    std::string ext = dot == std::string::npos ? "" : path.substr(dot + 1);
+    std::transform(ext.begin(), ext.end(), ext.begin(), [](unsigned char c) { return char(std::tolower(c)); });
+    if (ext == "ppm")
+        return ImageFormat::PPM;
+    if (ext == "png")
+        return ImageFormat::PNG;
+    if (ext == "pfm")
+        return ImageFormat::PFM;
+    throw std::runtime_error("cannot tell the image format of " + path + ", use .ppm, .png or .pfm");
+}
+
+ImageWriter::ImageWriter(const std::string& path_, int width_, int height_, const Vector3f* framebuffer_,
+                         float exponent_)
+    : path(path_)
+    , format(formatOf(path_))
+    , width(width_)
+    , height(height_)
+    , framebuffer(framebuffer_)
+    , exponent(exponent_)
+    , ready(height_, 0)
+{
+    if (exponent != 1)
+    {
+        // What the 8 bit formats used to compute per channel, inverted once per level, so the
+        // levels come out the same without a pow per channel
+        auto level = [&](float v) { return int(255 * std::pow(v, exponent)); };
+        thresholds[0] = 0;
+        for (int k = 1; k < 256; ++k)
+        {
+            float v = std::pow(k / 255.f, 1 / exponent);
+            while (v > 0 && level(std::nextafter(v, 0.f)) >= k)
+                v = std::nextafter(v, 0.f);
+            while (level(v) < k)
+                v = std::nextafter(v, 2.f);
+            thresholds[k] = v;
+        }
+        thresholds[256] = std::numeric_limits<float>::infinity();
+
+        bucketLevel.resize(buckets);
+        for (int i = 0; i < buckets; ++i)
+        {
+            float v = i / float(buckets - 1);
+            bucketLevel[i] = (unsigned char)(std::upper_bound(thresholds + 1, thresholds + 256, v) - thresholds - 1);
+        }
+    }
+
+    file = fopen(path.c_str(), "wb");
+    if (!file)
+        throw std::runtime_error("cannot write " + path);
+    writeHeader();
+    writer = std::thread(&ImageWriter::run, this);
+}
+
+ImageWriter::~ImageWriter()
+{
+    if (writer.joinable())
+    {
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            stopping = true;
+        }
+        wake.notify_one();
+        writer.join();
+    }
+    if (file)
+        fclose(file);
+}
+
+void ImageWriter::rowsDone(int y0, int y1)
+{
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        std::fill(ready.begin() + y0, ready.begin() + y1, 1);
+    }
+    wake.notify_one();
+}
+
+void ImageWriter::finish()
+{
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        if (std::find(ready.begin(), ready.end(), 0) != ready.end())
+            throw std::logic_error("ImageWriter::finish() before every row of " + path + " was done");
+    }
+    writer.join();
+    writeTrailer();
+    if (fclose(file) != 0)
+        failed = true;
+    file = nullptr;
+    if (failed)
+        throw std::runtime_error("writing " + path + " failed");
+}
+
+void ImageWriter::run()
+{
+    std::unique_lock<std::mutex> lock(mutex);
+    while (nextRow < height)
+    {
+        wake.wait(lock, [&] { return stopping || ready[nextRow]; });
+        if (stopping)
+            return;
+        int y0 = nextRow, y1 = nextRow;
+        while (y1 < height && ready[y1])
+            ++y1;
+        lock.unlock();
+        writeRows(y0, y1);
+        lock.lock();
+        nextRow = y1;
+    }
+}
+
+void ImageWriter::put(const void* data, size_t size)
+{
+    if (!failed && fwrite(data, 1, size, file) != size)
+        failed = true;
+}
+
+void ImageWriter::writeHeader()
+{
+    char header[64];
+    int n = 0;
+    switch (format)
+    {
+    case ImageFormat::PPM:
+        n = snprintf(header, sizeof(header), "P6\n%d %d\n255\n", width, height);
+        put(header, size_t(n));
+        break;
+    case ImageFormat::PFM:
+    {
+        // A negative scale marks little endian floats
+        const uint16_t one = 1;
+        bool little = *reinterpret_cast<const unsigned char*>(&one) == 1;
+        n = snprintf(header, sizeof(header), "PF\n%d %d\n%s\n", width, height, little ? "-1.0" : "1.0");
+        put(header, size_t(n));
+        break;
+    }
+    case ImageFormat::PNG:
+    {
+        static const unsigned char signature[8] = {0x89, 'P', 'N', 'G', '\r', '\n', 0x1a, '\n'};
+        put(signature, sizeof(signature));
+        bytes.clear();
+        putBigEndian(bytes, uint32_t(width));
+        putBigEndian(bytes, uint32_t(height));
+        // 8 bits, RGB, deflate, adaptive filters, no interlace
+        const unsigned char rest[5] = {8, 2, 0, 0, 0};
+        bytes.insert(bytes.end(), rest, rest + 5);
+        writePNGChunk("IHDR", bytes.data(), bytes.size());
+        // The zlib header: deflate with a 32K window, no dictionary
+        const unsigned char zlib[2] = {0x78, 0x01};
+        writePNGChunk("IDAT", zlib, 2);
+        break;
+    }
+    }
+    headerSize = n;
+}
+
+// [comment]
+// Clamps and quantizes one row. With an exponent of 1 the level is the truncated product, a loop
+// the compiler vectorizes. Otherwise a table of the level at evenly spaced values gives a first
+// guess, mostly the level itself, and the thresholds on either side settle the rest: the same
+// level as the pow it replaces at a fraction of the cost.
+// [/comment]
+void ImageWriter::quantizeRow(const Vector3f* row, unsigned char* out) const
+{
+    const float* in = &row[0].x;
+    int n = 3 * width;
+    if (exponent == 1)
+    {
+        // Clamped after scaling, which comes to the same and is what vectorizes
+        for (int i = 0; i < n; ++i)
+            out[i] = (unsigned char)std::max(0.f, std::min(255.f, 255 * in[i]));
+        return;
+    }
+    for (int i = 0; i < n; ++i)
+    {
+        float v = clamp(0, 1, in[i]);
+        int k = bucketLevel[int(v * (buckets - 1))];
+        while (v < thresholds[k])
+            --k;
+        while (v >= thresholds[k + 1])
+            ++k;
+        out[i] = (unsigned char)k;
+    }
+}
+
+void ImageWriter::writeRows(int y0, int y1)
+{
+    size_t rowBytes = 3 * size_t(width);
+    switch (format)
+    {
+    case ImageFormat::PPM:
+        bytes.resize(rowBytes * (y1 - y0));
+        for (int y = y0; y < y1; ++y)
+            quantizeRow(framebuffer + size_t(y) * width, &bytes[rowBytes * (y - y0)]);
+        put(bytes.data(), bytes.size());
+        break;
+    case ImageFormat::PFM:
+    {
+        // Rows are stored bottom to top, so the run goes before the rows written already
+        std::vector<float> floats(3 * size_t(width) * (y1 - y0));
+        for (int y = y0; y < y1; ++y)
+            memcpy(&floats[3 * size_t(width) * (y1 - 1 - y)], framebuffer + size_t(y) * width,
+                   sizeof(float) * 3 * width);
+        if (!failed && fseek(file, headerSize + long(sizeof(float) * 3 * width) * (height - y1), SEEK_SET) != 0)
+            failed = true;
+        put(floats.data(), sizeof(float) * floats.size());
+        break;
+    }
+    case ImageFormat::PNG:
+    {
+        // Every row starts with its filter type, 0 for none
+        std::vector<unsigned char> raw((rowBytes + 1) * (y1 - y0));
+        for (int y = y0; y < y1; ++y)
+        {
+            unsigned char* out = &raw[(rowBytes + 1) * (y - y0)];
+            out[0] = 0;
+            quantizeRow(framebuffer + size_t(y) * width, out + 1);
+        }
+        adler = adler32(adler, raw.data(), raw.size());
+
+        bytes.clear();
+        for (size_t first = 0; first < raw.size(); first += maxStoredBlock)
+        {
+            size_t len = std::min(maxStoredBlock, raw.size() - first);
+            const unsigned char block[5] = {0, (unsigned char)len, (unsigned char)(len >> 8), (unsigned char)~len,
+                                            (unsigned char)(~len >> 8)};
+            bytes.insert(bytes.end(), block, block + 5);
+            bytes.insert(bytes.end(), raw.begin() + first, raw.begin() + first + len);
+        }
+        writePNGChunk("IDAT", bytes.data(), bytes.size());
+        break;
+    }
+    }
+}
+
+void ImageWriter::writeTrailer()
+{
+    if (format != ImageFormat::PNG)
+        return;
+    // An empty final block ends the deflate stream, then the checksum of the data
+    bytes = {1, 0, 0, 0xff, 0xff};
+    putBigEndian(bytes, adler);
+    writePNGChunk("IDAT", bytes.data(), bytes.size());
+    writePNGChunk("IEND", nullptr, 0);
+}
+
+void ImageWriter::writePNGChunk(const char* type, const unsigned char* data, size_t size)
+{
+    std::vector<unsigned char> head;
+    putBigEndian(head, uint32_t(size));
+    head.insert(head.end(), type, type + 4);
+    uint32_t crc = crc32(0, head.data() + 4, 4);
+    crc = crc32(crc, data, size);
+    put(head.data(), head.size());
+    if (size > 0)
+        put(data, size);
+    std::vector<unsigned char> tail;
+    putBigEndian(tail, crc);
+    put(tail.data(), tail.size());
+}
@@ -2,11 +2,13 @@
 // Created by goksu on 2/25/20.
 //
 
+#include <cassert>
 #include <fstream>
 #include <vector>
 #include <future>
 #include "Scene.hpp"
 #include "Renderer.hpp"
+#include "ImageWriter.hpp"
 
 
 inline float deg2rad(const float& deg) { return deg * M_PI / 180.0; }
@@ -26,6 +28,9 @@ void Renderer::Render(const Scene& scene)
     Vector3f eye_pos(278, 273, -800);
     int m = 0;
 
+    // Opened first so a bad path fails before the render; it is written as rows complete
+    ImageWriter image(output, scene.width, scene.height, framebuffer.data(), 0.6f);
+
     // change the spp value to change sample amount
     int spp = 16;
     int num_threads = 8;
@@ -55,19 +60,10 @@ void Renderer::Render(const Scene& scene)
             framebuffer[m] = pixel_color / spp;
             m++;
         }
+        image.rowsDone(j, j + 1);
         UpdateProgress(j / (float)scene.height);
     }
     UpdateProgress(1.f);
 
-    // save framebuffer to file
-    FILE* fp = fopen("binary.ppm", "wb");
-    (void)fprintf(fp, "P6\n%d %d\n255\n", scene.width, scene.height);
-    for (auto i = 0; i < scene.height * scene.width; ++i) {
-        static unsigned char color[3];
-        color[0] = (unsigned char)(255 * std::pow(clamp(0, 1, framebuffer[i].x), 0.6f));
-        color[1] = (unsigned char)(255 * std::pow(clamp(0, 1, framebuffer[i].y), 0.6f));
-        color[2] = (unsigned char)(255 * std::pow(clamp(0, 1, framebuffer[i].z), 0.6f));
-        fwrite(color, 1, 3, fp);
-    }
-    fclose(fp);    
+    image.finish();
 }
@@ -1,6 +1,7 @@
 //
 // Created by goksu on 2/25/20.
 //
+#include <string>
 #include "Scene.hpp"
 
 #pragma once
@@ -17,5 +18,7 @@ class Renderer
 public:
     void Render(const Scene& scene);
 
+    std::string output = "binary.ppm";  // .ppm, .png or .pfm, see ImageWriter
+
 private:
 };
@@ -18,45 +18,18 @@ public:
     float area;
     Sphere(const Vector3f &c, const float &r, Material* mt = new Material()) : center(c), radius(r), radius2(r * r), m(mt), area(4 * M_PI *r *r) {}
     bool intersect(const Ray& ray) {
-        // analytic solution
-        Vector3f L = ray.origin - center;
-        float a = dotProduct(ray.direction, ray.direction);
-        float b = 2 * dotProduct(ray.direction, L);
-        float c = dotProduct(L, L) - radius2;
-        float t0, t1;
-        float area = 4 * M_PI * radius2;
-        if (!solveQuadratic(a, b, c, t0, t1)) return false;
-        if (t0 < 0) t0 = t1;
-        if (t0 < 0) return false;
-        return true;
+        float t;
+        return hit(ray, t);
     }
     bool intersect(const Ray& ray, float &tnear, uint32_t &index) const
     {
-        // analytic solution
-        Vector3f L = ray.origin - center;
-        float a = dotProduct(ray.direction, ray.direction);
-        float b = 2 * dotProduct(ray.direction, L);
-        float c = dotProduct(L, L) - radius2;
-        float t0, t1;
-        if (!
-        solveQuadratic(a, b, c, t0, t1)) return false;
-        if (t0 < 0) t0 = t1;
-        if (t0 < 0) return false;
-        tnear = t0;
-
-        return true;
+        return hit(ray, tnear);
     }
     Intersection getIntersection(Ray ray){
         Intersection result;
         result.happened = false;
-        Vector3f L = ray.origin - center;
-        float a = dotProduct(ray.direction, ray.direction);
-        float b = 2 * dotProduct(ray.direction, L);
-        float c = dotProduct(L, L) - radius2;
-        float t0, t1;
-        if (!solveQuadratic(a, b, c, t0, t1)) return result;
-        if (t0 < 0) t0 = t1;
-        if (t0 < 0) return result;
+        float t0;
+        if (!hit(ray, t0)) return result;
 
         result.happened=true;
 
@@ -92,6 +65,28 @@ public:
     bool hasEmit(){
         return m->hasEmission();
     }
+
+private:
+    // Distance to the nearer hit in front of the ray origin, or the farther one from inside. The
+    // discriminant is taken in the geometric form (Ray Tracing Gems, ch. 7), r^2 minus the squared
+    // distance from the center to the ray, which keeps its precision where b^2 - 4ac cancels.
+    bool hit(const Ray& ray, float &tnear) const
+    {
+        Vector3f f = ray.origin - center;
+        float a = dotProduct(ray.direction, ray.direction);
+        float b = -dotProduct(f, ray.direction);
+        Vector3f l = f + ray.direction * (b / a);
+        float discr = radius2 - dotProduct(l, l);
+        if (discr < 0) return false;
+        float c = dotProduct(f, f) - radius2;
+        float q = b + std::copysign(std::sqrt(a * discr), b);
+        float t0 = c / q, t1 = q / a;
+        if (t0 > t1) std::swap(t0, t1);
+        if (t0 < 0) t0 = t1;
+        if (!(t0 >= 0)) return false;
+        tnear = t0;
+        return true;
+    }
 };
 
 
@@ -12,23 +12,6 @@ const float kInfinity = std::numeric_limits<float>::max();
 inline float clamp(const float &lo, const float &hi, const float &v)
 { return std::max(lo, std::min(hi, v)); }
 
-inline  bool solveQuadratic(const float &a, const float &b, const float &c, float &x0, float &x1)
-{
-    float eps = 3.0f;
-    float discr = b * b - 4 * a * c + eps;
-    if (discr < 0) return false;
-    else if (discr == 0) x0 = x1 = - 0.5 * b / a;
-    else {
-        float q = (b > 0) ?
-                  -0.5 * (b + sqrt(discr)) :
-                  -0.5 * (b - sqrt(discr));
-        x0 = q / a;
-        x1 = c / q;
-    }
-    if (x0 > x1) std::swap(x0, x1);
-    return true;
-}
-
 inline float get_random_float()
 {
     std::random_device dev;